@@ -0,0 +1,372 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "metrics.h"
+
+#define RINGSIZE	(1024 * 1024)	/* must be a power of two */
+#define BATCHSIZE	(64 * 1024)
+#define FLUSHINTERVAL	50		/* milliseconds */
+#define PADDING		0
+#define PEERMAX		64
+
+/*
+ * In daemon mode every worker hands its records to a writer thread through a
+ * single producer, single consumer ring. The worker only ever advances head
+ * and the writer only ever advances tail, so neither of them takes a lock.
+ * Records are kept in binary form; formatting them, resolving the peer
+ * address and writing them out is left to the writer, which collects all
+ * pending records into one write(2). If the ring is full the record is
+ * dropped and counted instead of waiting for the writer.
+ *
+ * A record never wraps around the end of the ring. If it does not fit into
+ * the rest, a length of PADDING tells the writer to continue at the start.
+ */
+struct record {
+	uint32_t len;
+	char type;
+	char status;
+	uint16_t selectorlen;
+	socklen_t peerlen;
+	uint64_t bytes;
+	uint64_t duration;
+	struct timespec time;
+	struct sockaddr_storage peer;
+	char selector[];
+};
+
+static const char *statusnames[] = {
+	[ACCESSLOG_OK] = "ok",
+	[ACCESSLOG_ERROR] = "error",
+	[ACCESSLOG_ABORTED] = "aborted",
+	[ACCESSLOG_TIMEOUT] = "timeout"
+};
+
+static bool enabled;
+static bool tosyslog;
+static int fd = -1;
+static char *ring;
+static char *batch;
+static uint64_t head;
+static uint64_t tail;
+static int stop;
+static pthread_t writer;
+static uint64_t dropped;
+
+static void fill(struct record *r, const struct accesslog_entry *entry,
+    size_t selectorlen);
+static size_t line_max(size_t selectorlen);
+static size_t format(char *line, const struct record *r);
+static void output(const char *lines, size_t len);
+static void *run_writer(void *arg);
+
+/*
+ * Opens the access log. target is either a file, which is appended to, or
+ * ACCESSLOG_SYSLOG. As every request gets its record, debug messages are no
+ * longer sent to the syslog from then on.
+ */
+void
+accesslog_open(const char *target)
+{
+	assert(target != NULL);
+
+	if (strcmp(target, ACCESSLOG_SYSLOG) == 0)
+		tosyslog = true;
+	else {
+		fd = open(target, O_WRONLY | O_APPEND | O_CREAT, 0644);
+		if (fd == -1) {
+			syslog(LOG_ERR, "open error: %m");
+			fprintf(stderr, "open %s: %s\n", target,
+			    strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	setlogmask(LOG_UPTO(LOG_INFO));
+	enabled = true;
+}
+
+bool
+accesslog_enabled(void)
+{
+	return (enabled);
+}
+
+/*
+ * Starts the writer thread of the calling process. Without it, records are
+ * written synchronously by accesslog_log().
+ */
+void
+accesslog_start(void)
+{
+	if (!enabled)
+		return;
+
+	ring = malloc(RINGSIZE);
+	batch = malloc(BATCHSIZE);
+	if (ring == NULL || batch == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		free(ring);
+		free(batch);
+		ring = NULL;
+		return;
+	}
+
+	/* Signals are left to the worker. */
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int ret = pthread_create(&writer, NULL, &run_writer, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (ret != 0) {
+		syslog(LOG_ERR, "pthread_create error: %s", strerror(ret));
+		free(ring);
+		free(batch);
+		ring = NULL;
+	}
+}
+
+void
+accesslog_log(const struct accesslog_entry *entry)
+{
+	assert(entry != NULL);
+	assert(entry->selector != NULL);
+
+	if (!enabled)
+		return;
+
+	size_t selectorlen = strlen(entry->selector);
+	if (selectorlen > LINE_MAX)
+		selectorlen = LINE_MAX;
+	size_t need = offsetof(struct record, selector) + selectorlen;
+	need = (need + 7) & ~(size_t)7;
+
+	if (ring == NULL) {
+		struct record *r = malloc(need);
+		char *line = (r == NULL) ? NULL : malloc(line_max(selectorlen));
+		if (line == NULL) {
+			syslog(LOG_ERR, "malloc error: %m");
+			free(r);
+			return;
+		}
+		fill(r, entry, selectorlen);
+		output(line, format(line, r));
+		free(line);
+		free(r);
+		return;
+	}
+
+	uint64_t h = head;
+	size_t contiguous = RINGSIZE - (h & (RINGSIZE - 1));
+	size_t skip = (contiguous < need) ? contiguous : 0;
+	if (h + skip + need - __atomic_load_n(&tail, __ATOMIC_ACQUIRE) >
+	    RINGSIZE) {
+		dropped++;
+		metrics_count(METRICS_ACCESSLOG_DROPPED, 1);
+		return;
+	}
+	if (skip > 0) {
+		*(uint32_t *)(ring + (h & (RINGSIZE - 1))) = PADDING;
+		h += skip;
+	}
+
+	fill((struct record *)(ring + (h & (RINGSIZE - 1))), entry,
+	    selectorlen);
+	__atomic_store_n(&head, h + need, __ATOMIC_RELEASE);
+}
+
+/*
+ * Writes the pending records and stops the writer thread.
+ */
+void
+accesslog_close(void)
+{
+	if (ring != NULL) {
+		__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+		pthread_join(writer, NULL);
+		free(ring);
+		free(batch);
+		ring = NULL;
+	}
+	if (dropped > 0)
+		syslog(LOG_NOTICE, "dropped %" PRIu64 " access log records",
+		    dropped);
+	if (fd != -1) {
+		close(fd);
+		fd = -1;
+	}
+	enabled = false;
+}
+
+static void
+fill(struct record *r, const struct accesslog_entry *entry,
+    size_t selectorlen)
+{
+	assert(r != NULL);
+	assert(entry != NULL);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t usec = (int64_t)(now.tv_sec - entry->start.tv_sec) * 1000000 +
+	    (now.tv_nsec - entry->start.tv_nsec) / 1000;
+
+	r->len = (offsetof(struct record, selector) + selectorlen + 7) &
+	    ~(size_t)7;
+	r->type = entry->type;
+	r->status = entry->status;
+	r->selectorlen = selectorlen;
+	r->peerlen = 0;
+	if (entry->peer != NULL && entry->peerlen <= sizeof(r->peer)) {
+		memcpy(&r->peer, entry->peer, entry->peerlen);
+		r->peerlen = entry->peerlen;
+	}
+	r->bytes = entry->bytes;
+	r->duration = (usec < 0) ? 0 : usec;
+	clock_gettime(CLOCK_REALTIME, &r->time);
+	memcpy(r->selector, entry->selector, selectorlen);
+}
+
+static size_t
+line_max(size_t selectorlen)
+{
+	return (128 + PEERMAX + 4 * selectorlen);
+}
+
+/*
+ * Formats a record as one line of tab separated fields: time, peer, item
+ * type, status, bytes sent, duration in microseconds and the selector with
+ * control characters and backslashes escaped.
+ */
+static size_t
+format(char *line, const struct record *r)
+{
+	assert(line != NULL);
+	assert(r != NULL);
+
+	char peer[PEERMAX] = "-";
+	if (r->peerlen > 0 && getnameinfo((const struct sockaddr *)&r->peer,
+	    r->peerlen, peer, sizeof(peer), NULL, 0, NI_NUMERICHOST) != 0)
+		strcpy(peer, "-");
+
+	struct tm tm;
+	char stamp[32];
+	gmtime_r(&r->time.tv_sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	int n = sprintf(line, "%s.%03ldZ\t%s\t%c\t%s\t%" PRIu64 "\t%" PRIu64
+	    "\t", stamp, r->time.tv_nsec / 1000000, peer,
+	    r->type != '\0' ? r->type : '-', statusnames[(int)r->status],
+	    r->bytes, r->duration);
+
+	char *p = line + n;
+	for (size_t i = 0; i < r->selectorlen; i++) {
+		unsigned char c = r->selector[i];
+		if (c < 0x20 || c == 0x7f || c == '\\')
+			p += sprintf(p, "\\x%02x", c);
+		else
+			*p++ = c;
+	}
+	*p++ = '\n';
+
+	return (p - line);
+}
+
+static void
+output(const char *lines, size_t len)
+{
+	assert(lines != NULL);
+
+	if (tosyslog) {
+		while (len > 0) {
+			const char *lf = memchr(lines, '\n', len);
+			size_t l = lf - lines;
+			syslog(LOG_INFO, "%.*s", (int)l, lines);
+			lines += l + 1;
+			len -= l + 1;
+		}
+		return;
+	}
+
+	while (len > 0) {
+		ssize_t w = write(fd, lines, len);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "access log write error: %m");
+			return;
+		}
+		lines += w;
+		len -= w;
+	}
+}
+
+static void *
+run_writer(void *arg)
+{
+	(void)arg;
+
+	for (;;) {
+		/* Anything logged before stop was set is written out. */
+		int stopping = __atomic_load_n(&stop, __ATOMIC_ACQUIRE);
+		uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+		uint64_t t = tail;
+
+		size_t used = 0;
+		while (t < h) {
+			size_t offset = t & (RINGSIZE - 1);
+			const struct record *r = (void *)(ring + offset);
+			if (r->len == PADDING) {
+				t += RINGSIZE - offset;
+				continue;
+			}
+			if (BATCHSIZE - used < line_max(r->selectorlen)) {
+				output(batch, used);
+				used = 0;
+			}
+			used += format(batch + used, r);
+			t += r->len;
+			__atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+		}
+		__atomic_store_n(&tail, t, __ATOMIC_RELEASE);
+		if (used > 0)
+			output(batch, used);
+
+		if (stopping)
+			break;
+
+		struct timespec interval = {
+			.tv_sec = 0,
+			.tv_nsec = FLUSHINTERVAL * 1000000L
+		};
+		nanosleep(&interval, NULL);
+	}
+
+	return (NULL);
+}
@@ -0,0 +1,50 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * The target naming the syslog instead of a file.
+ */
+#define ACCESSLOG_SYSLOG	"syslog"
+
+enum accesslog_status {
+	ACCESSLOG_OK,		/* the item has been sent */
+	ACCESSLOG_ERROR,	/* an error message has been sent */
+	ACCESSLOG_ABORTED,	/* the connection failed */
+	ACCESSLOG_TIMEOUT	/* the client missed a deadline */
+};
+
+/*
+ * One request. start is taken from CLOCK_MONOTONIC when the request arrived,
+ * peer may be NULL. A type of '\0' means the request never got that far.
+ */
+struct accesslog_entry {
+	struct timespec start;
+	const struct sockaddr *peer;
+	socklen_t peerlen;
+	const char *selector;
+	char type;
+	enum accesslog_status status;
+	uint64_t bytes;
+};
+
+void accesslog_open(const char *_target);
+bool accesslog_enabled(void);
+void accesslog_start(void);
+void accesslog_log(const struct accesslog_entry *_entry);
+void accesslog_close(void);
+
+#endif /* !ACCESSLOG_H */
@@ -0,0 +1,168 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "arena.h"
+
+#define CHUNKSIZE	(64 * 1024)
+#define ALIGNMENT	16
+#define HEADERSIZE	((sizeof(struct chunk) + ALIGNMENT - 1) & \
+			    ~(size_t)(ALIGNMENT - 1))
+
+/*
+ * A bump allocator for everything that lives as long as a single request.
+ * Memory is handed out from a list of chunks and released all at once by
+ * arena_reset(), which keeps the first chunk for the next request.
+ */
+struct chunk {
+	struct chunk *prev;
+	size_t size;
+	size_t used;
+	/* data follows */
+};
+
+struct arena {
+	struct chunk *current;
+	struct chunk *first;
+};
+
+static struct chunk *new_chunk(size_t size);
+
+struct arena *
+arena_new(void)
+{
+	struct arena *arena = malloc(sizeof(struct arena));
+	if (arena == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		return (NULL);
+	}
+
+	arena->first = arena->current = new_chunk(CHUNKSIZE);
+	if (arena->first == NULL) {
+		free(arena);
+		return (NULL);
+	}
+
+	return (arena);
+}
+
+void
+arena_free(struct arena *arena)
+{
+	assert(arena != NULL);
+
+	arena_reset(arena);
+	free(arena->first);
+	free(arena);
+}
+
+/*
+ * Returns NULL if no memory is left, like malloc(3).
+ */
+void *
+arena_alloc(struct arena *arena, size_t size)
+{
+	assert(arena != NULL);
+
+	size = (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+
+	struct chunk *c = arena->current;
+	if (c->size - c->used < size) {
+		c = new_chunk(size > CHUNKSIZE ? size : CHUNKSIZE);
+		if (c == NULL)
+			return (NULL);
+		c->prev = arena->current;
+		arena->current = c;
+	}
+
+	void *p = (char *)c + HEADERSIZE + c->used;
+	c->used += size;
+
+	return (p);
+}
+
+char *
+arena_strndup(struct arena *arena, const char *s, size_t n)
+{
+	assert(arena != NULL);
+	assert(s != NULL);
+
+	size_t l = strnlen(s, n);
+	char *d = arena_alloc(arena, l + 1);
+	if (d == NULL)
+		return (NULL);
+	memcpy(d, s, l);
+	d[l] = '\0';
+
+	return (d);
+}
+
+/*
+ * A mark remembers the current fill level, so short lived allocations, e.g.
+ * the ones made for a single menu item, can be released by arena_rewind().
+ */
+struct arena_mark
+arena_mark(struct arena *arena)
+{
+	assert(arena != NULL);
+
+	struct arena_mark mark = {
+		.chunk = arena->current,
+		.used = arena->current->used
+	};
+
+	return (mark);
+}
+
+void
+arena_rewind(struct arena *arena, struct arena_mark mark)
+{
+	assert(arena != NULL);
+	assert(mark.chunk != NULL);
+
+	while (arena->current != mark.chunk) {
+		struct chunk *c = arena->current;
+		assert(c != arena->first);
+		arena->current = c->prev;
+		free(c);
+	}
+	arena->current->used = mark.used;
+}
+
+void
+arena_reset(struct arena *arena)
+{
+	assert(arena != NULL);
+
+	struct arena_mark mark = {
+		.chunk = arena->first,
+		.used = 0
+	};
+	arena_rewind(arena, mark);
+}
+
+static struct chunk *
+new_chunk(size_t size)
+{
+	struct chunk *c = malloc(HEADERSIZE + size);
+	if (c == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		return (NULL);
+	}
+	c->prev = NULL;
+	c->size = size;
+	c->used = 0;
+
+	return (c);
+}
@@ -0,0 +1,28 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+struct arena;
+
+struct arena_mark {
+	void *chunk;
+	size_t used;
+};
+
+struct arena *arena_new(void);
+void arena_free(struct arena *_arena);
+void *arena_alloc(struct arena *_arena, size_t _size);
+char *arena_strndup(struct arena *_arena, const char *_s, size_t _n);
+struct arena_mark arena_mark(struct arena *_arena);
+void arena_rewind(struct arena *_arena, struct arena_mark _mark);
+void arena_reset(struct arena *_arena);
+
+#endif /* !ARENA_H */
@@ -0,0 +1,65 @@
+#!/bin/sh
+#
+# "THE BEER-WARE LICENSE" (Revision 42):
+# <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+# you can do whatever you want with this stuff. If we meet some day, and you
+# think this stuff is worth it, you can buy me a beer in return.
+#
+# Generates a synthetic gopher hole for the benchmarks:
+#
+#	deep/		a directory chain DEPTH levels deep
+#	flat/		a single directory holding FLAT small text files
+#	map/		a directory with a gophermap of MAPLINES lines
+#	small.txt	a short text file
+#	large.txt	a text file of about LARGE megabytes
+#	large.bin	a binary file of LARGE megabytes
+
+set -e
+
+if [ $# -ne 1 ]; then
+	echo "Usage: corpus.sh directory" >&2
+	exit 1
+fi
+
+DIR=$1
+DEPTH=${DEPTH:-32}
+FLAT=${FLAT:-5000}
+MAPLINES=${MAPLINES:-10000}
+LARGE=${LARGE:-64}
+
+mkdir -p "$DIR"
+cd "$DIR"
+
+awk 'BEGIN { for (i = 0; i < 20; i++) print "Lorem ipsum dolor sit amet." }' \
+    > small.txt
+
+awk -v mb="$LARGE" 'BEGIN {
+	line = "The quick brown fox jumps over the lazy dog, again and again."
+	n = mb * 1024 * 1024 / (length(line) + 1)
+	for (i = 0; i < n; i++)
+		print i ": " line
+}' > large.txt
+
+dd if=/dev/urandom of=large.bin bs=1048576 count="$LARGE" 2> /dev/null
+
+p=deep
+for i in $(awk -v n="$DEPTH" 'BEGIN { for (i = 0; i < n; i++) print i }'); do
+	p=$p/d$i
+done
+mkdir -p "$p"
+echo "bottom" > "$p/bottom.txt"
+
+mkdir -p flat
+awk -v n="$FLAT" 'BEGIN {
+	for (i = 0; i < n; i++) {
+		f = sprintf("flat/f%06d.txt", i)
+		print "file " i > f
+		close(f)
+	}
+}'
+
+mkdir -p map
+awk -v n="$MAPLINES" 'BEGIN {
+	for (i = 0; i < n; i++)
+		printf("0Entry %d\t/small.txt\n1Link %d\t/flat\n", i, i)
+}' > map/gophermap
@@ -0,0 +1,355 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A gopher load generator. It keeps a number of connections busy, each
+ * sending one selector, reading the response until the server closes the
+ * connection and starting over, until the requested number of requests is
+ * done. The result is printed as a single JSON object.
+ */
+
+#define MAXEVENTS	64
+#define BUFSIZE		(64 * 1024)
+
+enum state {
+	CONNECTING,
+	WRITING,
+	READING
+};
+
+struct client {
+	enum state state;
+	int fd;
+	const char *selector;
+	size_t sent;
+	size_t bytes;
+	char first;
+	struct timespec start;
+};
+
+static const char *name = "default";
+static const char **selectors;
+static size_t nselectors;
+static struct addrinfo *address;
+static size_t issued;
+static size_t completed;
+static size_t errors;
+static uint64_t bytes;
+static uint64_t *latencies;
+
+static void usage(void);
+static bool start(int ep, struct client *c, size_t requests);
+static void handle(int ep, struct client *c, uint32_t events,
+    size_t requests);
+static void finish(int ep, struct client *c, bool success,
+    size_t requests);
+static uint64_t elapsed(const struct timespec *from);
+static int compare(const void *a, const void *b);
+static double percentile(double p);
+
+int
+main(int argc, char **argv)
+{
+	const char *host = "127.0.0.1";
+	const char *port = "70";
+	long connections = 16;
+	long requests = 10000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "H:p:c:n:s:N:h")) != -1) {
+		switch (opt) {
+		case 'H':
+			host = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'c':
+			connections = strtol(optarg, NULL, 10);
+			break;
+		case 'n':
+			requests = strtol(optarg, NULL, 10);
+			break;
+		case 's': {
+			const char **s = realloc(selectors,
+			    (nselectors + 1) * sizeof(*selectors));
+			if (s == NULL) {
+				perror("realloc");
+				exit(EXIT_FAILURE);
+			}
+			selectors = s;
+			selectors[nselectors++] = optarg;
+			break;
+		}
+		case 'N':
+			name = optarg;
+			break;
+		case 'h':
+		default:
+			usage();
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+	if (connections < 1 || requests < 1) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+	if (nselectors == 0) {
+		static const char *root[] = { "" };
+		selectors = root;
+		nselectors = 1;
+	}
+	if (connections > requests)
+		connections = requests;
+
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM
+	};
+	int ret = getaddrinfo(host, port, &hints, &address);
+	if (ret != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	latencies = calloc(requests, sizeof(uint64_t));
+	struct client *clients = calloc(connections, sizeof(struct client));
+	if (latencies == NULL || clients == NULL) {
+		perror("calloc");
+		exit(EXIT_FAILURE);
+	}
+
+	int ep = epoll_create1(0);
+	if (ep == -1) {
+		perror("epoll_create1");
+		exit(EXIT_FAILURE);
+	}
+
+	struct timespec begin;
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+
+	for (long i = 0; i < connections; i++)
+		if (!start(ep, &clients[i], requests))
+			exit(EXIT_FAILURE);
+
+	while (completed < (size_t)requests) {
+		struct epoll_event events[MAXEVENTS];
+		int n = epoll_wait(ep, events, MAXEVENTS, -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(EXIT_FAILURE);
+		}
+		for (int i = 0; i < n; i++)
+			handle(ep, events[i].data.ptr, events[i].events,
+			    requests);
+	}
+
+	double seconds = elapsed(&begin) / 1e6;
+	qsort(latencies, completed, sizeof(uint64_t), &compare);
+
+	printf("{\"scenario\":\"%s\",\"connections\":%ld,\"requests\":%zu,"
+	    "\"errors\":%zu,\"seconds\":%.3f,\"requests_per_s\":%.1f,"
+	    "\"bytes_per_s\":%.0f,\"p50_us\":%.0f,\"p99_us\":%.0f,"
+	    "\"p999_us\":%.0f}\n", name, connections, completed, errors,
+	    seconds, completed / seconds, bytes / seconds, percentile(0.5),
+	    percentile(0.99), percentile(0.999));
+
+	close(ep);
+	freeaddrinfo(address);
+	free(clients);
+	free(latencies);
+
+	return (errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void
+usage(void)
+{
+	fputs("Usage: loadgen [-c connections] [-n requests] [-N name] "
+	    "[-s selector ...]\n", stderr);
+	fputs("               [-H host] [-p port]\n", stderr);
+}
+
+/*
+ * Opens a new connection on c for the next request.
+ */
+static bool
+start(int ep, struct client *c, size_t requests)
+{
+	assert(c != NULL);
+
+	if (issued == requests)
+		return (true);
+
+	c->fd = socket(address->ai_family, address->ai_socktype,
+	    address->ai_protocol);
+	if (c->fd == -1) {
+		perror("socket");
+		return (false);
+	}
+	int flags = fcntl(c->fd, F_GETFL);
+	fcntl(c->fd, F_SETFL, flags | O_NONBLOCK);
+
+	c->selector = selectors[issued % nselectors];
+	c->sent = 0;
+	c->bytes = 0;
+	c->first = '\0';
+	clock_gettime(CLOCK_MONOTONIC, &c->start);
+	issued++;
+
+	c->state = WRITING;
+	if (connect(c->fd, address->ai_addr, address->ai_addrlen) == -1) {
+		if (errno != EINPROGRESS) {
+			perror("connect");
+			return (false);
+		}
+		c->state = CONNECTING;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLOUT,
+		.data.ptr = c
+	};
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+		perror("epoll_ctl");
+		return (false);
+	}
+
+	return (true);
+}
+
+static void
+handle(int ep, struct client *c, uint32_t events, size_t requests)
+{
+	assert(c != NULL);
+
+	if (c->state == CONNECTING) {
+		int error = 0;
+		socklen_t len = sizeof(error);
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+		if (error != 0) {
+			finish(ep, c, false, requests);
+			return;
+		}
+		c->state = WRITING;
+	}
+
+	if (c->state == WRITING) {
+		char request[1024];
+		int l = snprintf(request, sizeof(request), "%s\r\n",
+		    c->selector);
+		ssize_t w = write(c->fd, request + c->sent, l - c->sent);
+		if (w == -1) {
+			if (errno != EAGAIN && errno != EINTR)
+				finish(ep, c, false, requests);
+			return;
+		}
+		c->sent += w;
+		if (c->sent < (size_t)l)
+			return;
+
+		c->state = READING;
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = c
+		};
+		epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+		return;
+	}
+
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	static char buf[BUFSIZE];
+	for (;;) {
+		ssize_t r = read(c->fd, buf, sizeof(buf));
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				finish(ep, c, false, requests);
+			return;
+		}
+		if (r == 0)
+			break;
+		if (c->bytes == 0)
+			c->first = buf[0];
+		c->bytes += r;
+	}
+
+	/* An empty response or an error item counts as failure. */
+	finish(ep, c, c->bytes > 0 && c->first != '3', requests);
+}
+
+static void
+finish(int ep, struct client *c, bool success, size_t requests)
+{
+	assert(c != NULL);
+
+	close(c->fd);
+	latencies[completed++] = elapsed(&c->start);
+	bytes += c->bytes;
+	if (!success)
+		errors++;
+
+	if (!start(ep, c, requests))
+		exit(EXIT_FAILURE);
+}
+
+static uint64_t
+elapsed(const struct timespec *from)
+{
+	assert(from != NULL);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((now.tv_sec - from->tv_sec) * 1000000 +
+	    (now.tv_nsec - from->tv_nsec) / 1000);
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static double
+percentile(double p)
+{
+	if (completed == 0)
+		return (0);
+
+	size_t i = (size_t)(p * completed);
+	if (i >= completed)
+		i = completed - 1;
+
+	return (latencies[i]);
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+#
+# "THE BEER-WARE LICENSE" (Revision 42):
+# <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+# you can do whatever you want with this stuff. If we meet some day, and you
+# think this stuff is worth it, you can buy me a beer in return.
+#
+# Runs every scenario against mgopherd, once spawned per connection as from
+# inetd and once as standalone daemon, and prints one JSON object per
+# scenario. The corpus is generated on first use.
+#
+# Environment: CORPUS (corpus directory), PORT (default 7070), CONNS
+# (concurrent connections, default 16), REQUESTS (requests per small
+# scenario, default 2000), WORKERS (daemon workers, default 4).
+
+set -e
+
+BENCH=$(cd "$(dirname "$0")" && pwd)
+TOP=$(dirname "$BENCH")
+CORPUS=${CORPUS:-$BENCH/corpus}
+PORT=${PORT:-7070}
+CONNS=${CONNS:-16}
+REQUESTS=${REQUESTS:-2000}
+WORKERS=${WORKERS:-4}
+
+[ -d "$CORPUS" ] || "$BENCH/corpus.sh" "$CORPUS"
+CORPUS=$(cd "$CORPUS" && pwd)
+DEEP=/$(cd "$CORPUS" && find deep -type d | awk '{ print length, $0 }' |
+    sort -n | tail -n 1 | cut -d ' ' -f 2)
+
+status=0
+server=
+
+start() {
+	"$@" &
+	server=$!
+	sleep 1
+}
+
+stop() {
+	kill "$server"
+	wait "$server" 2> /dev/null || true
+}
+
+scenarios() {
+	mode=$1
+	for s in "small 1 /small.txt" "flat-menu 100 /flat" \
+	    "deep-menu 1 $DEEP" "gophermap 10 /map" \
+	    "large-text 100 /large.txt" "large-bin 100 /large.bin"; do
+		set -- $s
+		n=$((REQUESTS / $2))
+		[ "$n" -ge 1 ] || n=1
+		c=$CONNS
+		[ "$c" -le "$n" ] || c=$n
+		"$BENCH/loadgen" -p "$PORT" -c "$c" -n "$n" -N "$mode/$1" \
+		    -s "$3" || status=1
+	done
+}
+
+start "$BENCH/spawn" "$PORT" "$TOP/mgopherd" -r "$CORPUS" -H localhost \
+    -p "$PORT"
+scenarios inetd
+stop
+
+start "$TOP/mgopherd" -d -w "$WORKERS" -r "$CORPUS" -H localhost -p "$PORT"
+scenarios daemon
+stop
+
+exit $status
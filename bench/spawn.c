@@ -0,0 +1,91 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * A minimal inetd stand-in: listens on a port and runs the given command for
+ * every connection with the socket as its standard input and output, just
+ * like an inetd "nowait" service.
+ */
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 3) {
+		fputs("Usage: spawn port command [argument ...]\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sa.sa_flags = SA_NOCLDWAIT;
+	sigaction(SIGCHLD, &sa, NULL);
+
+	struct addrinfo hints = {
+		.ai_family = AF_INET,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE
+	};
+	struct addrinfo *ai;
+	int ret = getaddrinfo("127.0.0.1", argv[1], &hints, &ai);
+	if (ret != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	int s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+	int on = 1;
+	if (s == -1 ||
+	    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == -1 ||
+	    bind(s, ai->ai_addr, ai->ai_addrlen) == -1 ||
+	    listen(s, SOMAXCONN) == -1) {
+		perror("listen");
+		exit(EXIT_FAILURE);
+	}
+	freeaddrinfo(ai);
+
+	for (;;) {
+		int c = accept(s, NULL, NULL);
+		if (c == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			exit(EXIT_FAILURE);
+		}
+
+		switch (fork()) {
+		case -1:
+			perror("fork");
+			break;
+		case 0:
+			close(s);
+			if (dup2(c, STDIN_FILENO) == -1 ||
+			    dup2(c, STDOUT_FILENO) == -1)
+				_exit(EXIT_FAILURE);
+			close(c);
+			execv(argv[2], argv + 2);
+			perror("execv");
+			_exit(EXIT_FAILURE);
+		default:
+			break;
+		}
+		close(c);
+	}
+}
@@ -0,0 +1,301 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+
+#include "classify.h"
+#include "itemtypes.h"
+
+#define DEFAULTPRIORITY	1
+#define MAXKEY		128
+
+/*
+ * Rules map file name extensions or MIME types to item types. MIME rules
+ * either match a type exactly ("text/html") or every subtype of a media type
+ * if the subtype is an asterisk. If several rules match, the one with the
+ * highest priority wins, exact MIME rules beat wildcard ones with the same
+ * priority. Both sets of rules are compiled into open addressing hash
+ * tables.
+ */
+struct rule {
+	char *key;
+	char type;
+	int priority;
+};
+
+struct table {
+	struct rule *rules;
+	size_t size;
+	size_t used;
+};
+
+static const struct {
+	const char *mime;
+	char type;
+} defaults[] = {
+	{ "text/html",			IT_HTML },
+	{ "text/*",			IT_FILE },
+	{ "image/gif",			IT_GIF },
+	{ "image/*",			IT_IMAGE },
+	{ "audio/*",			IT_AUDIO },
+	{ "application/ogg",		IT_AUDIO },
+	{ "application/x-bzip2",	IT_ARCHIVE },
+	{ "application/x-gzip",		IT_ARCHIVE },
+	{ "application/zip",		IT_ARCHIVE }
+};
+
+static struct table extensions;
+static struct table mimetypes;
+
+static void add_rule(struct table *table, const char *key, char type,
+    int priority);
+static const struct rule *find_rule(const struct table *table,
+    const char *key);
+static uint32_t hash(const char *key);
+static bool valid_type(char type);
+
+/*
+ * Compiles the built-in rules and, if typemap is not NULL, the rules of the
+ * given file. Every non-empty line of a typemap not starting with '#' reads
+ *
+ *     ext|mime key type [priority]
+ */
+void
+classify_load(const char *typemap)
+{
+	for (size_t i = 0; i < sizeof(defaults) / sizeof(defaults[0]); i++)
+		add_rule(&mimetypes, defaults[i].mime, defaults[i].type, 0);
+
+	if (typemap == NULL)
+		return;
+
+	FILE *in = fopen(typemap, "r");
+	if (in == NULL) {
+		syslog(LOG_ERR, "fopen error: %m");
+		fprintf(stderr, "fopen %s: %s\n", typemap, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	char line[LINE_MAX];
+	int lineno = 0;
+	while (fgets(line, sizeof(line), in) != NULL) {
+		lineno++;
+
+		char kind[8] = "", key[MAXKEY], type[2];
+		int priority = DEFAULTPRIORITY;
+		char *p = line + strspn(line, " \t");
+		if (*p == '#' || *p == '\n' || *p == '\0')
+			continue;
+
+		int n = sscanf(p, "%7s %127s %1s %d", kind, key, type,
+		    &priority);
+		bool isext = (strcmp(kind, "ext") == 0);
+		if (n < 3 || (!isext && strcmp(kind, "mime") != 0) ||
+		    !valid_type(*type)) {
+			syslog(LOG_ERR, "%s:%d: malformed rule", typemap,
+			    lineno);
+			fprintf(stderr, "%s:%d: malformed rule\n", typemap,
+			    lineno);
+			exit(EXIT_FAILURE);
+		}
+
+		if (isext) {
+			char *k = (*key == '.') ? key + 1 : key;
+			for (char *c = k; *c != '\0'; c++)
+				*c = tolower((unsigned char)*c);
+			add_rule(&extensions, k, *type, priority);
+		} else
+			add_rule(&mimetypes, key, *type, priority);
+	}
+	if (ferror(in)) {
+		syslog(LOG_ERR, "fgets error: %m");
+		fprintf(stderr, "fgets %s: %s\n", typemap, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	fclose(in);
+
+	syslog(LOG_DEBUG, "typemap: %zu extension and %zu mime rules",
+	    extensions.used, mimetypes.used);
+}
+
+/*
+ * Returns the item type for the extension of the file name, trying the
+ * longest extension ("tar.gz") first, or '\0' if no rule is decisive and
+ * the content has to be sniffed.
+ */
+char
+classify_extension(const char *name)
+{
+	assert(name != NULL);
+
+	if (extensions.used == 0)
+		return ('\0');
+
+	const char *base = strrchr(name, '/');
+	base = (base == NULL) ? name : base + 1;
+
+	for (const char *dot = strchr(base + 1, '.'); dot != NULL;
+	    dot = strchr(dot + 1, '.')) {
+		char key[MAXKEY];
+		size_t l = strlen(dot + 1);
+		if (l == 0 || l >= sizeof(key))
+			continue;
+		for (size_t i = 0; i <= l; i++)
+			key[i] = tolower((unsigned char)dot[1 + i]);
+
+		const struct rule *r = find_rule(&extensions, key);
+		if (r != NULL)
+			return (r->type);
+	}
+
+	return ('\0');
+}
+
+char
+classify_mime(const char *mime)
+{
+	assert(mime != NULL);
+
+	const struct rule *exact = find_rule(&mimetypes, mime);
+
+	const struct rule *wildcard = NULL;
+	const char *slash = strchr(mime, '/');
+	if (slash != NULL && (size_t)(slash - mime) + 3 <= MAXKEY) {
+		char key[MAXKEY];
+		size_t l = slash - mime + 1;
+		memcpy(key, mime, l);
+		key[l] = '*';
+		key[l + 1] = '\0';
+		wildcard = find_rule(&mimetypes, key);
+	}
+
+	if (exact != NULL && (wildcard == NULL ||
+	    exact->priority >= wildcard->priority))
+		return (exact->type);
+	if (wildcard != NULL)
+		return (wildcard->type);
+
+	return (IT_BINARY);
+}
+
+static void
+add_rule(struct table *table, const char *key, char type, int priority)
+{
+	assert(table != NULL);
+	assert(key != NULL);
+
+	if ((table->used + 1) * 2 > table->size) {
+		struct table grown = {
+			.size = (table->size == 0) ? 64 : table->size * 2,
+			.used = 0
+		};
+		grown.rules = calloc(grown.size, sizeof(struct rule));
+		if (grown.rules == NULL) {
+			syslog(LOG_ERR, "calloc error: %m");
+			fprintf(stderr, "calloc rules: %s\n", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		for (size_t i = 0; i < table->size; i++) {
+			struct rule *r = &table->rules[i];
+			if (r->key == NULL)
+				continue;
+			size_t j = hash(r->key) & (grown.size - 1);
+			while (grown.rules[j].key != NULL)
+				j = (j + 1) & (grown.size - 1);
+			grown.rules[j] = *r;
+			grown.used++;
+		}
+		free(table->rules);
+		*table = grown;
+	}
+
+	size_t i = hash(key) & (table->size - 1);
+	while (table->rules[i].key != NULL) {
+		struct rule *r = &table->rules[i];
+		if (strcmp(r->key, key) == 0) {
+			/* Later rules win over earlier ones of equal rank. */
+			if (priority >= r->priority) {
+				r->type = type;
+				r->priority = priority;
+			}
+			return;
+		}
+		i = (i + 1) & (table->size - 1);
+	}
+
+	table->rules[i].key = strdup(key);
+	if (table->rules[i].key == NULL) {
+		syslog(LOG_ERR, "strdup error: %m");
+		fprintf(stderr, "strdup rule: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	table->rules[i].type = type;
+	table->rules[i].priority = priority;
+	table->used++;
+}
+
+static const struct rule *
+find_rule(const struct table *table, const char *key)
+{
+	assert(table != NULL);
+	assert(key != NULL);
+
+	if (table->used == 0)
+		return (NULL);
+
+	size_t i = hash(key) & (table->size - 1);
+	while (table->rules[i].key != NULL) {
+		if (strcmp(table->rules[i].key, key) == 0)
+			return (&table->rules[i]);
+		i = (i + 1) & (table->size - 1);
+	}
+
+	return (NULL);
+}
+
+static uint32_t
+hash(const char *key)
+{
+	assert(key != NULL);
+
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)key; *p != '\0';
+	    p++)
+		h = (h ^ *p) * 16777619u;
+
+	return (h);
+}
+
+static bool
+valid_type(char type)
+{
+	switch (type) {
+	case IT_IGNORE:
+	case IT_FILE:
+	case IT_ARCHIVE:
+	case IT_BINARY:
+	case IT_GIF:
+	case IT_HTML:
+	case IT_IMAGE:
+	case IT_AUDIO:
+		return (true);
+	default:
+		return (false);
+	}
+}
@@ -0,0 +1,15 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef CLASSIFY_H
+#define CLASSIFY_H
+
+void classify_load(const char *_typemap);
+char classify_extension(const char *_name);
+char classify_mime(const char *_mime);
+
+#endif /* !CLASSIFY_H */
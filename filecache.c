@@ -0,0 +1,369 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "filecache.h"
+#include "tools.h"
+
+#define BUCKETS		4096	/* must be a power of two */
+#define DOORBITS	65536	/* must be a power of two */
+
+/*
+ * Small files are kept exactly as they go over the wire, keyed by selector.
+ * An entry is valid as long as the file has the same inode, size,
+ * modification and change time as when it was loaded. The least recently
+ * used entries are evicted as soon as the cached files exceed the budget.
+ *
+ * Entries handed out by filecache_get() and filecache_put() are referenced,
+ * so a connection can keep sending one even if it is evicted meanwhile.
+ */
+struct cachedfile {
+	char *selector;
+	uint32_t hash;
+	struct tool_stamp stamp;
+	char type;
+	char *data;
+	size_t len;
+	int refs;
+	bool cached;
+	struct cachedfile *chain;
+	struct cachedfile *prev;
+	struct cachedfile *next;
+};
+
+static size_t budget;
+static size_t maxsize;
+static size_t used;
+static struct cachedfile **buckets;
+static struct cachedfile *head;
+static struct cachedfile *tail;
+
+/*
+ * The doorkeeper remembers which selectors have been asked for recently. Only
+ * a selector seen before is admitted, so files requested just once never
+ * displace the popular ones. It is cleared whenever it fills up, which lets
+ * old sightings age out.
+ */
+static unsigned char doorkeeper[DOORBITS / 8];
+static size_t doorcount;
+
+static struct cachedfile *find(const char *selector, uint32_t hash);
+static uint32_t hash_selector(const char *selector);
+static void unlink_lru(struct cachedfile *f);
+static void link_lru(struct cachedfile *f);
+static void evict(struct cachedfile *f);
+static void destroy(struct cachedfile *f);
+
+void
+filecache_init(size_t size, size_t max)
+{
+	budget = size;
+	maxsize = max;
+}
+
+bool
+filecache_enabled(void)
+{
+	return (budget > 0 && maxsize > 0);
+}
+
+size_t
+filecache_maxsize(void)
+{
+	return (maxsize);
+}
+
+/*
+ * Returns a reference to the cached file if it is still valid for the given
+ * stat(2) result. If s is NULL, the caller vouches for the entry, because
+ * changes to the file are reported through filecache_invalidate().
+ */
+struct cachedfile *
+filecache_get(const char *selector, const struct stat *s)
+{
+	assert(selector != NULL);
+
+	if (buckets == NULL)
+		return (NULL);
+
+	struct cachedfile *f = find(selector, hash_selector(selector));
+	if (f == NULL)
+		return (NULL);
+
+	if (s != NULL && !tool_same_stamp(&f->stamp, s, true)) {
+		evict(f);
+		return (NULL);
+	}
+
+	unlink_lru(f);
+	link_lru(f);
+	f->refs++;
+
+	return (f);
+}
+
+/*
+ * Returns true if selector has been asked for recently and is worth being
+ * cached.
+ */
+bool
+filecache_admit(const char *selector)
+{
+	assert(selector != NULL);
+
+	uint32_t h = hash_selector(selector);
+	uint32_t b1 = h & (DOORBITS - 1);
+	uint32_t b2 = (h * 2654435761u >> 16) & (DOORBITS - 1);
+
+	bool seen = ((doorkeeper[b1 / 8] & (1 << (b1 % 8))) != 0 &&
+	    (doorkeeper[b2 / 8] & (1 << (b2 % 8))) != 0);
+	if (seen)
+		return (true);
+
+	doorkeeper[b1 / 8] |= 1 << (b1 % 8);
+	doorkeeper[b2 / 8] |= 1 << (b2 % 8);
+	if (++doorcount >= DOORBITS / 8) {
+		memset(doorkeeper, 0, sizeof(doorkeeper));
+		doorcount = 0;
+	}
+
+	return (false);
+}
+
+/*
+ * Adds the wire bytes of a file of the given item type to the cache. The
+ * cache takes ownership of data. A reference to the new entry is returned,
+ * or NULL if it could not be cached, in which case data has been freed.
+ */
+struct cachedfile *
+filecache_put(const char *selector, const struct stat *s, char type,
+    char *data, size_t len)
+{
+	assert(selector != NULL);
+	assert(s != NULL);
+	assert(data != NULL);
+
+	if (len > budget) {
+		free(data);
+		return (NULL);
+	}
+
+	if (buckets == NULL) {
+		buckets = calloc(BUCKETS, sizeof(struct cachedfile *));
+		if (buckets == NULL) {
+			syslog(LOG_ERR, "calloc error: %m");
+			free(data);
+			return (NULL);
+		}
+	}
+
+	struct cachedfile *f = calloc(1, sizeof(struct cachedfile));
+	if (f == NULL) {
+		syslog(LOG_ERR, "calloc error: %m");
+		free(data);
+		return (NULL);
+	}
+	f->selector = strdup(selector);
+	if (f->selector == NULL) {
+		syslog(LOG_ERR, "strdup error: %m");
+		free(f);
+		free(data);
+		return (NULL);
+	}
+	f->hash = hash_selector(selector);
+
+	struct cachedfile *o = find(selector, f->hash);
+	if (o != NULL)
+		evict(o);
+
+	while (used + len > budget && tail != NULL)
+		evict(tail);
+
+	tool_make_stamp(&f->stamp, s);
+	f->type = type;
+	f->data = data;
+	f->len = len;
+	f->refs = 1;
+	f->cached = true;
+
+	struct cachedfile **pf = &buckets[f->hash & (BUCKETS - 1)];
+	f->chain = *pf;
+	*pf = f;
+	link_lru(f);
+	used += len;
+
+	return (f);
+}
+
+const char *
+filecache_data(const struct cachedfile *f, size_t *len)
+{
+	assert(f != NULL);
+	assert(len != NULL);
+
+	*len = f->len;
+	return (f->data);
+}
+
+char
+filecache_type(const struct cachedfile *f)
+{
+	assert(f != NULL);
+
+	return (f->type);
+}
+
+void
+filecache_release(struct cachedfile *f)
+{
+	assert(f != NULL);
+	assert(f->refs > 0);
+
+	if (--f->refs == 0 && !f->cached)
+		destroy(f);
+}
+
+void
+filecache_invalidate(const char *selector)
+{
+	assert(selector != NULL);
+
+	if (buckets == NULL)
+		return;
+
+	struct cachedfile *f = find(selector, hash_selector(selector));
+	if (f != NULL)
+		evict(f);
+}
+
+/*
+ * Drops all files at or below selector.
+ */
+void
+filecache_invalidate_tree(const char *selector)
+{
+	assert(selector != NULL);
+
+	size_t l = strlen(selector);
+	if (l > 0 && selector[l - 1] == '/')
+		l--;
+
+	struct cachedfile *f = head;
+	while (f != NULL) {
+		struct cachedfile *next = f->next;
+		if (strncmp(f->selector, selector, l) == 0 &&
+		    (f->selector[l] == '\0' || f->selector[l] == '/'))
+			evict(f);
+		f = next;
+	}
+}
+
+void
+filecache_flush(void)
+{
+	while (tail != NULL)
+		evict(tail);
+}
+
+static struct cachedfile *
+find(const char *selector, uint32_t hash)
+{
+	assert(selector != NULL);
+
+	for (struct cachedfile *f = buckets[hash & (BUCKETS - 1)]; f != NULL;
+	    f = f->chain)
+		if (f->hash == hash && strcmp(f->selector, selector) == 0)
+			return (f);
+
+	return (NULL);
+}
+
+static uint32_t
+hash_selector(const char *selector)
+{
+	assert(selector != NULL);
+
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)selector;
+	    *p != '\0'; p++)
+		h = (h ^ *p) * 16777619u;
+
+	return (h);
+}
+
+static void
+unlink_lru(struct cachedfile *f)
+{
+	assert(f != NULL);
+
+	if (f->prev != NULL)
+		f->prev->next = f->next;
+	else
+		head = f->next;
+	if (f->next != NULL)
+		f->next->prev = f->prev;
+	else
+		tail = f->prev;
+	f->prev = f->next = NULL;
+}
+
+static void
+link_lru(struct cachedfile *f)
+{
+	assert(f != NULL);
+
+	f->prev = NULL;
+	f->next = head;
+	if (head != NULL)
+		head->prev = f;
+	head = f;
+	if (tail == NULL)
+		tail = f;
+}
+
+/*
+ * Removes the file from the cache. It is freed as soon as the last reference
+ * is released.
+ */
+static void
+evict(struct cachedfile *f)
+{
+	assert(f != NULL);
+	assert(f->cached);
+
+	struct cachedfile **pf = &buckets[f->hash & (BUCKETS - 1)];
+	while (*pf != f)
+		pf = &(*pf)->chain;
+	*pf = f->chain;
+
+	unlink_lru(f);
+	used -= f->len;
+	f->cached = false;
+
+	if (f->refs == 0)
+		destroy(f);
+}
+
+static void
+destroy(struct cachedfile *f)
+{
+	assert(f != NULL);
+
+	free(f->selector);
+	free(f->data);
+	free(f);
+}
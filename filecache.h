@@ -0,0 +1,33 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct cachedfile;
+
+void filecache_init(size_t _budget, size_t _maxsize);
+bool filecache_enabled(void);
+size_t filecache_maxsize(void);
+struct cachedfile *filecache_get(const char *_selector,
+    const struct stat *_s);
+bool filecache_admit(const char *_selector);
+struct cachedfile *filecache_put(const char *_selector, const struct stat *_s,
+    char _type, char *_data, size_t _len);
+const char *filecache_data(const struct cachedfile *_file, size_t *_len);
+char filecache_type(const struct cachedfile *_file);
+void filecache_release(struct cachedfile *_file);
+void filecache_invalidate(const char *_selector);
+void filecache_invalidate_tree(const char *_selector);
+void filecache_flush(void);
+
+#endif /* !FILECACHE_H */
@@ -0,0 +1,727 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "findindex.h"
+#include "send.h"
+#include "tools.h"
+
+#define MAGIC		"MGOPHFN"
+#define VERSION		1
+#define BYTEORDER	0x01020304
+#define MAXRESULTS	200
+#define ALIGN(n)	(((n) + 7) & ~(uint64_t)7)
+
+/*
+ * A find index is written by mgopherd-index and mapped read-only by
+ * mgopherd. It lists every entry of the served tree that shows up in a
+ * menu, with the item type it is listed with.
+ *
+ * The names of all entries are kept folded to lower case in one text, each
+ * terminated by a NUL byte, in the order of the entries. Two sorted arrays
+ * of offsets lead into it: a suffix array holding every position within a
+ * name, sorted by the rest of the name from there, and the entries sorted
+ * by their names. A substring is found by a binary search in the former, a
+ * prefix by one in the latter, and the entry a position belongs to by a
+ * binary search over the name offsets of the entries.
+ */
+struct header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t size;
+	uint64_t text;
+	uint64_t textlen;
+	uint64_t suffixes;
+	uint64_t nsuffixes;
+	uint64_t names;
+	uint64_t entries;
+	uint64_t nentries;
+};
+
+struct entry {
+	uint64_t selector;
+	uint32_t name;
+	uint32_t type;
+};
+
+struct builderentry {
+	char *selector;
+	size_t name;
+	char type;
+};
+
+struct findindex_builder {
+	char *text;
+	size_t textlen;
+	size_t textcapacity;
+	struct builderentry *entries;
+	size_t nentries;
+	size_t capacity;
+};
+
+/*
+ * The entries found by a query, at most MAXRESULTS of them. more is set if
+ * further entries matched.
+ */
+struct matches {
+	uint32_t entries[MAXRESULTS];
+	size_t n;
+	bool more;
+};
+
+static char *map;
+static size_t mapsize;
+static const struct header *header;
+static const char *text;
+static const uint32_t *suffixes;
+static const uint32_t *names;
+static const struct entry *entries;
+
+/* The text the builder sorts, as qsort(3) passes no argument. */
+static const char *sorttext;
+static const struct builderentry *sortentries;
+
+static bool check_index(void);
+static void fold(char *dst, const char *src, size_t size);
+static void find_substring(const char *s, struct matches *m);
+static void find_glob(const char *pattern, struct matches *m);
+static void suffix_range(const char *s, size_t len, size_t *lo, size_t *hi);
+static void name_range(const char *s, size_t len, size_t *lo, size_t *hi);
+static uint32_t owner(uint32_t position);
+static size_t literal(const char *pattern, size_t *start);
+static bool add_match(struct matches *m, uint32_t entry);
+static int compare_suffixes(const void *a, const void *b);
+static int compare_names(const void *a, const void *b);
+static int compare_matches(const void *a, const void *b);
+static bool write_padding(FILE *f, uint64_t len);
+
+/*
+ * Maps the index at path. An index that cannot be read or is damaged is
+ * logged and ignored; searches are then answered with an error message.
+ */
+void
+findindex_open(const char *path)
+{
+	assert(path != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		syslog(LOG_ERR, "open find index error: %m");
+		return;
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) == -1) {
+		syslog(LOG_ERR, "fstat find index error: %m");
+		close(fd);
+		return;
+	}
+	if ((uintmax_t)s.st_size < sizeof(struct header) ||
+	    (uintmax_t)s.st_size > SIZE_MAX) {
+		syslog(LOG_ERR, "find index \"%s\" has an invalid size", path);
+		close(fd);
+		return;
+	}
+
+	void *m = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		syslog(LOG_ERR, "mmap find index error: %m");
+		return;
+	}
+
+	map = m;
+	mapsize = s.st_size;
+	if (!check_index()) {
+		syslog(LOG_ERR, "ignoring find index \"%s\"", path);
+		munmap(m, mapsize);
+		map = NULL;
+		mapsize = 0;
+		return;
+	}
+
+	syslog(LOG_INFO, "find index \"%s\": %ju entries", path,
+	    (uintmax_t)header->nentries);
+}
+
+bool
+findindex_enabled(void)
+{
+	return (map != NULL);
+}
+
+/*
+ * Answers query with a menu of the matching entries, sorted by their
+ * selectors. A query holding one of the characters *, ?, [ or \ is taken
+ * as a fnmatch(3) pattern for the whole name, anything else as a part of
+ * the name. Case is ignored for ASCII letters. The menu is not terminated.
+ */
+void
+findindex_query(const char *query, FILE *out, const char *host,
+    const char *port)
+{
+	assert(query != NULL);
+	assert(out != NULL);
+	assert(host != NULL);
+	assert(port != NULL);
+	assert(map != NULL);
+
+	char pattern[LINE_MAX];
+	fold(pattern, query, sizeof(pattern));
+	if (pattern[0] == '\0') {
+		send_info(out, "Enter a part of a file name or a pattern like "
+		    "*.txt.", NULL);
+		return;
+	}
+
+	struct matches m = {
+		.n = 0,
+		.more = false
+	};
+	if (strpbrk(pattern, "*?[\\") == NULL)
+		find_substring(pattern, &m);
+	else
+		find_glob(pattern, &m);
+
+	char line[128];
+	if (m.more)
+		snprintf(line, sizeof(line), "More than %d entries found, "
+		    "showing %zu of them.", MAXRESULTS, m.n);
+	else
+		snprintf(line, sizeof(line), "%zu entries found.", m.n);
+	send_info(out, line, NULL);
+
+	qsort(m.entries, m.n, sizeof(uint32_t), &compare_matches);
+	for (size_t i = 0; i < m.n; i++) {
+		const struct entry *e = &entries[m.entries[i]];
+		char *selector = map + e->selector;
+		struct item item = {
+			.type = e->type,
+			.display = selector,
+			.selector = selector,
+			.host = (char *)host,
+			.port = (char *)port
+		};
+		send_item(out, &item);
+	}
+}
+
+struct findindex_builder *
+findindex_builder_new(void)
+{
+	return (calloc(1, sizeof(struct findindex_builder)));
+}
+
+/*
+ * Adds the entry at selector, listed with item type type. Entries have to
+ * be added in the order they are to be listed in. False is returned if no
+ * memory is left.
+ */
+bool
+findindex_builder_add(struct findindex_builder *b, const char *selector,
+    char type)
+{
+	assert(b != NULL);
+	assert(selector != NULL);
+
+	const char *name = strrchr(selector, '/');
+	name = (name == NULL) ? selector : name + 1;
+	size_t len = strlen(name) + 1;
+
+	if (b->textlen + len > b->textcapacity) {
+		size_t c = (b->textcapacity == 0) ? 4096 : b->textcapacity;
+		while (c < b->textlen + len)
+			c *= 2;
+		void *t = realloc(b->text, c);
+		if (t == NULL)
+			return (false);
+		b->text = t;
+		b->textcapacity = c;
+	}
+	if (b->nentries == b->capacity) {
+		size_t c = (b->capacity == 0) ? 256 : b->capacity * 2;
+		void *e = realloc(b->entries, c * sizeof(struct builderentry));
+		if (e == NULL)
+			return (false);
+		b->entries = e;
+		b->capacity = c;
+	}
+
+	struct builderentry *e = &b->entries[b->nentries];
+	e->selector = strdup(selector);
+	if (e->selector == NULL)
+		return (false);
+	e->name = b->textlen;
+	e->type = type;
+	fold(b->text + b->textlen, name, len);
+	b->textlen += len;
+	b->nentries++;
+
+	return (true);
+}
+
+/*
+ * Sorts the names and writes the index to a temporary file next to path,
+ * which is then renamed into place.
+ */
+bool
+findindex_builder_write(struct findindex_builder *b, const char *path)
+{
+	assert(b != NULL);
+	assert(path != NULL);
+
+	if (b->textlen > UINT32_MAX || b->nentries > UINT32_MAX) {
+		errno = EFBIG;
+		return (false);
+	}
+
+	size_t nsuffixes = b->textlen - b->nentries;
+	uint32_t *sa = malloc((nsuffixes > 0 ? nsuffixes : 1) *
+	    sizeof(uint32_t));
+	uint32_t *na = malloc((b->nentries > 0 ? b->nentries : 1) *
+	    sizeof(uint32_t));
+	if (sa == NULL || na == NULL) {
+		free(sa);
+		free(na);
+		return (false);
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < b->textlen; i++)
+		if (b->text[i] != '\0')
+			sa[n++] = i;
+	assert(n == nsuffixes);
+	for (size_t i = 0; i < b->nentries; i++)
+		na[i] = i;
+
+	sorttext = b->text;
+	sortentries = b->entries;
+	qsort(sa, nsuffixes, sizeof(uint32_t), &compare_suffixes);
+	qsort(na, b->nentries, sizeof(uint32_t), &compare_names);
+
+	struct header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(h.magic));
+	h.version = VERSION;
+	h.byteorder = BYTEORDER;
+	h.text = sizeof(struct header);
+	h.textlen = b->textlen;
+	h.suffixes = ALIGN(h.text + h.textlen);
+	h.nsuffixes = nsuffixes;
+	h.names = h.suffixes + nsuffixes * sizeof(uint32_t);
+	h.entries = ALIGN(h.names + b->nentries * sizeof(uint32_t));
+	h.nentries = b->nentries;
+	uint64_t heap = h.entries + b->nentries * sizeof(struct entry);
+	h.size = heap;
+	for (size_t i = 0; i < b->nentries; i++)
+		h.size += strlen(b->entries[i].selector) + 1;
+
+	size_t l = strlen(path) + sizeof(".tmp");
+	char *tmp = malloc(l);
+	if (tmp == NULL) {
+		free(sa);
+		free(na);
+		return (false);
+	}
+	snprintf(tmp, l, "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		free(tmp);
+		free(sa);
+		free(na);
+		return (false);
+	}
+
+	bool success = (tool_write_all(f, &h, sizeof(h)) &&
+	    tool_write_all(f, b->text, b->textlen) &&
+	    write_padding(f, h.suffixes - h.text - h.textlen) &&
+	    tool_write_all(f, sa, nsuffixes * sizeof(uint32_t)) &&
+	    tool_write_all(f, na, b->nentries * sizeof(uint32_t)) &&
+	    write_padding(f, h.entries - h.names -
+	    b->nentries * sizeof(uint32_t)));
+	uint64_t offset = heap;
+	for (size_t i = 0; success && i < b->nentries; i++) {
+		struct entry e = {
+			.selector = offset,
+			.name = b->entries[i].name,
+			.type = (unsigned char)b->entries[i].type
+		};
+		offset += strlen(b->entries[i].selector) + 1;
+		success = tool_write_all(f, &e, sizeof(e));
+	}
+	for (size_t i = 0; success && i < b->nentries; i++)
+		success = tool_write_all(f, b->entries[i].selector,
+		    strlen(b->entries[i].selector) + 1);
+	free(sa);
+	free(na);
+
+	if (fclose(f) == EOF)
+		success = false;
+	if (success && rename(tmp, path) == -1)
+		success = false;
+	if (!success) {
+		int error = errno;
+		unlink(tmp);
+		errno = error;
+	}
+	free(tmp);
+
+	return (success);
+}
+
+void
+findindex_builder_free(struct findindex_builder *b)
+{
+	if (b == NULL)
+		return;
+
+	for (size_t i = 0; i < b->nentries; i++)
+		free(b->entries[i].selector);
+	free(b->entries);
+	free(b->text);
+	free(b);
+}
+
+/*
+ * Checks the mapped index once, so later lookups can not lead to reads
+ * outside the mapping.
+ */
+static bool
+check_index(void)
+{
+	header = (const struct header *)map;
+	const struct header *h = header;
+	if (memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != VERSION || h->byteorder != BYTEORDER) {
+		syslog(LOG_ERR, "find index has an unknown format");
+		return (false);
+	}
+	if (h->size != mapsize || h->text != sizeof(struct header) ||
+	    h->textlen > UINT32_MAX || h->textlen > mapsize - h->text ||
+	    h->suffixes != ALIGN(h->text + h->textlen) ||
+	    h->nsuffixes > h->textlen ||
+	    h->names != h->suffixes + h->nsuffixes * sizeof(uint32_t) ||
+	    h->nentries > h->textlen || h->names > mapsize ||
+	    h->nentries > (mapsize - h->names) / sizeof(uint32_t) ||
+	    h->entries != ALIGN(h->names + h->nentries * sizeof(uint32_t)) ||
+	    h->entries > mapsize ||
+	    h->nentries > (mapsize - h->entries) / sizeof(struct entry)) {
+		syslog(LOG_ERR, "find index is truncated");
+		return (false);
+	}
+
+	text = map + h->text;
+	suffixes = (const uint32_t *)(map + h->suffixes);
+	names = (const uint32_t *)(map + h->names);
+	entries = (const struct entry *)(map + h->entries);
+	bool valid = (h->textlen == 0 || text[h->textlen - 1] == '\0');
+	for (uint64_t i = 0; valid && i < h->nsuffixes; i++)
+		valid = (suffixes[i] < h->textlen);
+	for (uint64_t i = 0; valid && i < h->nentries; i++) {
+		const struct entry *e = &entries[i];
+		valid = (names[i] < h->nentries && e->name < h->textlen &&
+		    (i == 0 || e->name > entries[i - 1].name) &&
+		    e->selector < mapsize &&
+		    memchr(map + e->selector, '\0',
+		    mapsize - e->selector) != NULL);
+	}
+	if (!valid) {
+		syslog(LOG_ERR, "find index is damaged");
+		return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Copies src to dst, folding ASCII letters to lower case. dst is always
+ * terminated.
+ */
+static void
+fold(char *dst, const char *src, size_t size)
+{
+	assert(dst != NULL);
+	assert(src != NULL);
+	assert(size > 0);
+
+	size_t i;
+	for (i = 0; i + 1 < size && src[i] != '\0'; i++)
+		dst[i] = (src[i] >= 'A' && src[i] <= 'Z') ?
+		    src[i] + 'a' - 'A' : src[i];
+	dst[i] = '\0';
+}
+
+static void
+find_substring(const char *s, struct matches *m)
+{
+	assert(s != NULL);
+	assert(m != NULL);
+
+	size_t lo, hi;
+	suffix_range(s, strlen(s), &lo, &hi);
+	for (size_t i = lo; i < hi; i++)
+		if (!add_match(m, owner(suffixes[i])))
+			break;
+}
+
+/*
+ * Matches pattern against the names holding one of its literal parts: the
+ * part the pattern starts with is looked up as a prefix, every other as a
+ * substring, and the one found the least often is used. A pattern without
+ * any literal part is matched against every name.
+ */
+static void
+find_glob(const char *pattern, struct matches *m)
+{
+	assert(pattern != NULL);
+	assert(m != NULL);
+
+	size_t lo = 0;
+	size_t hi = header->nentries;
+	bool prefix = true;
+
+	size_t start;
+	size_t len;
+	for (const char *p = pattern; *p != '\0'; p += start + len) {
+		len = literal(p, &start);
+		if (len == 0)
+			continue;
+
+		size_t l, h;
+		if (p == pattern && start == 0)
+			name_range(p, len, &l, &h);
+		else
+			suffix_range(p + start, len, &l, &h);
+		if (h - l < hi - lo) {
+			lo = l;
+			hi = h;
+			prefix = (p == pattern && start == 0);
+		}
+	}
+
+	for (size_t i = lo; i < hi; i++) {
+		uint32_t e = prefix ? names[i] : owner(suffixes[i]);
+		if (fnmatch(pattern, text + entries[e].name, 0) != 0)
+			continue;
+		if (!add_match(m, e))
+			break;
+	}
+}
+
+/*
+ * Finds the range of suffixes starting with the len bytes of s.
+ */
+static void
+suffix_range(const char *s, size_t len, size_t *lo, size_t *hi)
+{
+	assert(s != NULL);
+	assert(lo != NULL);
+	assert(hi != NULL);
+
+	size_t l = 0;
+	size_t h = header->nsuffixes;
+	while (l < h) {
+		size_t mid = l + (h - l) / 2;
+		if (strncmp(text + suffixes[mid], s, len) < 0)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+	*lo = l;
+
+	h = header->nsuffixes;
+	while (l < h) {
+		size_t mid = l + (h - l) / 2;
+		if (strncmp(text + suffixes[mid], s, len) <= 0)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+	*hi = l;
+}
+
+/*
+ * Finds the range of entries whose names start with the len bytes of s.
+ */
+static void
+name_range(const char *s, size_t len, size_t *lo, size_t *hi)
+{
+	assert(s != NULL);
+	assert(lo != NULL);
+	assert(hi != NULL);
+
+	size_t l = 0;
+	size_t h = header->nentries;
+	while (l < h) {
+		size_t mid = l + (h - l) / 2;
+		if (strncmp(text + entries[names[mid]].name, s, len) < 0)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+	*lo = l;
+
+	h = header->nentries;
+	while (l < h) {
+		size_t mid = l + (h - l) / 2;
+		if (strncmp(text + entries[names[mid]].name, s, len) <= 0)
+			l = mid + 1;
+		else
+			h = mid;
+	}
+	*hi = l;
+}
+
+/*
+ * Returns the entry whose name holds position.
+ */
+static uint32_t
+owner(uint32_t position)
+{
+	size_t lo = 0;
+	size_t hi = header->nentries;
+	while (hi - lo > 1) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (entries[mid].name <= position)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+/*
+ * Finds the next literal part of pattern, the bytes up to the next
+ * wildcard, bracket expression or escape. The number of bytes skipped
+ * before it is stored in start and its length is returned.
+ */
+static size_t
+literal(const char *pattern, size_t *start)
+{
+	assert(pattern != NULL);
+	assert(start != NULL);
+
+	const char *p = pattern;
+	for (;;) {
+		if (*p == '*' || *p == '?')
+			p++;
+		else if (*p == '\\')
+			p += (p[1] != '\0') ? 2 : 1;
+		else if (*p == '[') {
+			p++;
+			if (*p == '!')
+				p++;
+			if (*p == ']')
+				p++;
+			while (*p != '\0' && *p != ']')
+				p++;
+			if (*p == ']')
+				p++;
+		} else
+			break;
+	}
+	*start = p - pattern;
+
+	return (strcspn(p, "*?[\\"));
+}
+
+/*
+ * Adds entry to m unless it is already there. False is returned once m is
+ * full.
+ */
+static bool
+add_match(struct matches *m, uint32_t entry)
+{
+	assert(m != NULL);
+
+	for (size_t i = 0; i < m->n; i++)
+		if (m->entries[i] == entry)
+			return (true);
+
+	if (m->n == MAXRESULTS) {
+		m->more = true;
+		return (false);
+	}
+	m->entries[m->n++] = entry;
+
+	return (true);
+}
+
+static int
+compare_suffixes(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	uint32_t sa = *(const uint32_t *)a;
+	uint32_t sb = *(const uint32_t *)b;
+
+	int cmp = strcmp(sorttext + sa, sorttext + sb);
+	if (cmp != 0)
+		return (cmp);
+	return (sa < sb ? -1 : sa > sb);
+}
+
+static int
+compare_names(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	uint32_t na = *(const uint32_t *)a;
+	uint32_t nb = *(const uint32_t *)b;
+
+	int cmp = strcmp(sorttext + sortentries[na].name,
+	    sorttext + sortentries[nb].name);
+	if (cmp != 0)
+		return (cmp);
+	return (na < nb ? -1 : na > nb);
+}
+
+static int
+compare_matches(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	const struct entry *ea = &entries[*(const uint32_t *)a];
+	const struct entry *eb = &entries[*(const uint32_t *)b];
+
+	return (strcmp(map + ea->selector, map + eb->selector));
+}
+
+static bool
+write_padding(FILE *f, uint64_t len)
+{
+	assert(f != NULL);
+	assert(len < 8);
+
+	static const char zero[8];
+
+	return (tool_write_all(f, zero, len));
+}
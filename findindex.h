@@ -0,0 +1,34 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef FINDINDEX_H
+#define FINDINDEX_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * The selector of the file name search item. Components starting with a
+ * dot are rejected by the request validation, so it cannot hide a file.
+ */
+#define FINDINDEX_SELECTOR	"/.find"
+
+struct findindex_builder;
+
+void findindex_open(const char *_path);
+bool findindex_enabled(void);
+void findindex_query(const char *_query, FILE *_out, const char *_host,
+    const char *_port);
+
+struct findindex_builder *findindex_builder_new(void);
+bool findindex_builder_add(struct findindex_builder *_b,
+    const char *_selector, char _type);
+bool findindex_builder_write(struct findindex_builder *_b,
+    const char *_path);
+void findindex_builder_free(struct findindex_builder *_b);
+
+#endif /* !FINDINDEX_H */
@@ -18,10 +18,18 @@
 #include "gophermap.h"
 #include "tools.h"
 
+static char *copy_field(struct arena *arena, const char *p, size_t l,
+    FILE *out);
+
+/*
+ * Parses a gophermap line into item. All strings of the item are allocated
+ * from arena.
+ */
 bool
-gophermap_parse_item(struct opt_options *options, struct item *item,
-    const char *selector, const char *line, FILE *out)
+gophermap_parse_item(struct opt_options *options, struct arena *arena,
+    struct item *item, const char *selector, const char *line, FILE *out)
 {
+	assert(arena != NULL);
 	assert(item != NULL);
 	assert(line != NULL);
 	assert(out != NULL);
@@ -41,21 +49,12 @@ gophermap_parse_item(struct opt_options *options, struct item *item,
 		send_error(out, "E: Malformed line", line);
 		return (false);
 	}
-	char *display = malloc(l+1);
-	if (display == NULL) {
-		syslog(LOG_ERR, "malloc error: %m");
-		send_error(out, "E: malloc", strerror(errno));
-		send_info(out, "I: I could not allocate memory.", NULL);
-		exit(EXIT_FAILURE);
-	}
-	strncpy(display, p, l);
-	display[l] = '\0';
+	char *display = copy_field(arena, p, l, out);
 	p += l;
 
 	if (*p == '\0') {
 		syslog(LOG_NOTICE, "malformed gophermap line: \"%s\"", line);
 		send_error(out, "E: Malformed line", line);
-		free(display);
 		return (false);
 	}
 	p++;
@@ -64,71 +63,34 @@ gophermap_parse_item(struct opt_options *options, struct item *item,
 	bool relative = (l > 0 && *p != '/' && strncasecmp(p, "GET ", 4) != 0);
 	char *sel;
 	if (relative) {
-		char *rel = malloc(l+1);
-		if (rel == NULL) {
-			syslog(LOG_ERR, "malloc error: %m");
-			send_error(out, "E: malloc", strerror(errno));
-			send_info(out, "I: I could not allocate memory.", NULL);
-			exit(EXIT_FAILURE);
-		}
-		strncpy(rel, p, l);
-		rel[l] = '\0';
-		sel = tool_join_path(selector, rel, out);
-		free(rel);
-	} else {
-		sel = malloc(l+1);
-		if (sel == NULL) {
-			syslog(LOG_ERR, "malloc error: %m");
-			send_error(out, "E: malloc", strerror(errno));
-			send_info(out, "I: I could not allocate memory.", NULL);
-			exit(EXIT_FAILURE);
-		}
-		strncpy(sel, p, l);
-		sel[l] = '\0';
-	}
+		char *rel = copy_field(arena, p, l, out);
+		sel = tool_join_path(arena, selector, rel, out);
+		if (sel == NULL)
+			return (false);
+	} else
+		sel = copy_field(arena, p, l, out);
 	p += l;
 
 	if (*p != '\0')
 		p++;
 
-	size_t ll = l = strcspn(p, "\t");
-	bool use_default = (l == 0 || (l == 1 && *p == '+'));
-	if (use_default)
-		ll = strlen(opt_get_host(options));
-	char *host = malloc(ll+1);
-	if (host == NULL) {
-		syslog(LOG_ERR, "malloc error: %m");
-		send_error(out, "E: malloc", strerror(errno));
-		send_info(out, "I: I could not allocate memory.", NULL);
-		exit(EXIT_FAILURE);
-	}
-	if (use_default)
-		strncpy(host, opt_get_host(options), ll);
+	l = strcspn(p, "\t");
+	char *host;
+	if (l == 0 || (l == 1 && *p == '+'))
+		host = opt_get_host(options);
 	else
-		strncpy(host, p, ll);
-	host[ll] = '\0';
+		host = copy_field(arena, p, l, out);
 	p += l;
 
 	if (*p != '\0')
 		p++;
 
-	ll = l = strcspn(p, "\t");
-	use_default = (l == 0 || (l == 1 && *p == '+'));
-	if (use_default)
-		ll = strlen(opt_get_port(options));
-	char *port = malloc(ll+1);
-	if (host == NULL) {
-		syslog(LOG_ERR, "malloc error: %m");
-		send_error(out, "E: malloc", strerror(errno));
-		send_info(out, "I: I could not allocate "
-		    "memory.", NULL);
-		exit(EXIT_FAILURE);
-	}
-	if (use_default)
-		strncpy(port, opt_get_port(options), ll);
+	l = strcspn(p, "\t");
+	char *port;
+	if (l == 0 || (l == 1 && *p == '+'))
+		port = opt_get_port(options);
 	else
-		strncpy(port, p, ll);
-	port[ll] = '\0';
+		port = copy_field(arena, p, l, out);
 
 	item->type = type;
 	item->display = display;
@@ -139,13 +101,20 @@ gophermap_parse_item(struct opt_options *options, struct item *item,
 	return (true);
 }
 
-void
-gophermap_free_item(struct item *item)
+static char *
+copy_field(struct arena *arena, const char *p, size_t l, FILE *out)
 {
-	assert(item != NULL);
+	assert(arena != NULL);
+	assert(p != NULL);
+	assert(out != NULL);
+
+	char *field = arena_strndup(arena, p, l);
+	if (field == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		send_error(out, "E: malloc", strerror(errno));
+		send_info(out, "I: I could not allocate memory.", NULL);
+		exit(EXIT_FAILURE);
+	}
 
-	free(item->display);
-	free(item->selector);
-	free(item->host);
-	free(item->port);
+	return (field);
 }
@@ -10,11 +10,12 @@
 
 #include <stdbool.h>
 
+#include "arena.h"
 #include "send.h"
 #include "options.h"
 
 bool gophermap_parse_item(struct opt_options *_options,
-    struct item *_item, const char *_selector, const char *_line, FILE *_out);
-void gophermap_free_item(struct item *_item);
+    struct arena *_arena, struct item *_item, const char *_selector,
+    const char *_line, FILE *_out);
 
 #endif /* !GOPHERMAP_H */
@@ -13,6 +13,7 @@
 #define IT_DIR		'1'
 #define IT_ERROR	'3'
 #define IT_ARCHIVE	'5'
+#define IT_SEARCH	'7'
 #define IT_BINARY	'9'
 #define IT_GIF		'g'
 #define IT_HTML		'h'
@@ -0,0 +1,290 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "menucache.h"
+#include "tools.h"
+
+#define BUCKETS		4096	/* must be a power of two */
+
+/*
+ * Rendered menus are kept per selector, host and port. An entry is valid as
+ * long as the directory and its gophermap carry the same size, modification
+ * and change times as when the menu was rendered. The least recently used
+ * entries are evicted as soon as the cached menus exceed the budget.
+ */
+struct menu {
+	char *key;
+	uint32_t hash;
+	struct tool_stamp dir;
+	struct tool_stamp map;
+	bool hasmap;
+	char *data;
+	size_t len;
+	struct menu *chain;
+	struct menu *prev;
+	struct menu *next;
+};
+
+static size_t budget;
+static size_t used;
+static struct menu **buckets;
+static struct menu *head;
+static struct menu *tail;
+
+static char *make_key(const char *selector, const char *host,
+    const char *port, uint32_t *hash);
+static uint32_t hash_selector(const char *selector);
+static void unlink_lru(struct menu *m);
+static void link_lru(struct menu *m);
+static void evict(struct menu *m);
+
+void
+menucache_init(size_t size)
+{
+	budget = size;
+}
+
+bool
+menucache_enabled(void)
+{
+	return (budget > 0);
+}
+
+/*
+ * Returns the cached menu if it is still valid for the given stat(2) results
+ * of the directory and its gophermap. map is NULL if there is no gophermap.
+ * If dir is NULL as well, the caller vouches for the entry, because changes
+ * to the directory are reported through menucache_invalidate().
+ */
+const char *
+menucache_get(const char *selector, const char *host, const char *port,
+    const struct stat *dir, const struct stat *map, size_t *len)
+{
+	assert(selector != NULL);
+	assert(host != NULL);
+	assert(port != NULL);
+	assert(len != NULL);
+
+	if (buckets == NULL)
+		return (NULL);
+
+	uint32_t hash;
+	char *key = make_key(selector, host, port, &hash);
+	if (key == NULL)
+		return (NULL);
+
+	struct menu *m;
+	for (m = buckets[hash & (BUCKETS - 1)]; m != NULL; m = m->chain)
+		if (m->hash == hash && strcmp(m->key, key) == 0)
+			break;
+	free(key);
+
+	if (m == NULL)
+		return (NULL);
+
+	if (dir != NULL && (!tool_same_stamp(&m->dir, dir, true) ||
+	    m->hasmap != (map != NULL) ||
+	    (map != NULL && !tool_same_stamp(&m->map, map, true)))) {
+		evict(m);
+		return (NULL);
+	}
+
+	unlink_lru(m);
+	link_lru(m);
+
+	*len = m->len;
+	return (m->data);
+}
+
+/*
+ * Adds a rendered menu to the cache. The cache takes ownership of data.
+ */
+void
+menucache_put(const char *selector, const char *host, const char *port,
+    const struct stat *dir, const struct stat *map, char *data, size_t len)
+{
+	assert(selector != NULL);
+	assert(host != NULL);
+	assert(port != NULL);
+	assert(dir != NULL);
+	assert(data != NULL);
+
+	if (len > budget) {
+		free(data);
+		return;
+	}
+
+	if (buckets == NULL) {
+		buckets = calloc(BUCKETS, sizeof(struct menu *));
+		if (buckets == NULL) {
+			syslog(LOG_ERR, "calloc error: %m");
+			free(data);
+			return;
+		}
+	}
+
+	struct menu *m = calloc(1, sizeof(struct menu));
+	if (m == NULL) {
+		syslog(LOG_ERR, "calloc error: %m");
+		free(data);
+		return;
+	}
+	m->key = make_key(selector, host, port, &m->hash);
+	if (m->key == NULL) {
+		free(m);
+		free(data);
+		return;
+	}
+
+	struct menu **pm = &buckets[m->hash & (BUCKETS - 1)];
+	for (struct menu *o = *pm; o != NULL; o = o->chain)
+		if (o->hash == m->hash && strcmp(o->key, m->key) == 0) {
+			evict(o);
+			break;
+		}
+
+	while (used + len > budget && tail != NULL)
+		evict(tail);
+
+	tool_make_stamp(&m->dir, dir);
+	m->hasmap = (map != NULL);
+	if (map != NULL)
+		tool_make_stamp(&m->map, map);
+	m->data = data;
+	m->len = len;
+
+	m->chain = *pm;
+	*pm = m;
+	link_lru(m);
+	used += len;
+}
+
+/*
+ * Drops the menus of the given selector for all hosts and ports.
+ */
+void
+menucache_invalidate(const char *selector)
+{
+	assert(selector != NULL);
+
+	if (buckets == NULL)
+		return;
+
+	uint32_t hash = hash_selector(selector);
+	size_t l = strlen(selector);
+
+	struct menu *m = buckets[hash & (BUCKETS - 1)];
+	while (m != NULL) {
+		struct menu *next = m->chain;
+		if (m->hash == hash && strncmp(m->key, selector, l) == 0 &&
+		    m->key[l] == '\t')
+			evict(m);
+		m = next;
+	}
+}
+
+void
+menucache_flush(void)
+{
+	while (tail != NULL)
+		evict(tail);
+}
+
+/*
+ * Entries are hashed by their selector only, so all variants of a selector
+ * share a chain.
+ */
+static char *
+make_key(const char *selector, const char *host, const char *port,
+    uint32_t *hash)
+{
+	assert(hash != NULL);
+
+	size_t l = strlen(selector) + strlen(host) + strlen(port) + 3;
+	char *key = malloc(l);
+	if (key == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		return (NULL);
+	}
+	snprintf(key, l, "%s\t%s\t%s", selector, host, port);
+	*hash = hash_selector(selector);
+
+	return (key);
+}
+
+static uint32_t
+hash_selector(const char *selector)
+{
+	assert(selector != NULL);
+
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)selector;
+	    *p != '\0'; p++)
+		h = (h ^ *p) * 16777619u;
+
+	return (h);
+}
+
+static void
+unlink_lru(struct menu *m)
+{
+	assert(m != NULL);
+
+	if (m->prev != NULL)
+		m->prev->next = m->next;
+	else
+		head = m->next;
+	if (m->next != NULL)
+		m->next->prev = m->prev;
+	else
+		tail = m->prev;
+	m->prev = m->next = NULL;
+}
+
+static void
+link_lru(struct menu *m)
+{
+	assert(m != NULL);
+
+	m->prev = NULL;
+	m->next = head;
+	if (head != NULL)
+		head->prev = m;
+	head = m;
+	if (tail == NULL)
+		tail = m;
+}
+
+static void
+evict(struct menu *m)
+{
+	assert(m != NULL);
+
+	struct menu **pm = &buckets[m->hash & (BUCKETS - 1)];
+	while (*pm != m)
+		pm = &(*pm)->chain;
+	*pm = m->chain;
+
+	unlink_lru(m);
+	used -= m->len;
+
+	free(m->key);
+	free(m->data);
+	free(m);
+}
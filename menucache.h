@@ -0,0 +1,27 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef MENUCACHE_H
+#define MENUCACHE_H
+
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+void menucache_init(size_t _budget);
+bool menucache_enabled(void);
+const char *menucache_get(const char *_selector, const char *_host,
+    const char *_port, const struct stat *_dir, const struct stat *_map,
+    size_t *_len);
+void menucache_put(const char *_selector, const char *_host,
+    const char *_port, const struct stat *_dir, const struct stat *_map,
+    char *_data, size_t _len);
+void menucache_invalidate(const char *_selector);
+void menucache_flush(void);
+
+#endif /* !MENUCACHE_H */
@@ -0,0 +1,380 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <assert.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define SUBBUCKETS	8	/* per power of two, must be a power of two */
+#define SUBBITS		3
+#define MAXEXPONENT	36	/* about nineteen hours in microseconds */
+#define NBUCKETS	((MAXEXPONENT - SUBBITS + 2) * SUBBUCKETS)
+#define MAXERRORS	32
+#define ERRORNAMEMAX	24
+#define NTYPES		128
+
+/*
+ * Every worker process owns one slot of a shared mapping and is the only one
+ * writing to it, so counting needs neither locks nor atomic operations. The
+ * slots are summed up when the metrics are served; a value read while it is
+ * being updated is merely off by one request.
+ *
+ * Latencies are kept in log-linear histograms: every power of two of
+ * microseconds is split into SUBBUCKETS buckets, which bounds the relative
+ * error of a quantile by 1/SUBBUCKETS over the whole range.
+ */
+struct histogram {
+	uint64_t buckets[NBUCKETS];
+	uint64_t sum;
+	uint64_t count;
+};
+
+struct errorclass {
+	char name[ERRORNAMEMAX];
+	uint64_t count;
+};
+
+struct slot {
+	uint64_t counters[METRICS_NCOUNTERS];
+	uint64_t requests[NTYPES];
+	struct errorclass errors[MAXERRORS];
+	struct histogram histograms[METRICS_NHISTOGRAMS];
+};
+
+static const char *counternames[METRICS_NCOUNTERS] = {
+	[METRICS_CONNECTIONS] = "mgopherd_connections_total",
+	[METRICS_BYTES] = "mgopherd_sent_bytes_total",
+	[METRICS_DIRENTS] = "mgopherd_directory_entries_total",
+	[METRICS_MAGIC] = "mgopherd_magic_calls_total",
+	[METRICS_ACCESSLOG_DROPPED] = "mgopherd_accesslog_dropped_total",
+	[METRICS_RATELIMITED] = "mgopherd_ratelimited_total",
+	[METRICS_SCRIPT_STARTS] = "mgopherd_script_starts_total"
+};
+
+static const char *cachenames[METRICS_NCOUNTERS] = {
+	[METRICS_MENUCACHE_HIT] = "menu",
+	[METRICS_FILECACHE_HIT] = "file",
+	[METRICS_TYPECACHE_HIT] = "type",
+	[METRICS_INDEXMENU_HIT] = "index_menu",
+	[METRICS_INDEXTYPE_HIT] = "index_type",
+	[METRICS_NAMEINDEX_HIT] = "name_index"
+};
+
+static const char *timeoutnames[METRICS_NCOUNTERS] = {
+	[METRICS_TIMEOUT_FIRSTBYTE] = "first_byte",
+	[METRICS_TIMEOUT_REQUEST] = "request",
+	[METRICS_TIMEOUT_IDLE] = "idle",
+	[METRICS_TIMEOUT_THROUGHPUT] = "throughput"
+};
+
+static const char *histogramnames[METRICS_NHISTOGRAMS] = {
+	[METRICS_REQUEST] = "mgopherd_request_duration",
+	[METRICS_MENU] = "mgopherd_menu_duration",
+	[METRICS_SEARCH] = "mgopherd_search_duration"
+};
+
+static struct slot local;
+static struct slot *slots;
+static int nslots;
+static struct slot *self = &local;
+
+static int bucket(uint64_t usec);
+static uint64_t bucket_limit(int b);
+static void write_histogram(FILE *out, enum metrics_histogram h);
+
+/*
+ * Sets up the shared slots for n workers. Has to be called before the
+ * workers are forked. Without it everything is counted in a private slot and
+ * metrics_enabled() returns false.
+ */
+void
+metrics_init(int n)
+{
+	assert(n > 0);
+
+	int fd = open("/dev/zero", O_RDWR);
+	if (fd == -1) {
+		syslog(LOG_ERR, "open /dev/zero error: %m");
+		return;
+	}
+	void *p = mmap(NULL, n * sizeof(struct slot),
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		syslog(LOG_ERR, "mmap error: %m");
+		return;
+	}
+
+	slots = p;
+	nslots = n;
+}
+
+/*
+ * Makes the calling worker count into the given slot. A respawned worker
+ * continues the counts of its predecessor.
+ */
+void
+metrics_attach(int slot)
+{
+	if (slots == NULL)
+		return;
+
+	assert(slot >= 0 && slot < nslots);
+
+	self = &slots[slot];
+}
+
+bool
+metrics_enabled(void)
+{
+	return (slots != NULL);
+}
+
+void
+metrics_count(enum metrics_counter counter, uint64_t n)
+{
+	assert(counter < METRICS_NCOUNTERS);
+
+	self->counters[counter] += n;
+}
+
+void
+metrics_request(char type)
+{
+	self->requests[(unsigned char)type % NTYPES]++;
+}
+
+/*
+ * Counts an error by its class, which is the message passed to send_error()
+ * without the "E: " prefix. Classes beyond MAXERRORS share the last entry.
+ */
+void
+metrics_error(const char *error)
+{
+	assert(error != NULL);
+
+	if (strncmp(error, "E: ", 3) == 0)
+		error += 3;
+
+	struct errorclass *e = self->errors;
+	for (int i = 0; i < MAXERRORS - 1; i++, e++) {
+		if (e->name[0] == '\0') {
+			snprintf(e->name, sizeof(e->name), "%s", error);
+			break;
+		}
+		if (strncmp(e->name, error, sizeof(e->name) - 1) == 0)
+			break;
+	}
+	if (e == &self->errors[MAXERRORS - 1])
+		strcpy(e->name, "other");
+	e->count++;
+}
+
+/*
+ * Records the time passed since start and returns it in microseconds.
+ */
+uint64_t
+metrics_observe(enum metrics_histogram histogram,
+    const struct timespec *start)
+{
+	assert(histogram < METRICS_NHISTOGRAMS);
+	assert(start != NULL);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	int64_t usec = (int64_t)(now.tv_sec - start->tv_sec) * 1000000 +
+	    (now.tv_nsec - start->tv_nsec) / 1000;
+	if (usec < 0)
+		usec = 0;
+
+	struct histogram *h = &self->histograms[histogram];
+	h->buckets[bucket(usec)]++;
+	h->sum += usec;
+	h->count++;
+
+	return (usec);
+}
+
+/*
+ * Writes the sum over all workers in the Prometheus text exposition format,
+ * as a text file entity.
+ */
+void
+metrics_write(FILE *out)
+{
+	assert(out != NULL);
+
+	uint64_t counters[METRICS_NCOUNTERS] = { 0 };
+	uint64_t requests[NTYPES] = { 0 };
+	struct errorclass errors[MAXERRORS];
+	memset(errors, 0, sizeof(errors));
+
+	for (int s = 0; s < nslots; s++) {
+		for (int i = 0; i < METRICS_NCOUNTERS; i++)
+			counters[i] += slots[s].counters[i];
+		for (int i = 0; i < NTYPES; i++)
+			requests[i] += slots[s].requests[i];
+		for (int i = 0; i < MAXERRORS; i++) {
+			const struct errorclass *e = &slots[s].errors[i];
+			if (e->name[0] == '\0')
+				break;
+			int j = 0;
+			while (j < MAXERRORS - 1 &&
+			    errors[j].name[0] != '\0' &&
+			    strcmp(errors[j].name, e->name) != 0)
+				j++;
+			if (j == MAXERRORS - 1)
+				strcpy(errors[j].name, "other");
+			else if (errors[j].name[0] == '\0')
+				strcpy(errors[j].name, e->name);
+			errors[j].count += e->count;
+		}
+	}
+
+	fprintf(out, "# TYPE mgopherd_workers gauge\r\n");
+	fprintf(out, "mgopherd_workers %d\r\n", nslots);
+
+	fprintf(out, "# TYPE mgopherd_requests_total counter\r\n");
+	for (int i = 0; i < NTYPES; i++)
+		if (requests[i] > 0)
+			fprintf(out, "mgopherd_requests_total{type=\"%c\"} %"
+			    PRIu64 "\r\n", i, requests[i]);
+
+	fprintf(out, "# TYPE mgopherd_errors_total counter\r\n");
+	for (int i = 0; i < MAXERRORS && errors[i].name[0] != '\0'; i++)
+		fprintf(out, "mgopherd_errors_total{class=\"%s\"} %" PRIu64
+		    "\r\n", errors[i].name, errors[i].count);
+
+	for (int i = 0; i < METRICS_NCOUNTERS; i++) {
+		if (counternames[i] == NULL)
+			continue;
+		fprintf(out, "# TYPE %s counter\r\n", counternames[i]);
+		fprintf(out, "%s %" PRIu64 "\r\n", counternames[i],
+		    counters[i]);
+	}
+
+	/* Every hit counter is directly followed by its miss counter. */
+	fprintf(out, "# TYPE mgopherd_cache_hits_total counter\r\n");
+	for (int i = 0; i < METRICS_NCOUNTERS; i++)
+		if (cachenames[i] != NULL)
+			fprintf(out, "mgopherd_cache_hits_total{cache=\"%s\"} %"
+			    PRIu64 "\r\n", cachenames[i], counters[i]);
+	fprintf(out, "# TYPE mgopherd_cache_misses_total counter\r\n");
+	for (int i = 0; i < METRICS_NCOUNTERS; i++)
+		if (cachenames[i] != NULL)
+			fprintf(out, "mgopherd_cache_misses_total{cache=\"%s\"}"
+			    " %" PRIu64 "\r\n", cachenames[i],
+			    counters[i + 1]);
+
+	fprintf(out, "# TYPE mgopherd_timeouts_total counter\r\n");
+	for (int i = 0; i < METRICS_NCOUNTERS; i++)
+		if (timeoutnames[i] != NULL)
+			fprintf(out, "mgopherd_timeouts_total{deadline=\"%s\"}"
+			    " %" PRIu64 "\r\n", timeoutnames[i], counters[i]);
+
+	for (int i = 0; i < METRICS_NHISTOGRAMS; i++)
+		write_histogram(out, i);
+
+	fputs(".\r\n", out);
+}
+
+static int
+bucket(uint64_t usec)
+{
+	if (usec < SUBBUCKETS)
+		return (usec);
+
+	int exponent = 0;
+	for (uint64_t v = usec; v > 1; v >>= 1)
+		exponent++;
+	if (exponent > MAXEXPONENT)
+		return (NBUCKETS - 1);
+
+	int sub = (usec >> (exponent - SUBBITS)) & (SUBBUCKETS - 1);
+
+	return ((exponent - SUBBITS + 1) * SUBBUCKETS + sub);
+}
+
+/*
+ * Returns the smallest value in microseconds that is beyond bucket b.
+ */
+static uint64_t
+bucket_limit(int b)
+{
+	if (b < SUBBUCKETS)
+		return (b + 1);
+
+	int exponent = b / SUBBUCKETS + SUBBITS - 1;
+	uint64_t sub = b % SUBBUCKETS;
+
+	return ((SUBBUCKETS + sub + 1) << (exponent - SUBBITS));
+}
+
+/*
+ * The exposed buckets end at every power of two, so they do not change from
+ * one scrape to the next. The quantiles are taken from the finer internal
+ * buckets and reported as the upper limit of the bucket they fall into.
+ */
+static void
+write_histogram(FILE *out, enum metrics_histogram histogram)
+{
+	assert(out != NULL);
+
+	struct histogram h;
+	memset(&h, 0, sizeof(h));
+	for (int s = 0; s < nslots; s++) {
+		const struct histogram *sh = &slots[s].histograms[histogram];
+		for (int i = 0; i < NBUCKETS; i++)
+			h.buckets[i] += sh->buckets[i];
+		h.sum += sh->sum;
+		h.count += sh->count;
+	}
+
+	const char *name = histogramnames[histogram];
+	fprintf(out, "# TYPE %s_seconds histogram\r\n", name);
+	uint64_t cumulative = 0;
+	for (int i = 0; i < NBUCKETS; i++) {
+		cumulative += h.buckets[i];
+		if (i % SUBBUCKETS != SUBBUCKETS - 1)
+			continue;
+		/* Values are whole microseconds below the limit. */
+		fprintf(out, "%s_seconds_bucket{le=\"%.6f\"} %" PRIu64 "\r\n",
+		    name, (bucket_limit(i) - 1) / 1e6, cumulative);
+	}
+	fprintf(out, "%s_seconds_bucket{le=\"+Inf\"} %" PRIu64 "\r\n", name,
+	    h.count);
+	fprintf(out, "%s_seconds_sum %.6f\r\n", name, h.sum / 1e6);
+	fprintf(out, "%s_seconds_count %" PRIu64 "\r\n", name, h.count);
+
+	static const char *quantiles[] = { "0.5", "0.99", "0.999" };
+	fprintf(out, "# TYPE %s_quantile_seconds gauge\r\n", name);
+	for (size_t q = 0; q < sizeof(quantiles) / sizeof(*quantiles); q++) {
+		uint64_t rank = h.count * strtod(quantiles[q], NULL);
+		uint64_t seen = 0;
+		int i = 0;
+		while (i < NBUCKETS - 1 && seen + h.buckets[i] <= rank)
+			seen += h.buckets[i++];
+		fprintf(out, "%s_quantile_seconds{quantile=\"%s\"} %.6f\r\n",
+		    name, quantiles[q], h.count > 0 ?
+		    (bucket_limit(i) - 1) / 1e6 : 0.0);
+	}
+}
@@ -0,0 +1,66 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * The selector the metrics are served at. Components starting with a dot
+ * are rejected by the request validation, so it cannot hide a file.
+ */
+#define METRICS_SELECTOR	"/.metrics"
+
+enum metrics_counter {
+	METRICS_CONNECTIONS,
+	METRICS_BYTES,
+	METRICS_DIRENTS,
+	METRICS_MAGIC,
+	METRICS_ACCESSLOG_DROPPED,
+	METRICS_RATELIMITED,
+	METRICS_SCRIPT_STARTS,
+	METRICS_MENUCACHE_HIT,
+	METRICS_MENUCACHE_MISS,
+	METRICS_FILECACHE_HIT,
+	METRICS_FILECACHE_MISS,
+	METRICS_TYPECACHE_HIT,
+	METRICS_TYPECACHE_MISS,
+	METRICS_INDEXMENU_HIT,
+	METRICS_INDEXMENU_MISS,
+	METRICS_INDEXTYPE_HIT,
+	METRICS_INDEXTYPE_MISS,
+	METRICS_NAMEINDEX_HIT,
+	METRICS_NAMEINDEX_MISS,
+	METRICS_TIMEOUT_FIRSTBYTE,
+	METRICS_TIMEOUT_REQUEST,
+	METRICS_TIMEOUT_IDLE,
+	METRICS_TIMEOUT_THROUGHPUT,
+	METRICS_NCOUNTERS
+};
+
+enum metrics_histogram {
+	METRICS_REQUEST,
+	METRICS_MENU,
+	METRICS_SEARCH,
+	METRICS_NHISTOGRAMS
+};
+
+void metrics_init(int _nslots);
+void metrics_attach(int _slot);
+bool metrics_enabled(void);
+void metrics_count(enum metrics_counter _counter, uint64_t _n);
+void metrics_request(char _type);
+void metrics_error(const char *_error);
+uint64_t metrics_observe(enum metrics_histogram _histogram,
+    const struct timespec *_start);
+void metrics_write(FILE *_out);
+
+#endif /* !METRICS_H */
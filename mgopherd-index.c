@@ -0,0 +1,396 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "classify.h"
+#include "findindex.h"
+#include "itemtypes.h"
+#include "options.h"
+#include "pack.h"
+#include "request.h"
+#include "search.h"
+#include "siteindex.h"
+#include "tools.h"
+
+#define GOPHERMAP	"gophermap"
+#define PAGEPARAM	"?page="
+
+struct walk {
+	struct opt_options *options;
+	struct siteindex *index;
+	struct search_builder *search;
+	struct findindex_builder *find;
+	struct pack_builder *pack;
+	struct arena *paths;
+	struct arena *requests;
+	FILE *null;
+	size_t dirs;
+	size_t files;
+};
+
+static void walk_directory(struct walk *w, const char *selector,
+    const char *path);
+static void index_menu(struct walk *w, const char *selector,
+    const char *path);
+static bool render_menu(struct walk *w, const char *request, char **buf,
+    size_t *len);
+static void pack_pages(struct walk *w, const char *selector);
+static void pack_file(struct walk *w, const char *selector,
+    const char *path, char type);
+static void add_file(struct walk *w, const char *selector,
+    const char *path, const struct stat *st, char type);
+
+/*
+ * Walks the served directory structure once and writes a site index holding
+ * the rendered menu of every directory and the item type of every regular
+ * file, exactly as mgopherd would serve them with the same options, a
+ * search index over all text files, a find index of all listed names and a
+ * pack of all menus and files.
+ */
+int
+main(int argc, char **argv)
+{
+	openlog("mgopherd-index", LOG_PID, LOG_USER);
+
+	struct opt_options *options = opt_parse(argc, argv);
+	assert(options != NULL);
+
+	if (opt_get_index(options) == NULL &&
+	    opt_get_search(options) == NULL &&
+	    opt_get_findindex(options) == NULL &&
+	    opt_get_pack(options) == NULL) {
+		fprintf(stderr, "no index given (-i, -N, -P or -S)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	classify_load(opt_get_typemap(options));
+
+	struct walk w = {
+		.options = options,
+		.index = NULL,
+		.search = NULL,
+		.find = NULL,
+		.pack = NULL,
+		.paths = arena_new(),
+		.requests = arena_new(),
+		.null = fopen("/dev/null", "w")
+	};
+	if (opt_get_index(options) != NULL)
+		w.index = siteindex_new(opt_get_host(options),
+		    opt_get_port(options));
+	if (opt_get_search(options) != NULL)
+		w.search = search_builder_new(opt_get_search(options));
+	if (opt_get_findindex(options) != NULL)
+		w.find = findindex_builder_new();
+	if (opt_get_pack(options) != NULL) {
+		w.pack = pack_builder_new(opt_get_pack(options),
+		    opt_get_host(options), opt_get_port(options));
+		if (w.pack == NULL) {
+			fprintf(stderr, "writing %s: %s\n",
+			    opt_get_pack(options), strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+	if ((opt_get_index(options) != NULL && w.index == NULL) ||
+	    (opt_get_search(options) != NULL && w.search == NULL) ||
+	    (opt_get_findindex(options) != NULL && w.find == NULL) ||
+	    w.paths == NULL || w.requests == NULL) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (w.null == NULL) {
+		fprintf(stderr, "fopen /dev/null: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	walk_directory(&w, "/", opt_get_root(options));
+
+	if (w.index != NULL && !siteindex_write(w.index,
+	    opt_get_index(options))) {
+		fprintf(stderr, "writing %s: %s\n", opt_get_index(options),
+		    strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (w.search != NULL && !search_builder_write(w.search,
+	    opt_get_search(options))) {
+		fprintf(stderr, "writing %s: %s\n", opt_get_search(options),
+		    strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (w.find != NULL && !findindex_builder_write(w.find,
+	    opt_get_findindex(options))) {
+		fprintf(stderr, "writing %s: %s\n",
+		    opt_get_findindex(options), strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (w.pack != NULL && !pack_builder_write(w.pack)) {
+		fprintf(stderr, "writing %s: %s\n", opt_get_pack(options),
+		    strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	syslog(LOG_INFO, "indexed %zu directories and %zu files", w.dirs,
+	    w.files);
+
+	fclose(w.null);
+	arena_free(w.requests);
+	arena_free(w.paths);
+	pack_builder_free(w.pack);
+	findindex_builder_free(w.find);
+	search_builder_free(w.search);
+	siteindex_free(w.index);
+	opt_free(options);
+
+	closelog();
+}
+
+static void
+walk_directory(struct walk *w, const char *selector, const char *path)
+{
+	assert(w != NULL);
+	assert(selector != NULL);
+	assert(path != NULL);
+
+	if (w->index != NULL || w->pack != NULL)
+		index_menu(w, selector, path);
+
+	DIR *dir = opendir(path);
+	if (dir == NULL) {
+		fprintf(stderr, "opendir %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+
+		struct arena_mark mark = arena_mark(w->paths);
+		char *p = tool_join_path(w->paths, path, entry->d_name,
+		    w->null);
+		char *s = tool_join_path(w->paths, selector, entry->d_name,
+		    w->null);
+		struct stat st;
+		if (p == NULL || s == NULL || lstat(p, &st) == -1) {
+			arena_rewind(w->paths, mark);
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode)) {
+			if (w->find != NULL &&
+			    request_listed(p, IT_DIR, w->null) &&
+			    !findindex_builder_add(w->find, s, IT_DIR)) {
+				fprintf(stderr, "malloc: %s\n",
+				    strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			walk_directory(w, s, p);
+		} else if (S_ISREG(st.st_mode)) {
+			char type = request_itemtype(p, w->null);
+			if (type != IT_IGNORE)
+				add_file(w, s, p, &st, type);
+		}
+
+		arena_rewind(w->paths, mark);
+	}
+
+	closedir(dir);
+}
+
+/*
+ * Renders the menu of a directory through request_handle(), so it is the
+ * very same menu mgopherd would send. The stamps are taken first: if the
+ * directory changes while it is rendered, the entry is simply never used.
+ */
+static void
+index_menu(struct walk *w, const char *selector, const char *path)
+{
+	assert(w != NULL);
+	assert(selector != NULL);
+	assert(path != NULL);
+
+	struct arena_mark mark = arena_mark(w->paths);
+	char *map = tool_join_path(w->paths, path, GOPHERMAP, w->null);
+	struct stat dir, ms;
+	if (map == NULL || stat(path, &dir) == -1) {
+		arena_rewind(w->paths, mark);
+		return;
+	}
+	bool hasmap = (stat(map, &ms) == 0);
+	arena_rewind(w->paths, mark);
+
+	char *buf;
+	size_t len;
+	if (!render_menu(w, selector, &buf, &len)) {
+		fprintf(stderr, "not indexing %s\n", selector);
+		return;
+	}
+
+	if (w->pack != NULL) {
+		if (!pack_builder_add_menu(w->pack, selector, buf, len)) {
+			fprintf(stderr, "writing %s: %s\n",
+			    opt_get_pack(w->options), strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		pack_pages(w, selector);
+	}
+
+	if (w->index == NULL)
+		free(buf);
+	else if (!siteindex_add_menu(w->index, selector, &dir,
+	    hasmap ? &ms : NULL, buf, len)) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	w->dirs++;
+}
+
+/*
+ * Renders the answer to request into a buffer that has to be freed by the
+ * caller. False is returned if request_handle() failed.
+ */
+static bool
+render_menu(struct walk *w, const char *request, char **buf, size_t *len)
+{
+	assert(w != NULL);
+	assert(request != NULL);
+	assert(buf != NULL);
+	assert(len != NULL);
+
+	char r[LINE_MAX];
+	if (strlen(request) >= sizeof(r))
+		return (false);
+	strcpy(r, request);
+
+	*buf = NULL;
+	*len = 0;
+	FILE *out = open_memstream(buf, len);
+	if (out == NULL) {
+		fprintf(stderr, "open_memstream: %s\n", strerror(errno));
+		return (false);
+	}
+
+	struct response response = {
+		.out = out,
+		.fd = -1,
+		.text = false,
+		.cached = NULL,
+		.data = NULL
+	};
+	bool success = request_handle(w->options, w->requests, r, &response);
+	if (fclose(out) == EOF)
+		success = false;
+
+	if (response.fd != -1) {
+		close(response.fd);
+		success = false;
+	}
+	if (!success) {
+		free(*buf);
+		*buf = NULL;
+	}
+
+	return (success);
+}
+
+/*
+ * Packs the pages after the first of a menu that is split into pages, until
+ * mgopherd would reject the page number.
+ */
+static void
+pack_pages(struct walk *w, const char *selector)
+{
+	assert(w != NULL);
+	assert(selector != NULL);
+
+	if (opt_get_pagesize(w->options) == 0)
+		return;
+
+	for (size_t page = 2;; page++) {
+		char request[LINE_MAX];
+		snprintf(request, sizeof(request), "%s" PAGEPARAM "%zu",
+		    selector, page);
+
+		char *buf;
+		size_t len;
+		if (!render_menu(w, request, &buf, &len))
+			return;
+		bool success = pack_builder_add_menu(w->pack, request, buf,
+		    len);
+		free(buf);
+		if (!success) {
+			fprintf(stderr, "writing %s: %s\n",
+			    opt_get_pack(w->options), strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+/*
+ * Packs a file as mgopherd would send it: type 0 as a text entity, all
+ * other types as they are.
+ */
+static void
+pack_file(struct walk *w, const char *selector, const char *path, char type)
+{
+	assert(w != NULL);
+	assert(selector != NULL);
+	assert(path != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		return;
+	}
+	if (!pack_builder_add_file(w->pack, selector, type, fd,
+	    type == IT_FILE)) {
+		fprintf(stderr, "writing %s: %s\n", opt_get_pack(w->options),
+		    strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	close(fd);
+}
+
+static void
+add_file(struct walk *w, const char *selector, const char *path,
+    const struct stat *st, char type)
+{
+	assert(w != NULL);
+	assert(selector != NULL);
+	assert(path != NULL);
+	assert(st != NULL);
+
+	bool success = true;
+	if (w->index != NULL)
+		success = siteindex_add_file(w->index, st, type);
+	if (success && w->search != NULL && type == IT_FILE)
+		success = search_builder_add(w->search, selector, path, st);
+	if (success && w->find != NULL && request_listed(path, type, w->null))
+		success = findindex_builder_add(w->find, selector, type);
+	if (!success) {
+		fprintf(stderr, "malloc: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (w->pack != NULL)
+		pack_file(w, selector, path, type);
+	w->files++;
+}
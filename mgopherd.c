@@ -7,52 +7,61 @@
 
 #define _POSIX_C_SOURCE 200809
 
-#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
 
 #include <assert.h>
-#include <dirent.h>
 #include <errno.h>
 #include <limits.h>
-#include <regex.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
-#include <strings.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
-#include "gophermap.h"
-#include "itemtypes.h"
+#include "accesslog.h"
+#include "arena.h"
+#include "classify.h"
+#include "filecache.h"
+#include "findindex.h"
+#include "menucache.h"
 #include "options.h"
+#include "pack.h"
+#include "ratelimit.h"
+#include "request.h"
+#include "script.h"
+#include "search.h"
 #include "send.h"
-#include "tools.h"
-
-#define GOPHERMAP	"gophermap"
-#define REQUESTREGEX	"^(/|(/[^\\.][^/]*)*)$"
-#define BINBLOCK	1024
-
-struct context {
-	const char *selector;
-	const char *path;
-	FILE *out;
-};
-
-static void handle_directory(struct opt_options *options,
-    struct context *context);
-static void write_menu(struct opt_options *options, struct context *context);
-static void write_gophermap(struct opt_options *options,
-    struct context *context, const char *map);
-static char itemtype(const char *path, FILE *out);
-static void write_binary_file(struct context *context);
-static void write_text_file(struct context *context);
-static int entry_select(const struct dirent *entry);
-static bool check_rights(const char *path, char type, FILE *out);
-static bool check_request(const char *request, FILE *out);
+#include "server.h"
+#include "siteindex.h"
+#include "transfer.h"
+
+#define OUTBUFSIZE	(64 * 1024)
+#define SCRIPTTIMEOUT	2	/* seconds */
+
+static volatile sig_atomic_t expired;
+
+static bool read_request(struct opt_options *options, char *request);
+static void handle_alarm(int sig);
+static bool write_file(int fd, bool text, long idle, FILE *out,
+    uint64_t *sent);
+static bool wait_writable(int fd, const struct timespec *since, long idle);
+static void log_access(const struct timespec *start,
+    const struct sockaddr *peer, socklen_t peerlen, const char *request,
+    char type, enum accesslog_status status, uint64_t bytes);
 
 int
 main(int argc, char **argv)
 {
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
 	openlog("mgopherd", LOG_PID, LOG_USER);
 
 	struct opt_options *options;
@@ -60,6 +69,54 @@ main(int argc, char **argv)
 	options = opt_parse(argc, argv);
 	assert(options != NULL);
 
+	classify_load(opt_get_typemap(options));
+	if (opt_get_index(options) != NULL)
+		siteindex_open(opt_get_index(options), opt_get_host(options),
+		    opt_get_port(options));
+	if (opt_get_search(options) != NULL)
+		search_open(opt_get_search(options));
+	if (opt_get_findindex(options) != NULL)
+		findindex_open(opt_get_findindex(options));
+	if (opt_get_pack(options) != NULL)
+		pack_open(opt_get_pack(options), opt_get_host(options),
+		    opt_get_port(options));
+	if (opt_get_accesslog(options) != NULL)
+		accesslog_open(opt_get_accesslog(options));
+	/* A worker serves none of its other connections while a script runs. */
+	if (opt_get_scripts(options) > 0) {
+		long timeout = opt_get_idletimeout(options);
+		if (opt_get_daemon(options) &&
+		    (timeout == 0 || timeout > SCRIPTTIMEOUT))
+			timeout = SCRIPTTIMEOUT;
+		script_init(opt_get_scripts(options), timeout);
+	}
+
+	if (opt_get_daemon(options)) {
+		menucache_init(opt_get_menucache(options));
+		filecache_init(opt_get_filecache(options),
+		    opt_get_filecachemax(options));
+		ratelimit_init(opt_get_addresslimit(options),
+		    opt_get_prefixlimit(options));
+		server_run(options);
+
+		accesslog_close();
+		opt_free(options);
+		closelog();
+		exit(EXIT_SUCCESS);
+	}
+
+	/*
+	 * Large menus would otherwise go out in BUFSIZ sized writes.
+	 */
+	if (setvbuf(stdout, NULL, _IOFBF, OUTBUFSIZE) != 0)
+		syslog(LOG_WARNING, "setvbuf error: %m");
+
+	struct sockaddr_storage peer;
+	socklen_t peerlen = sizeof(peer);
+	if (getpeername(STDIN_FILENO, (struct sockaddr *)&peer,
+	    &peerlen) == -1)
+		peerlen = 0;
+
 	char *request = malloc(LINE_MAX);
 	if (request == NULL) {
 		syslog(LOG_ERR, "malloc error: %m");
@@ -69,7 +126,16 @@ main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
-	if (fgets(request, LINE_MAX, stdin) == NULL) {
+	if (!read_request(options, request)) {
+		if (expired) {
+			syslog(LOG_NOTICE, "request timed out");
+			if (accesslog_enabled()) {
+				log_access(&start, (struct sockaddr *)&peer,
+				    peerlen, "", '-', ACCESSLOG_TIMEOUT, 0);
+				accesslog_close();
+			}
+			exit(EXIT_FAILURE);
+		}
 		if (ferror(stdin)) {
 			syslog(LOG_ERR, "fgets error: %m");
 			send_error(stdout, "E: fgets", strerror(errno));
@@ -78,419 +144,275 @@ main(int argc, char **argv)
 			send_eom(stdout);
 			exit(EXIT_FAILURE);
 		}
+		*request = '\0';
 	}
-	tool_strip_crlf(request);
 
-	if (!check_request(request, stdout)) {
-		syslog(LOG_NOTICE, "invalid request: \"%s\"", request);
-		send_error(stdout, "E: request", request);
-		send_info(stdout, "I: Your request seems to be invalid.", NULL);
+	struct arena *arena = arena_new();
+	if (arena == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		send_error(stdout, "E: malloc", strerror(errno));
+		send_info(stdout, "I: I could not allocate memory.", NULL);
 		send_eom(stdout);
 		exit(EXIT_FAILURE);
 	}
 
-	if (*request == '\0') {
-		request[0] = '/';
-		request[1] = '\0';
+	/*
+	 * With an access log the menu or message is gathered first, so its
+	 * size is known.
+	 */
+	FILE *out = stdout;
+	char *buf = NULL;
+	size_t buflen = 0;
+	if (accesslog_enabled()) {
+		out = open_memstream(&buf, &buflen);
+		if (out == NULL) {
+			syslog(LOG_ERR, "open_memstream error: %m");
+			out = stdout;
+		}
 	}
-	syslog(LOG_INFO, "selector: \"%s\"", request);
 
-	char *path = tool_join_path(opt_get_root(options), request, stdout);
-	syslog(LOG_DEBUG, "path: \"%s\"", path);
-
-	struct context context = {
-		.selector = request,
-		.path = path,
-		.out = stdout
+	struct response response = {
+		.out = out,
+		.peer = (struct sockaddr *)&peer,
+		.peerlen = peerlen,
+		.fd = -1,
+		.text = false,
+		.cached = NULL,
+		.data = NULL
 	};
 
-	switch (itemtype(context.path, context.out)){
-	case IT_FILE:
-		syslog(LOG_DEBUG, "serving text file");
-		write_text_file(&context);
-		break;
-	case IT_ARCHIVE:
-	case IT_BINARY:
-	case IT_GIF:
-	case IT_HTML:
-	case IT_IMAGE:
-	case IT_AUDIO:
-		syslog(LOG_DEBUG, "serving binary file");
-		write_binary_file(&context);
-		break;
-	case IT_DIR:
-		syslog(LOG_DEBUG, "serving directory");
-		handle_directory(options, &context);
-		break;
-	case IT_IGNORE:
-	default:
-		syslog(LOG_NOTICE, "invalid item: \"%s\"", context.path);
-		send_error(context.out, "E: request", request);
-		send_info(context.out, "I: You requested an invalid item.",
-		    NULL);
-		send_eom(context.out);
-		exit(EXIT_FAILURE);
+	enum accesslog_status status = ACCESSLOG_OK;
+	if (!request_handle(options, arena, request, &response))
+		status = ACCESSLOG_ERROR;
+
+	uint64_t bytes = 0;
+	if (out != stdout) {
+		if (fclose(out) == EOF)
+			syslog(LOG_ERR, "fclose error: %m");
+		fwrite(buf, 1, buflen, stdout);
+		bytes += buflen;
+		free(buf);
+	}
+	if (response.fd != -1 && !write_file(response.fd, response.text,
+	    opt_get_idletimeout(options), stdout, &bytes))
+		status = expired ? ACCESSLOG_TIMEOUT : ACCESSLOG_ABORTED;
+	if (response.cached != NULL) {
+		size_t len;
+		const char *data = filecache_data(response.cached, &len);
+		fwrite(data, 1, len, stdout);
+		filecache_release(response.cached);
+		bytes += len;
+	}
+	if (response.data != NULL) {
+		fwrite(response.data, 1, response.datalen, stdout);
+		bytes += response.datalen;
 	}
 
-	free(path);
+	if (accesslog_enabled()) {
+		if (fflush(stdout) == EOF && status == ACCESSLOG_OK)
+			status = ACCESSLOG_ABORTED;
+		log_access(&start, (struct sockaddr *)&peer, peerlen, request,
+		    response.type, status, bytes);
+		accesslog_close();
+	}
+
+	arena_free(arena);
 	free(request);
 	opt_free(options);
 
 	closelog();
+
+	exit(status == ACCESSLOG_OK ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
+/*
+ * Reads the request line into request, a buffer of LINE_MAX bytes. The first
+ * byte and the whole line have to arrive within their deadlines; expired is
+ * set if they do not. Afterwards, a write to the client that makes no
+ * progress for the idle timeout fails.
+ */
 static bool
-check_request(const char *request, FILE *out)
+read_request(struct opt_options *options, char *request)
 {
+	assert(options != NULL);
 	assert(request != NULL);
-	assert(out != NULL);
 
-	bool isvalid = true;
-	regex_t re;
-
-	int ret = regcomp(&re, REQUESTREGEX, REG_EXTENDED | REG_NOSUB);
-	if (ret != 0) {
-		char errbuf[128];
-		regerror(ret, &re, errbuf, sizeof(errbuf));
-		syslog(LOG_ERR, "regcomp: %s", errbuf);
-		send_error(out, "E: regcomp", errbuf);
-		send_info(out, "I: I could not compile a regular expression.",
-		    NULL);
-		send_eom(out);
-		exit(EXIT_FAILURE);
-	}
+	long firstbyte = opt_get_firstbyte(options);
+	long requesttimeout = opt_get_requesttimeout(options);
+	long idletimeout = opt_get_idletimeout(options);
 
-	ret = regexec(&re, request, 0, NULL, 0);
-	if (ret != 0) {
-		if (ret != REG_NOMATCH) {
-			char errbuf[128];
-			regerror(ret, &re, errbuf, sizeof(errbuf));
-			syslog(LOG_ERR, "regexec: %s", errbuf);
-			send_error(out, "E: regcomp", errbuf);
-			send_info(out, "I: I could not compile a regular "
-			    "expression.", NULL);
-			send_eom(out);
-			exit(EXIT_FAILURE);
+	if (firstbyte > 0) {
+		struct pollfd pfd = {
+			.fd = STDIN_FILENO,
+			.events = POLLIN
+		};
+		int n;
+		do
+			n = poll(&pfd, 1, firstbyte * 1000);
+		while (n == -1 && errno == EINTR);
+		if (n == 0) {
+			expired = 1;
+			return (false);
 		}
-
-		isvalid = false;
 	}
 
-	regfree(&re);
-
-	return (isvalid);
-}
-
-static void
-handle_directory(struct opt_options *options, struct context *context)
-{
-	assert(options != NULL);
-	assert(context != NULL);
+	/*
+	 * Without SA_RESTART the alarm interrupts the read below fgets().
+	 */
+	if (requesttimeout > 0) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = handle_alarm;
+		sigemptyset(&sa.sa_mask);
+		if (sigaction(SIGALRM, &sa, NULL) == -1)
+			syslog(LOG_WARNING, "sigaction error: %m");
+		else
+			alarm(requesttimeout);
+	}
 
-	char *map = tool_join_path(context->path, GOPHERMAP, context->out);
+	char *line = fgets(request, LINE_MAX, stdin);
+	alarm(0);
+	if (line == NULL || expired)
+		return (false);
 
-	if (check_rights(map, IT_FILE, context->out))
-		write_gophermap(options, context, map);
-	else
-		write_menu(options, context);
+	if (idletimeout > 0) {
+		struct timeval tv = {
+			.tv_sec = idletimeout
+		};
+		if (setsockopt(STDOUT_FILENO, SOL_SOCKET, SO_SNDTIMEO, &tv,
+		    sizeof(tv)) == -1 && errno != ENOTSOCK)
+			syslog(LOG_WARNING, "setsockopt error: %m");
+	}
 
-	free(map);
+	return (true);
 }
 
 static void
-write_menu(struct opt_options *options, struct context *context)
+handle_alarm(int sig)
 {
-	assert(options != NULL);
-	assert(context != NULL);
-
-	struct dirent **dirents;
-	int entries = scandir(context->path, &dirents, &entry_select,
-	    &alphasort);
-	if (entries == -1) {
-		syslog(LOG_ERR, "scandir error: %m");
-		send_error(context->out, "E: scandir", strerror(errno));
-		send_info(context->out, "I: I have a problem scanning a "
-		    "directory.", context->path);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
-	}
-	for (int i = 0; i < entries; i++) {
-		char *item = dirents[i]->d_name;
-		char *path = tool_join_path(context->path, item, context->out);
-		char type = itemtype(path, context->out);
-		char *sel = tool_join_path(context->selector, item,
-		    context->out);
-
-		if (!check_rights(path, type, context->out)) {
-			syslog(LOG_DEBUG, "missing rights: \"%s\"", path);
-			free(sel);
-			free(path);
-			free(dirents[i]);
-			continue;
-		}
-
-		struct item it = {
-			.type = type,
-			.display = item,
-			.selector = sel,
-			.host = opt_get_host(options),
-			.port = opt_get_port(options)
-		};
+	(void)sig;
 
-		send_item(context->out, &it);
-
-		free(sel);
-		free(path);
-		free(dirents[i]);
-	}
-	send_eom(context->out);
-
-	free(dirents);
+	expired = 1;
 }
 
+/*
+ * Sends the file fd to out and adds the number of bytes sent to sent. An
+ * error message is sent if the transfer fails, which may still reach the
+ * client. The transfer is given up and expired is set if it makes no
+ * progress for idle seconds.
+ */
 static bool
-check_rights(const char *path, char type, FILE *out)
+write_file(int fd, bool text, long idle, FILE *out, uint64_t *sent)
 {
-	assert(path != NULL);
+	assert(fd != -1);
 	assert(out != NULL);
+	assert(sent != NULL);
 
-	int mode;
-	switch (type) {
-	case IT_FILE:
-	case IT_ARCHIVE:
-	case IT_BINARY:
-	case IT_GIF:
-	case IT_HTML:
-	case IT_IMAGE:
-	case IT_AUDIO:
-		mode = R_OK;
-		break;
-	case IT_DIR:
-		mode = R_OK | X_OK;
-		break;
-	case IT_IGNORE:
-	default:
+	if (fflush(out) == EOF) {
+		syslog(LOG_ERR, "fflush error: %m");
+		close(fd);
 		return (false);
 	}
 
-	if (access(path, mode) == -1) {
-		if (errno != EACCES && errno != ENOENT) {
-			syslog(LOG_ERR, "access error: %m");
-			send_error(out, "E: accesss", strerror(errno));
-			send_info(out, "I: I couldn't check access rights "
-			    "for an item.", path);
-		}
+	struct transfer t;
+	if (!transfer_init(&t, fd, fileno(out), text)) {
+		send_error(out, "E: transfer", strerror(errno));
+		send_info(out, "I: I have a problem reading your requested "
+		    "item.", NULL);
+		send_eom(out);
+		transfer_free(&t);
 		return (false);
 	}
 
-	return (true);
-}
-
-static int
-entry_select(const struct dirent *entry)
-{
-	assert(entry != NULL);
-
-	if (entry->d_name[0] == '.')
-		return (0);
-
-	return (1);
-}
-
-static char
-itemtype(const char *path, FILE *out)
-{
-	assert(path != NULL);
-
-	struct stat s;
-	if (lstat(path, &s) == -1) {
-		syslog(LOG_ERR, "lstat error: %m");
-		send_error(out, "E: lstat", strerror(errno));
-		send_info(out, "I: I could not get file status.", path);
-		return (IT_IGNORE);
+	/*
+	 * Even with a blocking out, a transfer may have to wait again: if out
+	 * is a pipe or the send timeout of a socket passed.
+	 */
+	enum transfer_status status;
+	struct timespec progress;
+	clock_gettime(CLOCK_MONOTONIC, &progress);
+	for (;;) {
+		off_t before = t.sent;
+		status = transfer_run(&t, fileno(out));
+		if (status != TRANSFER_AGAIN)
+			break;
+		if (t.sent != before)
+			clock_gettime(CLOCK_MONOTONIC, &progress);
+		else if (!wait_writable(fileno(out), &progress, idle))
+			break;
 	}
+	*sent += t.sent;
 
-	char it;
-	if (S_ISREG(s.st_mode)) {
-		char *mime = tool_mimetype(path, out);
-
-		if (strcmp(mime, "text/html") == 0)
-			it = IT_HTML;
-		else if (strncmp(mime, "text/", 5) == 0)
-			it = IT_FILE;
-		else if (strcmp(mime, "image/gif") == 0)
-			it = IT_GIF;
-		else if (strncmp(mime, "image/", 6) == 0)
-			it = IT_IMAGE;
-		else if ((strncmp(mime, "audio/", 6) == 0) ||
-		    (strcmp(mime, "application/ogg") == 0))
-			it = IT_AUDIO;
-		else if ((strcmp(mime, "application/x-bzip2") == 0) ||
-		    (strcmp(mime, "application/x-gzip") == 0) ||
-		    (strcmp(mime, "application/zip") == 0))
-			it = IT_ARCHIVE;
-		else
-			it = IT_BINARY;
-
-		free(mime);
-	} else if (S_ISDIR(s.st_mode))
-		it = IT_DIR;
-	else
-		it = IT_IGNORE;;
-
-	return (it);
-}
-
-static void
-write_binary_file(struct context *context)
-{
-	assert(context != NULL);
-
-	FILE *in = fopen(context->path, "r");
-	if (in == NULL) {
-		syslog(LOG_ERR, "fopen error: %m");
-		send_error(context->out, "E: fopen", strerror(errno));
-		send_info(context->out, "I: I could not open the requested "
-		    "item.", context->path);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
+	if (status == TRANSFER_AGAIN) {
+		syslog(LOG_NOTICE, "transfer timed out");
+		expired = 1;
+		transfer_free(&t);
+		return (false);
 	}
 
-	void *block = malloc(BINBLOCK);
-	if (block == NULL) {
-		syslog(LOG_ERR, "malloc error: %m");
-		send_error(context->out, "E: malloc", strerror(errno));
-		send_info(context->out, "I: I could not allocate memory.",
-		    NULL);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
+	if (status == TRANSFER_ERROR) {
+		syslog(LOG_ERR, "transfer error: %m");
+		send_error(out, "E: transfer", strerror(errno));
+		send_info(out, "I: I have a problem transferring your "
+		    "requested item.", NULL);
+		send_eom(out);
+		transfer_free(&t);
+		return (false);
 	}
 
-	size_t r;
-	while ((r = fread(block, 1, BINBLOCK, in)) > 0) {
-		size_t w = fwrite(block, 1, r, context->out);
-		if (w < r) {
-			syslog(LOG_ERR, "fwrite error: %m");
-			send_error(context->out, "E: fwrite", strerror(errno));
-			send_info(context->out, "I: I have a problem writing "
-			    "your requested item.", context->path);
-			send_eom(context->out);
-
-			free(block);
-			exit(EXIT_FAILURE);
-		}
-		
-		if (r < BINBLOCK) {
-			if (ferror(in)) {
-				syslog(LOG_ERR, "fread error: %m");
-				send_error(context->out, "E: fread",
-				    strerror(errno));
-				send_info(context->out, "I: I have a problem "
-				    "reading your requested item.",
-				    context->path);
-				send_eom(context->out);
-				exit(EXIT_FAILURE);
-			}
-			break;
-		}
-	}
+	transfer_free(&t);
 
-	free(block);
+	return (true);
 }
 
-static void
-write_text_file(struct context *context)
+/*
+ * Waits until fd can be written to. False is returned if that takes until
+ * idle seconds after since.
+ */
+static bool
+wait_writable(int fd, const struct timespec *since, long idle)
 {
-	assert(context != NULL);
-
-	FILE *in = fopen(context->path, "r");
-	if (in == NULL) {
-		syslog(LOG_ERR, "fopen error: %m");
-		send_error(context->out, "E: fopen", strerror(errno));
-		send_info(context->out, "I: I could not open the requested "
-		    "item.", context->path);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
-	}
-
-	void *line = malloc(LINE_MAX);
-	if (line == NULL) {
-		syslog(LOG_ERR, "malloc error: %m");
-		send_error(context->out, "E: malloc", strerror(errno));
-		send_info(context->out, "I: I could not allocate memory.",
-		    NULL);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
+	assert(fd != -1);
+	assert(since != NULL);
+
+	int timeout = -1;
+	if (idle > 0) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		long elapsed = (now.tv_sec - since->tv_sec) * 1000 +
+		    (now.tv_nsec - since->tv_nsec) / 1000000;
+		if (elapsed >= idle * 1000)
+			return (false);
+		timeout = idle * 1000 - elapsed;
 	}
 
-	while (fgets(line, LINE_MAX, in) != NULL) {
-		tool_strip_crlf(line);
-		send_line(context->out, line);
-	}
-	if (ferror(stdin)) {
-		syslog(LOG_ERR, "fgets error: %m");
-		send_error(context->out, "E: fgets", strerror(errno));
-		send_info(context->out, "I: I have a problem reading a "
-		    "requested text file.", context->path);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
-	}
-	send_eom(context->out);
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLOUT
+	};
+	if (poll(&pfd, 1, timeout) == 0)
+		return (false);
 
-	free(line);
+	return (true);
 }
 
 static void
-write_gophermap(struct opt_options *options, struct context *context,
-    const char *map)
+log_access(const struct timespec *start, const struct sockaddr *peer,
+    socklen_t peerlen, const char *request, char type,
+    enum accesslog_status status, uint64_t bytes)
 {
-	assert(options != NULL);
-	assert(context != NULL);
-
-	FILE *in = fopen(map, "r");
-	if (in == NULL) {
-		syslog(LOG_ERR, "fopen error: %m");
-		send_error(context->out, "E: fopen", strerror(errno));
-		send_info(context->out, "I: I could not open a gophermap.",
-		    map);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
-	}
-
-	void *line = malloc(LINE_MAX);
-	if (line == NULL) {
-		syslog(LOG_ERR, "malloc error: %m");
-		send_error(context->out, "E: malloc", strerror(errno));
-		send_info(context->out, "I: I could not allocate memory.",
-		    NULL);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
-	}
-
-	while (fgets(line, LINE_MAX, in) != NULL) {
-		tool_strip_crlf(line);
-		if (strchr(line, '\t') != NULL) {
-			struct item item;
-			if (!gophermap_parse_item(options, &item,
-			    context->selector, line, context->out)) {
-				send_info(context->out, "I: I encountered a "
-				    "problem parsing a gophermap.", map);
-				continue;
-			}
-			send_item(context->out, &item);
-			gophermap_free_item(&item);
-		} else
-			send_info(context->out, line, NULL);
-	}
-	if (ferror(stdin)) {
-		syslog(LOG_ERR, "fgets error: %m");
-		send_error(context->out, "E: fgets", strerror(errno));
-		send_info(context->out, "I: I have a problem reading a "
-		    "gophermap.", map);
-		send_eom(context->out);
-		exit(EXIT_FAILURE);
-	}
-	send_eom(context->out);
+	assert(start != NULL);
+	assert(peer != NULL);
+	assert(request != NULL);
 
-	free(line);
+	struct accesslog_entry entry = {
+		.start = *start,
+		.peer = peer,
+		.peerlen = peerlen,
+		.selector = request,
+		.type = type,
+		.status = status,
+		.bytes = bytes
+	};
+	accesslog_log(&entry);
 }
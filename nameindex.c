@@ -0,0 +1,609 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE	/* d_type constants */
+#endif
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "metrics.h"
+#include "nameindex.h"
+#include "send.h"
+#include "tools.h"
+
+#define MAGIC		"MGOPHNX"
+#define VERSION		2
+#define BYTEORDER	0x01020304
+
+/*
+ * A name index holds the visible names of a single directory in byte order,
+ * each with the d_type it was read with, so any range of them can be listed
+ * without reading or sorting the whole directory. It consists of a header,
+ * a table of records and a heap with the selector of the directory and all
+ * names. All offsets are relative to the start of the index.
+ *
+ * Indexes are kept in the name directory, one file per directory named by a
+ * hash of its selector, and carry the stat(2) stamp the directory had before
+ * it was read. Once the directory carries a different stamp, it is read
+ * again and merged into the old index: only names that are new have to be
+ * sorted.
+ */
+struct header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t size;
+	uint64_t selector;
+	struct tool_stamp dir;
+	uint64_t records;
+	uint64_t nnames;
+};
+
+struct record {
+	uint64_t name;
+	uint32_t len;
+	uint32_t type;
+};
+
+struct nameindex {
+	char *map;
+	size_t size;
+	bool mapped;
+	const struct header *header;
+	const struct record *records;
+};
+
+struct added {
+	char *name;
+	int type;
+};
+
+/*
+ * The result of reading a directory: seen holds the type plus one of every
+ * name of the old index that is still present, added the new names.
+ */
+struct scan {
+	const struct nameindex *old;
+	unsigned char *seen;
+	struct added *added;
+	size_t nadded;
+	size_t capacity;
+};
+
+struct merge {
+	const struct scan *scan;
+	size_t i;
+	size_t j;
+};
+
+static struct nameindex *map_index(const char *path, const char *selector);
+static bool read_directory(struct scan *s, const char *selector, int dirfd,
+    struct arena *arena, FILE *out);
+static struct nameindex *build_index(const struct scan *s,
+    const char *selector, const struct stat *dir, FILE *out);
+static bool merge_next(struct merge *m, const char **name, int *type);
+static bool lookup(const struct nameindex *ni, const char *name,
+    size_t *i);
+static void write_index(const struct nameindex *ni, const char *path);
+static char *index_path(struct arena *arena, const char *namedir,
+    const char *selector);
+static int compare_added(const void *a, const void *b);
+static void out_of_memory(FILE *out);
+
+/*
+ * Returns the name index of the directory dirfd reached by selector. With a
+ * name directory, an index that is still valid is mapped from there, and a
+ * new one is stored there if the directory holds at least persist names.
+ * Without one, the index is built in memory. If NULL is returned an error
+ * message has already been sent.
+ */
+struct nameindex *
+nameindex_open(const char *namedir, const char *selector, int dirfd,
+    size_t persist, struct arena *arena, FILE *out)
+{
+	assert(selector != NULL);
+	assert(dirfd != -1);
+	assert(arena != NULL);
+	assert(out != NULL);
+
+	struct stat dir;
+	if (fstat(dirfd, &dir) == -1) {
+		syslog(LOG_ERR, "fstat error: %m");
+		send_error(out, "E: fstat", strerror(errno));
+		send_info(out, "I: I could not get file status.", selector);
+		return (NULL);
+	}
+
+	char *path = NULL;
+	struct nameindex *old = NULL;
+	if (namedir != NULL) {
+		path = index_path(arena, namedir, selector);
+		if (path == NULL)
+			out_of_memory(out);
+		old = map_index(path, selector);
+		if (old != NULL &&
+		    tool_same_stamp(&old->header->dir, &dir, true)) {
+			metrics_count(METRICS_NAMEINDEX_HIT, 1);
+			return (old);
+		}
+		metrics_count(METRICS_NAMEINDEX_MISS, 1);
+	}
+
+	struct scan s = {
+		.old = old
+	};
+	if (old != NULL && old->header->nnames > 0) {
+		s.seen = calloc(old->header->nnames, 1);
+		if (s.seen == NULL)
+			out_of_memory(out);
+	}
+
+	struct nameindex *ni = NULL;
+	if (read_directory(&s, selector, dirfd, arena, out))
+		ni = build_index(&s, selector, &dir, out);
+	free(s.seen);
+	free(s.added);
+	bool stale = (old != NULL);
+	nameindex_close(old);
+
+	/*
+	 * A directory changed within the last second may change again without
+	 * its stamp changing, so its index is not kept yet.
+	 */
+	if (ni != NULL && path != NULL) {
+		if (ni->header->nnames < persist) {
+			if (stale)
+				unlink(path);
+		} else if (dir.st_mtime < time(NULL) - 1)
+			write_index(ni, path);
+	}
+
+	return (ni);
+}
+
+size_t
+nameindex_count(const struct nameindex *ni)
+{
+	assert(ni != NULL);
+
+	return (ni->header->nnames);
+}
+
+/*
+ * Returns the i-th name and its d_type, or NULL if the record is damaged.
+ */
+const char *
+nameindex_name(const struct nameindex *ni, size_t i, int *type)
+{
+	assert(ni != NULL);
+	assert(i < ni->header->nnames);
+	assert(type != NULL);
+
+	const struct record *r = &ni->records[i];
+	if (r->name >= ni->size || r->len >= ni->size - r->name ||
+	    ni->map[r->name + r->len] != '\0')
+		return (NULL);
+
+	*type = r->type;
+	return (ni->map + r->name);
+}
+
+void
+nameindex_close(struct nameindex *ni)
+{
+	if (ni == NULL)
+		return;
+
+	if (ni->mapped)
+		munmap(ni->map, ni->size);
+	else
+		free(ni->map);
+	free(ni);
+}
+
+/*
+ * Maps the index at path. Only the header is checked here, records are
+ * checked as they are used, so a page costs no more than its names.
+ */
+static struct nameindex *
+map_index(const char *path, const char *selector)
+{
+	assert(path != NULL);
+	assert(selector != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			syslog(LOG_ERR, "open name index error: %m");
+		return (NULL);
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) == -1) {
+		syslog(LOG_ERR, "fstat name index error: %m");
+		close(fd);
+		return (NULL);
+	}
+	if ((uintmax_t)s.st_size < sizeof(struct header) ||
+	    (uintmax_t)s.st_size > SIZE_MAX) {
+		syslog(LOG_ERR, "name index \"%s\" has an invalid size", path);
+		close(fd);
+		return (NULL);
+	}
+
+	void *m = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		syslog(LOG_ERR, "mmap name index error: %m");
+		return (NULL);
+	}
+
+	const struct header *h = m;
+	size_t size = s.st_size;
+	if (memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != VERSION || h->byteorder != BYTEORDER ||
+	    h->size != size || h->records != sizeof(struct header) ||
+	    h->nnames > (size - h->records) / sizeof(struct record) ||
+	    h->selector >= size ||
+	    memchr((char *)m + h->selector, '\0', size - h->selector) ==
+	    NULL) {
+		syslog(LOG_ERR, "ignoring damaged name index \"%s\"", path);
+		munmap(m, size);
+		return (NULL);
+	}
+	if (strcmp((char *)m + h->selector, selector) != 0) {
+		munmap(m, size);
+		return (NULL);
+	}
+
+	struct nameindex *ni = malloc(sizeof(struct nameindex));
+	if (ni == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		munmap(m, size);
+		return (NULL);
+	}
+	ni->map = m;
+	ni->size = size;
+	ni->mapped = true;
+	ni->header = h;
+	ni->records = (const struct record *)((char *)m + h->records);
+
+	return (ni);
+}
+
+/*
+ * Reads the directory once. Names known from the old index are only marked,
+ * all others are collected and sorted.
+ */
+static bool
+read_directory(struct scan *s, const char *selector, int dirfd,
+    struct arena *arena, FILE *out)
+{
+	assert(s != NULL);
+	assert(selector != NULL);
+	assert(arena != NULL);
+	assert(out != NULL);
+
+	int fd = dup(dirfd);
+	DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		syslog(LOG_ERR, "fdopendir error: %m");
+		send_error(out, "E: fdopendir", strerror(errno));
+		send_info(out, "I: I have a problem scanning a directory.",
+		    selector);
+		if (fd != -1)
+			close(fd);
+		return (false);
+	}
+
+	size_t scanned = 0;
+	struct dirent *dirent;
+	for (;;) {
+		errno = 0;
+		if ((dirent = readdir(dir)) == NULL)
+			break;
+		scanned++;
+		if (dirent->d_name[0] == '.')
+			continue;
+
+#ifdef DT_UNKNOWN
+		int type = dirent->d_type;
+#else
+		int type = 0;
+#endif
+		size_t i;
+		if (s->old != NULL && lookup(s->old, dirent->d_name, &i)) {
+			s->seen[i] = type + 1;
+			continue;
+		}
+
+		if (s->nadded == s->capacity) {
+			s->capacity = (s->capacity == 0) ? 64 :
+			    s->capacity * 2;
+			void *a = realloc(s->added,
+			    s->capacity * sizeof(*s->added));
+			if (a == NULL)
+				out_of_memory(out);
+			s->added = a;
+		}
+		s->added[s->nadded].name = arena_strndup(arena,
+		    dirent->d_name, strlen(dirent->d_name));
+		if (s->added[s->nadded].name == NULL)
+			out_of_memory(out);
+		s->added[s->nadded].type = type;
+		s->nadded++;
+	}
+	metrics_count(METRICS_DIRENTS, scanned);
+	if (errno != 0) {
+		syslog(LOG_ERR, "readdir error: %m");
+		send_error(out, "E: readdir", strerror(errno));
+		send_info(out, "I: I have a problem scanning a directory.",
+		    selector);
+		closedir(dir);
+		return (false);
+	}
+	closedir(dir);
+
+	if (s->nadded > 0)
+		qsort(s->added, s->nadded, sizeof(*s->added), &compare_added);
+
+	return (true);
+}
+
+/*
+ * Lays out a new index in memory from the merged old and new names.
+ */
+static struct nameindex *
+build_index(const struct scan *s, const char *selector,
+    const struct stat *dir, FILE *out)
+{
+	assert(s != NULL);
+	assert(selector != NULL);
+	assert(dir != NULL);
+	assert(out != NULL);
+
+	struct merge m = {
+		.scan = s
+	};
+	const char *name;
+	int type;
+	size_t nnames = 0;
+	size_t heap = strlen(selector) + 1;
+	while (merge_next(&m, &name, &type)) {
+		nnames++;
+		heap += strlen(name) + 1;
+	}
+
+	size_t records = sizeof(struct header);
+	size_t size = records + nnames * sizeof(struct record) + heap;
+	struct nameindex *ni = malloc(sizeof(struct nameindex));
+	char *map = calloc(1, size);
+	if (ni == NULL || map == NULL)
+		out_of_memory(out);
+
+	struct header *h = (struct header *)map;
+	memcpy(h->magic, MAGIC, sizeof(h->magic));
+	h->version = VERSION;
+	h->byteorder = BYTEORDER;
+	h->size = size;
+	h->records = records;
+	h->nnames = nnames;
+	tool_make_stamp(&h->dir, dir);
+
+	size_t offset = records + nnames * sizeof(struct record);
+	h->selector = offset;
+	memcpy(map + offset, selector, strlen(selector) + 1);
+	offset += strlen(selector) + 1;
+
+	struct record *r = (struct record *)(map + records);
+	m.i = m.j = 0;
+	while (merge_next(&m, &name, &type)) {
+		size_t len = strlen(name);
+		r->name = offset;
+		r->len = len;
+		r->type = type;
+		memcpy(map + offset, name, len + 1);
+		offset += len + 1;
+		r++;
+	}
+
+	ni->map = map;
+	ni->size = size;
+	ni->mapped = false;
+	ni->header = h;
+	ni->records = (const struct record *)(map + records);
+
+	return (ni);
+}
+
+/*
+ * Returns the next name in byte order from the old names that are still
+ * present and the new ones.
+ */
+static bool
+merge_next(struct merge *m, const char **name, int *type)
+{
+	assert(m != NULL);
+	assert(name != NULL);
+	assert(type != NULL);
+
+	const struct scan *s = m->scan;
+	const char *old = NULL;
+	int oldtype = 0;
+	if (s->old != NULL) {
+		while (m->i < s->old->header->nnames && s->seen[m->i] == 0)
+			m->i++;
+		if (m->i < s->old->header->nnames)
+			old = nameindex_name(s->old, m->i, &oldtype);
+	}
+
+	if (old != NULL && (m->j == s->nadded ||
+	    strcmp(old, s->added[m->j].name) < 0)) {
+		*name = old;
+		*type = s->seen[m->i] - 1;
+		m->i++;
+		return (true);
+	}
+	if (m->j < s->nadded) {
+		*name = s->added[m->j].name;
+		*type = s->added[m->j].type;
+		m->j++;
+		return (true);
+	}
+
+	return (false);
+}
+
+/*
+ * Finds name in the old index. A damaged record ends the search; the name
+ * is then taken as new.
+ */
+static bool
+lookup(const struct nameindex *ni, const char *name, size_t *i)
+{
+	assert(ni != NULL);
+	assert(name != NULL);
+	assert(i != NULL);
+
+	size_t lo = 0;
+	size_t hi = ni->header->nnames;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int type;
+		const char *n = nameindex_name(ni, mid, &type);
+		if (n == NULL)
+			return (false);
+
+		int cmp = strcmp(name, n);
+		if (cmp < 0)
+			hi = mid;
+		else if (cmp > 0)
+			lo = mid + 1;
+		else {
+			*i = mid;
+			return (true);
+		}
+	}
+
+	return (false);
+}
+
+/*
+ * Writes the index to a temporary file and renames it into place, so other
+ * workers keep the index they have mapped. Failing to store an index only
+ * costs time and is not reported to the client.
+ */
+static void
+write_index(const struct nameindex *ni, const char *path)
+{
+	assert(ni != NULL);
+	assert(path != NULL);
+
+	char tmp[PATH_MAX];
+	if (snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid()) >=
+	    (int)sizeof(tmp))
+		return;
+
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		syslog(LOG_WARNING, "open name index error: %m");
+		return;
+	}
+
+	bool success = true;
+	for (size_t off = 0; off < ni->size;) {
+		ssize_t w = write(fd, ni->map + off, ni->size - off);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			success = false;
+			break;
+		}
+		off += w;
+	}
+	if (close(fd) == -1)
+		success = false;
+	if (success && rename(tmp, path) == -1)
+		success = false;
+	if (!success) {
+		syslog(LOG_WARNING, "write name index error: %m");
+		unlink(tmp);
+	}
+}
+
+/*
+ * The file name is the FNV-1a hash of the selector. Colliding selectors
+ * just replace each other's index, as it records the selector it belongs
+ * to.
+ */
+static char *
+index_path(struct arena *arena, const char *namedir, const char *selector)
+{
+	assert(arena != NULL);
+	assert(namedir != NULL);
+	assert(selector != NULL);
+
+	uint64_t h = 0xcbf29ce484222325;
+	for (const char *p = selector; *p != '\0'; p++) {
+		h ^= (unsigned char)*p;
+		h *= 0x100000001b3;
+	}
+
+	size_t len = strlen(namedir) + 18;
+	char *path = arena_alloc(arena, len);
+	if (path == NULL)
+		return (NULL);
+	snprintf(path, len, "%s/%016jx", namedir, (uintmax_t)h);
+
+	return (path);
+}
+
+/*
+ * Plain byte order, like the menus.
+ */
+static int
+compare_added(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	const struct added *aa = a;
+	const struct added *ab = b;
+
+	return (strcmp(aa->name, ab->name));
+}
+
+static void
+out_of_memory(FILE *out)
+{
+	assert(out != NULL);
+
+	syslog(LOG_ERR, "malloc error: %m");
+	send_error(out, "E: malloc", strerror(errno));
+	send_info(out, "I: I could not allocate memory.", NULL);
+	send_eom(out);
+	exit(EXIT_FAILURE);
+}
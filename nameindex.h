@@ -0,0 +1,25 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef NAMEINDEX_H
+#define NAMEINDEX_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "arena.h"
+
+struct nameindex;
+
+struct nameindex *nameindex_open(const char *_namedir, const char *_selector,
+    int _dirfd, size_t _persist, struct arena *_arena, FILE *_out);
+size_t nameindex_count(const struct nameindex *_ni);
+const char *nameindex_name(const struct nameindex *_ni, size_t _i,
+    int *_type);
+void nameindex_close(struct nameindex *_ni);
+
+#endif /* !NAMEINDEX_H */
@@ -6,9 +6,12 @@
  */
 
 #define _POSIX_C_SOURCE 200809
+#define _XOPEN_SOURCE 700
 
 #include <assert.h>
 #include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -18,13 +21,49 @@
 #include "options.h"
 
 #define GOPHERPORT "70"
+#define MENUCACHE (16 * 1024 * 1024)
+#define FILECACHE (16 * 1024 * 1024)
+#define FILECACHEMAX (64 * 1024)
+#define FIRSTBYTE 10
+#define REQUESTTIMEOUT 30
+#define IDLETIMEOUT 60
 
 void usage(void);
+static long parse_number(const char *arg, const char *name, long min,
+    long max);
+static size_t parse_size(const char *arg, const char *name);
+static void parse_limit(const char *arg, const char *name,
+    struct ratelimit_limit *limit);
+static void parse_timeouts(const char *arg, struct opt_options *options);
 
 struct opt_options {
 	char *host;
 	char *port;
 	char *root;
+	char *typemap;
+	char *index;
+	char *accesslog;
+	char *namedir;
+	char *search;
+	char *findindex;
+	char *pack;
+	long scripts;
+	bool daemon;
+	long workers;
+	bool affinity;
+	bool metrics;
+	bool uring;
+	struct ratelimit_limit address;
+	struct ratelimit_limit prefix;
+	long firstbyte;
+	long requesttimeout;
+	long idletimeout;
+	size_t minrate;
+	size_t menucache;
+	size_t filecache;
+	size_t filecachemax;
+	long pagesize;
+	bool stream;
 };
 
 struct opt_options *opt_parse(int argc, char **argv)
@@ -42,9 +81,34 @@ struct opt_options *opt_parse(int argc, char **argv)
 	options->root = NULL;
 	options->host = NULL;
 	options->port = NULL;
+	options->typemap = NULL;
+	options->index = NULL;
+	options->accesslog = NULL;
+	options->namedir = NULL;
+	options->search = NULL;
+	options->findindex = NULL;
+	options->pack = NULL;
+	options->scripts = 0;
+	options->daemon = false;
+	options->workers = 0;
+	options->affinity = false;
+	options->metrics = false;
+	options->uring = false;
+	memset(&options->address, 0, sizeof(options->address));
+	memset(&options->prefix, 0, sizeof(options->prefix));
+	options->firstbyte = FIRSTBYTE;
+	options->requesttimeout = REQUESTTIMEOUT;
+	options->idletimeout = IDLETIMEOUT;
+	options->minrate = 0;
+	options->menucache = MENUCACHE;
+	options->filecache = FILECACHE;
+	options->filecachemax = FILECACHEMAX;
+	options->pagesize = 0;
+	options->stream = false;
 
 	int opt;
-	while ((opt = getopt(argc, argv, "r:H:p:h")) != -1) {
+	while ((opt = getopt(argc, argv,
+	    "r:H:p:t:i:l:dw:amuq:Q:k:K:T:B:c:f:F:g:G:sS:N:P:x:h")) != -1) {
 		switch (opt){
 		case 'r':
 			free(options->root);
@@ -76,6 +140,135 @@ struct opt_options *opt_parse(int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 't':
+			free(options->typemap);
+			options->typemap = strdup(optarg);
+			if (options->typemap == NULL) {
+				syslog(LOG_ERR, "strdup error: %m");
+				fprintf(stderr, "strdup options->typemap: %s\n",
+				    strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'i':
+			free(options->index);
+			options->index = strdup(optarg);
+			if (options->index == NULL) {
+				syslog(LOG_ERR, "strdup error: %m");
+				fprintf(stderr, "strdup options->index: %s\n",
+				    strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'l':
+			free(options->accesslog);
+			options->accesslog = strdup(optarg);
+			if (options->accesslog == NULL) {
+				syslog(LOG_ERR, "strdup error: %m");
+				fprintf(stderr, "strdup options->accesslog: "
+				    "%s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'd':
+			options->daemon = true;
+			break;
+		case 'w':
+			options->workers = parse_number(optarg, "workers", 0,
+			    1024);
+			break;
+		case 'a':
+			options->affinity = true;
+			break;
+		case 'm':
+			options->metrics = true;
+			break;
+		case 'u':
+			options->uring = true;
+			break;
+		case 'q':
+			parse_limit(optarg, "request rate", &options->address);
+			break;
+		case 'Q':
+			parse_limit(optarg, "prefix request rate",
+			    &options->prefix);
+			break;
+		case 'k':
+			options->address.conns = parse_number(optarg,
+			    "connection limit", 0, 1000000);
+			break;
+		case 'K':
+			options->prefix.conns = parse_number(optarg,
+			    "prefix connection limit", 0, 1000000);
+			break;
+		case 'T':
+			parse_timeouts(optarg, options);
+			break;
+		case 'B':
+			options->minrate = parse_size(optarg,
+			    "minimum transfer rate");
+			break;
+		case 'c':
+			options->menucache = parse_size(optarg, "menu cache");
+			break;
+		case 'f':
+			options->filecache = parse_size(optarg, "file cache");
+			break;
+		case 'F':
+			options->filecachemax = parse_size(optarg,
+			    "file cache limit");
+			break;
+		case 'g':
+			options->pagesize = parse_number(optarg, "page size", 0,
+			    1000000);
+			break;
+		case 'G':
+			free(options->namedir);
+			options->namedir = realpath(optarg, NULL);
+			if (options->namedir == NULL) {
+				syslog(LOG_ERR, "realpath error: %m");
+				fprintf(stderr, "realpath options->namedir: "
+				    "%s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			options->stream = true;
+			break;
+		case 'S':
+			free(options->search);
+			options->search = strdup(optarg);
+			if (options->search == NULL) {
+				syslog(LOG_ERR, "strdup error: %m");
+				fprintf(stderr, "strdup options->search: %s\n",
+				    strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'N':
+			free(options->findindex);
+			options->findindex = strdup(optarg);
+			if (options->findindex == NULL) {
+				syslog(LOG_ERR, "strdup error: %m");
+				fprintf(stderr, "strdup options->findindex: "
+				    "%s\n", strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'P':
+			free(options->pack);
+			options->pack = strdup(optarg);
+			if (options->pack == NULL) {
+				syslog(LOG_ERR, "strdup error: %m");
+				fprintf(stderr, "strdup options->pack: %s\n",
+				    strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'x':
+			options->scripts = parse_number(optarg,
+			    "script processes", 0, 1000);
+			break;
 		case 'h':
 			usage();
 			exit(EXIT_SUCCESS);
@@ -87,6 +280,14 @@ struct opt_options *opt_parse(int argc, char **argv)
 		}
 	}
 
+	/* Workers complete every menu before sending it. */
+	if (options->daemon && options->stream) {
+		syslog(LOG_NOTICE, "-s is not supported in daemon mode");
+		fputs("-s is not supported in daemon mode\n", stderr);
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
 	if (options->root == NULL) {
 		options->root = realpath(".", NULL);
 		if (options->root == NULL) {
@@ -122,6 +323,42 @@ struct opt_options *opt_parse(int argc, char **argv)
 	syslog(LOG_DEBUG, "options->root: \"%s\"", options->root);
 	syslog(LOG_DEBUG, "options->host: \"%s\"", options->host);
 	syslog(LOG_DEBUG, "options->port: \"%s\"", options->port);
+	syslog(LOG_DEBUG, "options->typemap: \"%s\"",
+	    options->typemap != NULL ? options->typemap : "");
+	syslog(LOG_DEBUG, "options->index: \"%s\"",
+	    options->index != NULL ? options->index : "");
+	syslog(LOG_DEBUG, "options->accesslog: \"%s\"",
+	    options->accesslog != NULL ? options->accesslog : "");
+	syslog(LOG_DEBUG, "options->daemon: %d", options->daemon);
+	syslog(LOG_DEBUG, "options->workers: %ld", options->workers);
+	syslog(LOG_DEBUG, "options->affinity: %d", options->affinity);
+	syslog(LOG_DEBUG, "options->metrics: %d", options->metrics);
+	syslog(LOG_DEBUG, "options->uring: %d", options->uring);
+	syslog(LOG_DEBUG, "options->address: %ld/%ld, %ld",
+	    options->address.rate, options->address.burst,
+	    options->address.conns);
+	syslog(LOG_DEBUG, "options->prefix: %ld/%ld, %ld",
+	    options->prefix.rate, options->prefix.burst,
+	    options->prefix.conns);
+	syslog(LOG_DEBUG, "options->timeouts: %ld:%ld:%ld",
+	    options->firstbyte, options->requesttimeout,
+	    options->idletimeout);
+	syslog(LOG_DEBUG, "options->minrate: %zu", options->minrate);
+	syslog(LOG_DEBUG, "options->menucache: %zu", options->menucache);
+	syslog(LOG_DEBUG, "options->filecache: %zu", options->filecache);
+	syslog(LOG_DEBUG, "options->filecachemax: %zu",
+	    options->filecachemax);
+	syslog(LOG_DEBUG, "options->pagesize: %ld", options->pagesize);
+	syslog(LOG_DEBUG, "options->namedir: \"%s\"",
+	    options->namedir != NULL ? options->namedir : "");
+	syslog(LOG_DEBUG, "options->stream: %d", options->stream);
+	syslog(LOG_DEBUG, "options->search: \"%s\"",
+	    options->search != NULL ? options->search : "");
+	syslog(LOG_DEBUG, "options->findindex: \"%s\"",
+	    options->findindex != NULL ? options->findindex : "");
+	syslog(LOG_DEBUG, "options->pack: \"%s\"",
+	    options->pack != NULL ? options->pack : "");
+	syslog(LOG_DEBUG, "options->scripts: %ld", options->scripts);
 
 	return (options);
 }
@@ -134,6 +371,13 @@ opt_free(struct opt_options *options)
 	free(options->root);
 	free(options->host);
 	free(options->port);
+	free(options->typemap);
+	free(options->index);
+	free(options->accesslog);
+	free(options->namedir);
+	free(options->search);
+	free(options->findindex);
+	free(options->pack);
 	free(options);
 }
 
@@ -164,9 +408,340 @@ opt_get_port(struct opt_options *options)
 	return (options->port);
 }
 
+char *
+opt_get_typemap(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->typemap);
+}
+
+char *
+opt_get_index(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->index);
+}
+
+char *
+opt_get_accesslog(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->accesslog);
+}
+
+bool
+opt_get_daemon(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->daemon);
+}
+
+long
+opt_get_workers(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->workers);
+}
+
+bool
+opt_get_affinity(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->affinity);
+}
+
+bool
+opt_get_metrics(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->metrics);
+}
+
+bool
+opt_get_uring(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->uring);
+}
+
+const struct ratelimit_limit *
+opt_get_addresslimit(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (&options->address);
+}
+
+const struct ratelimit_limit *
+opt_get_prefixlimit(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (&options->prefix);
+}
+
+long
+opt_get_firstbyte(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->firstbyte);
+}
+
+long
+opt_get_requesttimeout(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->requesttimeout);
+}
+
+long
+opt_get_idletimeout(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->idletimeout);
+}
+
+size_t
+opt_get_minrate(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->minrate);
+}
+
+size_t
+opt_get_menucache(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->menucache);
+}
+
+size_t
+opt_get_filecache(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->filecache);
+}
+
+size_t
+opt_get_filecachemax(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->filecachemax);
+}
+
+long
+opt_get_pagesize(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->pagesize);
+}
+
+char *
+opt_get_namedir(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->namedir);
+}
+
+bool
+opt_get_stream(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->stream);
+}
+
+char *
+opt_get_search(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->search);
+}
+
+char *
+opt_get_findindex(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->findindex);
+}
+
+char *
+opt_get_pack(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->pack);
+}
+
+long
+opt_get_scripts(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	return (options->scripts);
+}
+
+static long
+parse_number(const char *arg, const char *name, long min, long max)
+{
+	assert(arg != NULL);
+	assert(name != NULL);
+
+	char *end;
+	errno = 0;
+	long n = strtol(arg, &end, 10);
+	if (errno != 0 || *arg == '\0' || *end != '\0' || n < min ||
+	    n > max) {
+		syslog(LOG_ERR, "invalid %s: \"%s\"", name, arg);
+		fprintf(stderr, "invalid %s: %s (expected %ld..%ld)\n", name,
+		    arg, min, max);
+		exit(EXIT_FAILURE);
+	}
+
+	return (n);
+}
+
+/*
+ * Parses a size in bytes with an optional k, m or g suffix.
+ */
+static size_t
+parse_size(const char *arg, const char *name)
+{
+	assert(arg != NULL);
+	assert(name != NULL);
+
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(arg, &end, 10);
+	unsigned long long unit = 1;
+	switch (*end) {
+	case 'g':
+	case 'G':
+		unit *= 1024;
+		/* FALLTHROUGH */
+	case 'm':
+	case 'M':
+		unit *= 1024;
+		/* FALLTHROUGH */
+	case 'k':
+	case 'K':
+		unit *= 1024;
+		end++;
+		break;
+	}
+	if (errno != 0 || *arg == '\0' || *arg == '-' || *end != '\0' ||
+	    n > SIZE_MAX / unit) {
+		syslog(LOG_ERR, "invalid %s: \"%s\"", name, arg);
+		fprintf(stderr, "invalid %s: %s\n", name, arg);
+		exit(EXIT_FAILURE);
+	}
+
+	return (n * unit);
+}
+
+/*
+ * Parses a request rate per second with an optional burst size, separated
+ * by a colon. The burst defaults to the rate.
+ */
+static void
+parse_limit(const char *arg, const char *name, struct ratelimit_limit *limit)
+{
+	assert(arg != NULL);
+	assert(name != NULL);
+	assert(limit != NULL);
+
+	char rate[32];
+	const char *colon = strchr(arg, ':');
+	size_t len = (colon != NULL) ? (size_t)(colon - arg) : strlen(arg);
+	if (len >= sizeof(rate))
+		len = sizeof(rate) - 1;
+	memcpy(rate, arg, len);
+	rate[len] = '\0';
+
+	limit->rate = parse_number(rate, name, 0, 1000000);
+	limit->burst = limit->rate;
+	if (colon != NULL)
+		limit->burst = parse_number(colon + 1, name, 1, 1000000);
+}
+
+/*
+ * Parses the timeouts for the first byte of the request, the whole request
+ * and a stalled response in seconds, separated by colons. Omitted ones keep
+ * their defaults.
+ */
+static void
+parse_timeouts(const char *arg, struct opt_options *options)
+{
+	assert(arg != NULL);
+	assert(options != NULL);
+
+	long *timeouts[] = {
+		&options->firstbyte,
+		&options->requesttimeout,
+		&options->idletimeout
+	};
+	const char *names[] = {
+		"first byte timeout",
+		"request timeout",
+		"idle timeout"
+	};
+
+	for (int i = 0; i < 3 && *arg != '\0'; i++) {
+		char field[32];
+		size_t len = strcspn(arg, ":");
+		if (len >= sizeof(field))
+			len = sizeof(field) - 1;
+		memcpy(field, arg, len);
+		field[len] = '\0';
+
+		*timeouts[i] = parse_number(field, names[i], 0, 86400);
+		arg += strcspn(arg, ":");
+		if (*arg == ':')
+			arg++;
+	}
+}
+
 void
 usage(void)
 {
-	fputs("Usage: mgopherd -r root -H host -p port\n", stderr);
+	fputs("Usage: mgopherd [-s] [-g pagesize] [-G namedir] [-i index] "
+	    "[-l accesslog]\n", stderr);
+	fputs("                [-N findindex] [-P pack] [-S searchindex] "
+	    "[-t typemap]\n", stderr);
+	fputs("                [-T timeouts] [-x procs] -r root -H host "
+	    "-p port\n", stderr);
+	fputs("       mgopherd -d [-amu] [-B rate] [-c cachesize] "
+	    "[-f cachesize] [-F filesize]\n", stderr);
+	fputs("                [-g pagesize] [-G namedir] [-i index] "
+	    "[-k conns] [-K conns]\n", stderr);
+	fputs("                [-l accesslog] [-N findindex] [-P pack] "
+	    "[-q rate[:burst]]\n", stderr);
+	fputs("                [-Q rate[:burst]] [-S searchindex] "
+	    "[-t typemap] [-T timeouts]\n", stderr);
+	fputs("                [-w workers] [-x procs] -r root -H host "
+	    "-p port\n", stderr);
 	fputs("       mgopherd -h\n", stderr);
+	fputs("       mgopherd-index [-t typemap] [-i index] [-N findindex] "
+	    "[-P pack]\n", stderr);
+	fputs("                      [-S searchindex] -r root -H host "
+	    "-p port\n", stderr);
 }
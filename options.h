@@ -8,6 +8,11 @@
 #ifndef OPTIONS_H
 #define OPTIONS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "ratelimit.h"
+
 struct opt_options;
 
 struct opt_options *opt_parse(int _argc, char **_argv);
@@ -16,5 +21,31 @@ void opt_free(struct opt_options *_options);
 char *opt_get_host(struct opt_options *_options);
 char *opt_get_root(struct opt_options *_options);
 char *opt_get_port(struct opt_options *_options);
+char *opt_get_typemap(struct opt_options *_options);
+char *opt_get_index(struct opt_options *_options);
+char *opt_get_accesslog(struct opt_options *_options);
+bool opt_get_daemon(struct opt_options *_options);
+long opt_get_workers(struct opt_options *_options);
+bool opt_get_affinity(struct opt_options *_options);
+bool opt_get_metrics(struct opt_options *_options);
+bool opt_get_uring(struct opt_options *_options);
+const struct ratelimit_limit *opt_get_addresslimit(
+    struct opt_options *_options);
+const struct ratelimit_limit *opt_get_prefixlimit(
+    struct opt_options *_options);
+long opt_get_firstbyte(struct opt_options *_options);
+long opt_get_requesttimeout(struct opt_options *_options);
+long opt_get_idletimeout(struct opt_options *_options);
+size_t opt_get_minrate(struct opt_options *_options);
+size_t opt_get_menucache(struct opt_options *_options);
+size_t opt_get_filecache(struct opt_options *_options);
+size_t opt_get_filecachemax(struct opt_options *_options);
+long opt_get_pagesize(struct opt_options *_options);
+char *opt_get_namedir(struct opt_options *_options);
+bool opt_get_stream(struct opt_options *_options);
+char *opt_get_search(struct opt_options *_options);
+char *opt_get_findindex(struct opt_options *_options);
+char *opt_get_pack(struct opt_options *_options);
+long opt_get_scripts(struct opt_options *_options);
 
 #endif /* !OPTIONS_H */
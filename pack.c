@@ -0,0 +1,531 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "pack.h"
+#include "tools.h"
+#include "transfer.h"
+
+#define MAGIC		"MGOPHPK"
+#define VERSION		1
+#define BYTEORDER	0x01020304
+#define PAGE		4096
+#define COPYSIZE	(64 * 1024)
+
+/*
+ * A pack holds everything needed to serve a directory structure: the
+ * rendered menu of every directory and the body of every file, exactly as
+ * they are sent, so text files are already converted to CRLF and
+ * terminated. It is written once by mgopherd-index and mapped read-only by
+ * mgopherd, which then does not look at the file system at all.
+ *
+ * The file starts with a header, followed by the menus and bodies, the
+ * strings, a table of records and an open addressing hash table of the
+ * records keyed by selector. Menus and bodies of at least a page start on a
+ * page boundary. All offsets are relative to the start of the file. Like
+ * the site index, a pack is only valid for the host and port it was
+ * rendered for and for the byte order of the machine that wrote it.
+ */
+struct header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t size;
+	uint64_t host;
+	uint64_t port;
+	uint64_t records;
+	uint64_t nrecords;
+	uint64_t slots;
+	uint64_t nslots;
+};
+
+struct record {
+	uint64_t selector;
+	uint64_t data;
+	uint64_t len;
+	uint32_t hash;
+	uint32_t type;
+};
+
+struct entry {
+	char *selector;
+	struct record record;
+};
+
+struct pack_builder {
+	char *path;
+	char *tmp;
+	char *host;
+	char *port;
+	FILE *f;
+	uint64_t offset;
+	struct entry *entries;
+	size_t nentries;
+	size_t capacity;
+};
+
+static const char *map;
+static size_t mapsize;
+static const struct header *header;
+static const struct record *records;
+static const uint32_t *slots;
+
+static bool check_pack(const char *host, const char *port);
+static uint32_t hash_selector(const char *selector);
+static struct entry *add_entry(struct pack_builder *b, const char *selector,
+    char type);
+static bool pad(struct pack_builder *b, uint64_t align);
+
+/*
+ * Maps the pack at path. Unlike a site index, a pack replaces the file
+ * system, so a pack that cannot be used is fatal.
+ */
+void
+pack_open(const char *path, const char *host, const char *port)
+{
+	assert(path != NULL);
+	assert(host != NULL);
+	assert(port != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		syslog(LOG_ERR, "open pack error: %m");
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) == -1) {
+		syslog(LOG_ERR, "fstat pack error: %m");
+		fprintf(stderr, "fstat %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if ((uintmax_t)s.st_size < sizeof(struct header) ||
+	    (uintmax_t)s.st_size > SIZE_MAX) {
+		syslog(LOG_ERR, "pack \"%s\" has an invalid size", path);
+		fprintf(stderr, "%s: invalid size\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	void *m = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		syslog(LOG_ERR, "mmap pack error: %m");
+		fprintf(stderr, "mmap %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	map = m;
+	mapsize = s.st_size;
+	if (!check_pack(host, port)) {
+		syslog(LOG_ERR, "unusable pack \"%s\"", path);
+		fprintf(stderr, "%s: unusable pack\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	syslog(LOG_INFO, "pack \"%s\": %ju items", path,
+	    (uintmax_t)header->nrecords);
+}
+
+bool
+pack_enabled(void)
+{
+	return (map != NULL);
+}
+
+/*
+ * Looks up the menu or file body of selector. A menu is reported with type
+ * '1'; the data is mapped for the lifetime of the process.
+ */
+bool
+pack_lookup(const char *selector, char *type, const char **data, size_t *len)
+{
+	assert(selector != NULL);
+	assert(type != NULL);
+	assert(data != NULL);
+	assert(len != NULL);
+
+	if (map == NULL)
+		return (false);
+
+	uint32_t hash = hash_selector(selector);
+	uint64_t mask = header->nslots - 1;
+	for (uint64_t i = hash & mask;; i = (i + 1) & mask) {
+		if (slots[i] == 0)
+			return (false);
+
+		const struct record *r = &records[slots[i] - 1];
+		if (r->hash != hash || strcmp(map + r->selector, selector) != 0)
+			continue;
+
+		*type = (char)r->type;
+		*data = map + r->data;
+		*len = r->len;
+		return (true);
+	}
+}
+
+/*
+ * Starts a pack to be written to a temporary file next to path.
+ */
+struct pack_builder *
+pack_builder_new(const char *path, const char *host, const char *port)
+{
+	assert(path != NULL);
+	assert(host != NULL);
+	assert(port != NULL);
+
+	struct pack_builder *b = calloc(1, sizeof(struct pack_builder));
+	if (b == NULL)
+		return (NULL);
+
+	size_t l = strlen(path) + sizeof(".tmp");
+	b->path = strdup(path);
+	b->tmp = malloc(l);
+	b->host = strdup(host);
+	b->port = strdup(port);
+	if (b->path == NULL || b->tmp == NULL || b->host == NULL ||
+	    b->port == NULL) {
+		pack_builder_free(b);
+		return (NULL);
+	}
+	snprintf(b->tmp, l, "%s.tmp", path);
+
+	/* The header is written last, once the layout is known. */
+	struct header h;
+	memset(&h, 0, sizeof(h));
+	b->f = fopen(b->tmp, "w");
+	if (b->f == NULL || !tool_write_all(b->f, &h, sizeof(h))) {
+		pack_builder_free(b);
+		return (NULL);
+	}
+	b->offset = sizeof(h);
+
+	return (b);
+}
+
+bool
+pack_builder_add_menu(struct pack_builder *b, const char *selector,
+    const char *data, size_t len)
+{
+	assert(b != NULL);
+	assert(selector != NULL);
+	assert(data != NULL);
+
+	if (len >= PAGE && !pad(b, PAGE))
+		return (false);
+	struct entry *e = add_entry(b, selector, '1');
+	if (e == NULL || !tool_write_all(b->f, data, len))
+		return (false);
+	e->record.len = len;
+	b->offset += len;
+
+	return (true);
+}
+
+/*
+ * Adds the file fd as it is sent for an item of type type, converted to a
+ * text entity if text is set.
+ */
+bool
+pack_builder_add_file(struct pack_builder *b, const char *selector,
+    char type, int fd, bool text)
+{
+	assert(b != NULL);
+	assert(selector != NULL);
+	assert(fd != -1);
+
+	struct entry *e;
+	if (text) {
+		char *data;
+		size_t len;
+		if (!transfer_load(fd, true, &data, &len))
+			return (false);
+		if ((len >= PAGE && !pad(b, PAGE)) ||
+		    (e = add_entry(b, selector, type)) == NULL ||
+		    !tool_write_all(b->f, data, len)) {
+			free(data);
+			return (false);
+		}
+		e->record.len = len;
+		b->offset += len;
+		free(data);
+		return (true);
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) == -1 || (s.st_size >= PAGE && !pad(b, PAGE)))
+		return (false);
+	e = add_entry(b, selector, type);
+	char *buf = malloc(COPYSIZE);
+	if (e == NULL || buf == NULL) {
+		free(buf);
+		return (false);
+	}
+
+	uint64_t len = 0;
+	for (;;) {
+		ssize_t r = pread(fd, buf, COPYSIZE, len);
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r <= 0) {
+			free(buf);
+			if (r == -1)
+				return (false);
+			break;
+		}
+		if (!tool_write_all(b->f, buf, r)) {
+			free(buf);
+			return (false);
+		}
+		len += r;
+	}
+	e->record.len = len;
+	b->offset += len;
+
+	return (true);
+}
+
+/*
+ * Writes the tables and renames the pack into place, so running servers
+ * keep the pack they have mapped.
+ */
+bool
+pack_builder_write(struct pack_builder *b)
+{
+	assert(b != NULL);
+	assert(b->f != NULL);
+
+	if (b->nentries >= UINT32_MAX) {
+		errno = EFBIG;
+		return (false);
+	}
+
+	struct header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(h.magic));
+	h.version = VERSION;
+	h.byteorder = BYTEORDER;
+
+	/* The strings follow the bodies, the tables are aligned. */
+	h.host = b->offset;
+	bool success = tool_write_all(b->f, b->host, strlen(b->host) + 1);
+	b->offset += strlen(b->host) + 1;
+	h.port = b->offset;
+	success = success && tool_write_all(b->f, b->port, strlen(b->port) + 1);
+	b->offset += strlen(b->port) + 1;
+	for (size_t i = 0; success && i < b->nentries; i++) {
+		struct entry *e = &b->entries[i];
+		size_t l = strlen(e->selector) + 1;
+		e->record.selector = b->offset;
+		success = tool_write_all(b->f, e->selector, l);
+		b->offset += l;
+	}
+
+	success = success && pad(b, sizeof(uint64_t));
+	h.records = b->offset;
+	h.nrecords = b->nentries;
+	for (size_t i = 0; success && i < b->nentries; i++)
+		success = tool_write_all(b->f, &b->entries[i].record,
+		    sizeof(struct record));
+	b->offset += b->nentries * sizeof(struct record);
+
+	/* At most half of the slots are used, so probe runs stay short. */
+	h.slots = b->offset;
+	h.nslots = 16;
+	while (h.nslots < 2 * (uint64_t)b->nentries)
+		h.nslots *= 2;
+	uint32_t *table = calloc(h.nslots, sizeof(uint32_t));
+	if (table == NULL)
+		success = false;
+	for (size_t i = 0; success && i < b->nentries; i++) {
+		uint64_t mask = h.nslots - 1;
+		uint64_t s = b->entries[i].record.hash & mask;
+		while (table[s] != 0)
+			s = (s + 1) & mask;
+		table[s] = i + 1;
+	}
+	success = success &&
+	    tool_write_all(b->f, table, h.nslots * sizeof(uint32_t));
+	b->offset += h.nslots * sizeof(uint32_t);
+	free(table);
+	h.size = b->offset;
+
+	success = success && fseeko(b->f, 0, SEEK_SET) == 0 &&
+	    tool_write_all(b->f, &h, sizeof(h));
+	if (fclose(b->f) == EOF)
+		success = false;
+	b->f = NULL;
+	if (success && rename(b->tmp, b->path) == -1)
+		success = false;
+	if (!success) {
+		int error = errno;
+		unlink(b->tmp);
+		errno = error;
+	}
+
+	return (success);
+}
+
+/*
+ * Frees the builder, removing the temporary file of a pack that was not
+ * written.
+ */
+void
+pack_builder_free(struct pack_builder *b)
+{
+	if (b == NULL)
+		return;
+
+	if (b->f != NULL) {
+		fclose(b->f);
+		unlink(b->tmp);
+	}
+	for (size_t i = 0; i < b->nentries; i++)
+		free(b->entries[i].selector);
+	free(b->entries);
+	free(b->path);
+	free(b->tmp);
+	free(b->host);
+	free(b->port);
+	free(b);
+}
+
+/*
+ * Checks everything later lookups rely on, so a damaged pack can not lead
+ * to reads outside the mapping.
+ */
+static bool
+check_pack(const char *host, const char *port)
+{
+	assert(map != NULL);
+
+	header = (const struct header *)map;
+	if (memcmp(header->magic, MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != VERSION || header->byteorder != BYTEORDER) {
+		syslog(LOG_ERR, "pack has an unknown format");
+		return (false);
+	}
+	if (header->size != mapsize ||
+	    header->records > mapsize ||
+	    header->records % sizeof(uint64_t) != 0 ||
+	    header->nrecords > (mapsize - header->records) /
+	    sizeof(struct record) ||
+	    header->slots != header->records + header->nrecords *
+	    sizeof(struct record) ||
+	    header->nslots <= header->nrecords ||
+	    (header->nslots & (header->nslots - 1)) != 0 ||
+	    header->nslots > (mapsize - header->slots) / sizeof(uint32_t)) {
+		syslog(LOG_ERR, "pack is truncated");
+		return (false);
+	}
+	if (!tool_check_string(map, mapsize, header->host) ||
+	    !tool_check_string(map, mapsize, header->port)) {
+		syslog(LOG_ERR, "pack is damaged");
+		return (false);
+	}
+	if (strcmp(map + header->host, host) != 0 ||
+	    strcmp(map + header->port, port) != 0) {
+		syslog(LOG_ERR, "pack was built for %s:%s",
+		    map + header->host, map + header->port);
+		return (false);
+	}
+
+	records = (const struct record *)(map + header->records);
+	slots = (const uint32_t *)(map + header->slots);
+	for (uint64_t i = 0; i < header->nrecords; i++)
+		if (!tool_check_string(map, mapsize, records[i].selector) ||
+		    records[i].data > mapsize ||
+		    records[i].len > mapsize - records[i].data) {
+			syslog(LOG_ERR, "pack is damaged");
+			return (false);
+		}
+	for (uint64_t i = 0; i < header->nslots; i++)
+		if (slots[i] > header->nrecords) {
+			syslog(LOG_ERR, "pack is damaged");
+			return (false);
+		}
+
+	return (true);
+}
+
+static uint32_t
+hash_selector(const char *selector)
+{
+	assert(selector != NULL);
+
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)selector;
+	    *p != '\0'; p++)
+		h = (h ^ *p) * 16777619u;
+
+	return (h);
+}
+
+/*
+ * Records an item whose data starts at the current offset.
+ */
+static struct entry *
+add_entry(struct pack_builder *b, const char *selector, char type)
+{
+	assert(b != NULL);
+	assert(selector != NULL);
+
+	if (b->nentries == b->capacity) {
+		size_t c = (b->capacity == 0) ? 256 : b->capacity * 2;
+		void *e = realloc(b->entries, c * sizeof(struct entry));
+		if (e == NULL)
+			return (NULL);
+		b->entries = e;
+		b->capacity = c;
+	}
+
+	struct entry *e = &b->entries[b->nentries];
+	memset(e, 0, sizeof(*e));
+	e->selector = strdup(selector);
+	if (e->selector == NULL)
+		return (NULL);
+	e->record.data = b->offset;
+	e->record.hash = hash_selector(selector);
+	e->record.type = (unsigned char)type;
+	b->nentries++;
+
+	return (e);
+}
+
+/*
+ * Pads the pack with zeros up to the next multiple of align.
+ */
+static bool
+pad(struct pack_builder *b, uint64_t align)
+{
+	assert(b != NULL);
+	assert(align > 0);
+
+	static const char zeros[PAGE];
+	size_t n = (align - b->offset % align) % align;
+	if (!tool_write_all(b->f, zeros, n))
+		return (false);
+	b->offset += n;
+
+	return (true);
+}
@@ -0,0 +1,30 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct pack_builder;
+
+void pack_open(const char *_path, const char *_host, const char *_port);
+bool pack_enabled(void);
+bool pack_lookup(const char *_selector, char *_type, const char **_data,
+    size_t *_len);
+
+struct pack_builder *pack_builder_new(const char *_path, const char *_host,
+    const char *_port);
+bool pack_builder_add_menu(struct pack_builder *_b, const char *_selector,
+    const char *_data, size_t _len);
+bool pack_builder_add_file(struct pack_builder *_b, const char *_selector,
+    char _type, int _fd, bool _text);
+bool pack_builder_write(struct pack_builder *_b);
+void pack_builder_free(struct pack_builder *_b);
+
+#endif /* !PACK_H */
@@ -0,0 +1,376 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "ratelimit.h"
+#include "send.h"
+
+#define NSTRIPES	64
+#define STRIPESLOTS	64
+#define TOKEN		1000	/* tokens are kept in thousandths */
+
+enum kind {
+	KIND_ADDRESS = 1,
+	KIND_PREFIX
+};
+
+struct key {
+	uint64_t hi;
+	uint64_t lo;
+	uint32_t kind;
+};
+
+/*
+ * A token bucket and the number of open connections of an address or a
+ * prefix. tokens are refilled lazily from stamp, the time of the last
+ * update in milliseconds.
+ */
+struct entry {
+	struct key key;
+	uint32_t active;
+	int64_t tokens;
+	int64_t stamp;
+};
+
+/*
+ * The table lives in a shared mapping, so all workers see the same counts
+ * no matter which of them accepts a connection. It has a fixed size and is
+ * split into stripes with a lock each; a key is only ever stored in the
+ * stripe its hash selects. A new key takes an unused entry or pushes out the
+ * idle entry of the stripe that has not been updated for the longest time.
+ * The locks are robust, so a worker dying in between does not block the
+ * others.
+ */
+struct stripe {
+	pthread_mutex_t lock;
+	struct entry entries[STRIPESLOTS];
+};
+
+static struct stripe *stripes;
+static struct ratelimit_limit limits[KIND_PREFIX + 1];
+static char *response;
+static size_t responselen;
+
+static bool make_key(const struct sockaddr *peer, enum kind kind,
+    struct key *key);
+static bool take(const struct key *key, int64_t now);
+static void give(const struct key *key, bool refund);
+static struct stripe *lock_stripe(const struct key *key);
+static struct entry *find(struct stripe *s, const struct key *key,
+    bool insert);
+static void refill(struct entry *e, const struct ratelimit_limit *l,
+    int64_t now);
+static int64_t now_ms(void);
+
+/*
+ * Sets up the shared table and the response sent to limited clients. Has to
+ * be called before the workers are forked. Nothing is limited if neither
+ * address nor prefix has a limit.
+ */
+void
+ratelimit_init(const struct ratelimit_limit *address,
+    const struct ratelimit_limit *prefix)
+{
+	assert(address != NULL);
+	assert(prefix != NULL);
+
+	limits[KIND_ADDRESS] = *address;
+	limits[KIND_PREFIX] = *prefix;
+	for (int k = KIND_ADDRESS; k <= KIND_PREFIX; k++)
+		if (limits[k].rate > 0 && limits[k].burst < 1)
+			limits[k].burst = limits[k].rate;
+	if (address->rate == 0 && address->conns == 0 && prefix->rate == 0 &&
+	    prefix->conns == 0)
+		return;
+
+	FILE *out = open_memstream(&response, &responselen);
+	if (out == NULL) {
+		syslog(LOG_ERR, "open_memstream error: %m");
+		return;
+	}
+	send_error(out, "E: rate limit", NULL);
+	send_info(out, "I: You sent too many requests, please slow down.",
+	    NULL);
+	send_eom(out);
+	if (fclose(out) == EOF) {
+		syslog(LOG_ERR, "fclose error: %m");
+		return;
+	}
+
+	int fd = open("/dev/zero", O_RDWR);
+	if (fd == -1) {
+		syslog(LOG_ERR, "open /dev/zero error: %m");
+		return;
+	}
+	void *p = mmap(NULL, NSTRIPES * sizeof(struct stripe),
+	    PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		syslog(LOG_ERR, "mmap error: %m");
+		return;
+	}
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	struct stripe *s = p;
+	for (int i = 0; i < NSTRIPES; i++)
+		pthread_mutex_init(&s[i].lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	stripes = s;
+}
+
+bool
+ratelimit_enabled(void)
+{
+	return (stripes != NULL);
+}
+
+/*
+ * Decides whether a new connection from peer is served. Every admitted
+ * connection has to be released by ratelimit_release() once it is closed.
+ */
+bool
+ratelimit_admit(const struct sockaddr *peer)
+{
+	assert(peer != NULL);
+
+	if (stripes == NULL)
+		return (true);
+
+	struct key address, prefix;
+	if (!make_key(peer, KIND_ADDRESS, &address) ||
+	    !make_key(peer, KIND_PREFIX, &prefix))
+		return (true);
+
+	int64_t now = now_ms();
+	if (!take(&address, now))
+		return (false);
+	if (!take(&prefix, now)) {
+		give(&address, true);
+		return (false);
+	}
+
+	return (true);
+}
+
+void
+ratelimit_release(const struct sockaddr *peer)
+{
+	assert(peer != NULL);
+
+	if (stripes == NULL)
+		return;
+
+	struct key address, prefix;
+	if (!make_key(peer, KIND_ADDRESS, &address) ||
+	    !make_key(peer, KIND_PREFIX, &prefix))
+		return;
+
+	give(&address, false);
+	give(&prefix, false);
+}
+
+/*
+ * Returns the complete response for a limited client, an error message in
+ * the style of send_error().
+ */
+const char *
+ratelimit_response(size_t *len)
+{
+	assert(len != NULL);
+
+	*len = responselen;
+	return (response);
+}
+
+/*
+ * IPv4 addresses are grouped by their /24 and IPv6 addresses by their /64
+ * prefix. Other families are not limited.
+ */
+static bool
+make_key(const struct sockaddr *peer, enum kind kind, struct key *key)
+{
+	assert(peer != NULL);
+	assert(key != NULL);
+
+	const unsigned char *a;
+	memset(key, 0, sizeof(*key));
+	key->kind = kind;
+
+	switch (peer->sa_family) {
+	case AF_INET:
+		a = (const unsigned char *)
+		    &((const struct sockaddr_in *)peer)->sin_addr;
+		key->lo = (uint64_t)0xffff << 32 | (uint64_t)a[0] << 24 |
+		    (uint64_t)a[1] << 16 | (uint64_t)a[2] << 8;
+		if (kind == KIND_ADDRESS)
+			key->lo |= a[3];
+		return (true);
+	case AF_INET6:
+		a = ((const struct sockaddr_in6 *)peer)->sin6_addr.s6_addr;
+		for (int i = 0; i < 8; i++) {
+			key->hi = key->hi << 8 | a[i];
+			key->lo = key->lo << 8 | a[i + 8];
+		}
+		if (kind == KIND_PREFIX)
+			key->lo = 0;
+		return (true);
+	default:
+		return (false);
+	}
+}
+
+/*
+ * Takes a token and a connection from the limits of key. False is returned
+ * if either of them is exhausted.
+ */
+static bool
+take(const struct key *key, int64_t now)
+{
+	assert(key != NULL);
+
+	const struct ratelimit_limit *l = &limits[key->kind];
+	if (l->rate == 0 && l->conns == 0)
+		return (true);
+
+	struct stripe *s = lock_stripe(key);
+	struct entry *e = find(s, key, true);
+	bool admitted = true;
+
+	/* If every entry is busy, the key is not tracked at all. */
+	if (e != NULL) {
+		refill(e, l, now);
+		if ((l->rate > 0 && e->tokens < TOKEN) ||
+		    (l->conns > 0 && e->active >= (uint32_t)l->conns))
+			admitted = false;
+		else {
+			if (l->rate > 0)
+				e->tokens -= TOKEN;
+			e->active++;
+		}
+	}
+
+	pthread_mutex_unlock(&s->lock);
+
+	return (admitted);
+}
+
+/*
+ * Gives the connection taken by take() back, and with refund its token.
+ */
+static void
+give(const struct key *key, bool refund)
+{
+	assert(key != NULL);
+
+	const struct ratelimit_limit *l = &limits[key->kind];
+	if (l->rate == 0 && l->conns == 0)
+		return;
+
+	struct stripe *s = lock_stripe(key);
+	struct entry *e = find(s, key, false);
+	if (e != NULL && e->active > 0) {
+		e->active--;
+		if (refund && l->rate > 0)
+			e->tokens += TOKEN;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+static struct stripe *
+lock_stripe(const struct key *key)
+{
+	assert(key != NULL);
+
+	uint64_t h = key->hi ^ key->lo * 0x9e3779b97f4a7c15 ^ key->kind;
+	h ^= h >> 29;
+	h *= 0xbf58476d1ce4e5b9;
+	h ^= h >> 32;
+
+	struct stripe *s = &stripes[h % NSTRIPES];
+	if (pthread_mutex_lock(&s->lock) == EOWNERDEAD)
+		pthread_mutex_consistent(&s->lock);
+
+	return (s);
+}
+
+static struct entry *
+find(struct stripe *s, const struct key *key, bool insert)
+{
+	assert(s != NULL);
+	assert(key != NULL);
+
+	struct entry *victim = NULL;
+	for (int i = 0; i < STRIPESLOTS; i++) {
+		struct entry *e = &s->entries[i];
+		if (e->key.kind == key->kind && e->key.hi == key->hi &&
+		    e->key.lo == key->lo)
+			return (e);
+		if (e->active > 0)
+			continue;
+		if (victim == NULL || (victim->key.kind != 0 &&
+		    (e->key.kind == 0 || e->stamp < victim->stamp)))
+			victim = e;
+	}
+
+	if (!insert || victim == NULL)
+		return (NULL);
+
+	victim->key = *key;
+	victim->active = 0;
+	victim->tokens = limits[key->kind].burst * TOKEN;
+	victim->stamp = now_ms();
+
+	return (victim);
+}
+
+static void
+refill(struct entry *e, const struct ratelimit_limit *l, int64_t now)
+{
+	assert(e != NULL);
+	assert(l != NULL);
+
+	if (now > e->stamp) {
+		e->tokens += (now - e->stamp) * l->rate;
+		if (e->tokens > l->burst * TOKEN)
+			e->tokens = l->burst * TOKEN;
+	}
+	e->stamp = now;
+}
+
+static int64_t
+now_ms(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return ((int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
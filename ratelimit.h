@@ -0,0 +1,35 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Limits for a single client address or a whole prefix. rate is the number
+ * of requests per second, burst the number of requests that may be made at
+ * once and conns the number of concurrent connections. 0 means unlimited.
+ */
+struct ratelimit_limit {
+	long rate;
+	long burst;
+	long conns;
+};
+
+void ratelimit_init(const struct ratelimit_limit *_address,
+    const struct ratelimit_limit *_prefix);
+bool ratelimit_enabled(void);
+bool ratelimit_admit(const struct sockaddr *_peer);
+void ratelimit_release(const struct sockaddr *_peer);
+const char *ratelimit_response(size_t *_len);
+
+#endif /* !RATELIMIT_H */
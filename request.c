@@ -0,0 +1,1343 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifdef __linux__
+#define _DEFAULT_SOURCE	/* d_type constants */
+#endif
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "arena.h"
+#include "classify.h"
+#include "filecache.h"
+#include "findindex.h"
+#include "gophermap.h"
+#include "itemtypes.h"
+#include "menucache.h"
+#include "metrics.h"
+#include "nameindex.h"
+#include "options.h"
+#include "pack.h"
+#include "request.h"
+#include "script.h"
+#include "search.h"
+#include "send.h"
+#include "siteindex.h"
+#include "tools.h"
+#include "transfer.h"
+#include "typecache.h"
+#include "watch.h"
+
+#define GOPHERMAP	"gophermap"
+#define PAGEPARAM	"?page="
+#define SLOWMENU	(500 * 1000)	/* microseconds */
+
+/*
+ * What a directory entry is known to be without calling stat(2), taken from
+ * d_type where the platform provides it.
+ */
+enum entrykind {
+	ENTRY_UNKNOWN,
+	ENTRY_REGULAR,
+	ENTRY_DIRECTORY,
+	ENTRY_OTHER
+};
+
+struct entry {
+	char *name;
+	enum entrykind kind;
+};
+
+struct context {
+	const char *selector;
+	const char *path;
+	size_t page;		/* 0 if no page was asked for */
+	const char *query;	/* "" if the request carried none */
+	const struct sockaddr *peer;
+	socklen_t peerlen;
+	FILE *out;
+	struct arena *arena;
+};
+
+static bool handle_directory(struct opt_options *options,
+    struct context *context);
+static bool write_menu(struct opt_options *options, struct context *context,
+    int dirfd);
+static bool write_stream(struct opt_options *options,
+    struct context *context, int dirfd);
+static bool write_page(struct opt_options *options, struct context *context,
+    int dirfd);
+static void write_entry(struct context *context, int dirfd, const char *name,
+    enum entrykind kind, const char *tail);
+static bool invalid_page(struct context *context);
+static void write_search_items(struct opt_options *options,
+    struct context *context, const char *tail);
+static char *search_request(char *request, const char *selector);
+static bool handle_search(struct opt_options *options, const char *selector,
+    const char *query, struct response *response);
+static bool handle_pack(const char *selector, size_t page,
+    struct response *response);
+static bool write_gophermap(struct opt_options *options,
+    struct context *context, int dirfd, const char *map);
+static void write_map_line(struct opt_options *options,
+    struct context *context, char *line, const char *map);
+static bool is_script(int dirfd, const char *name);
+static bool write_script(struct opt_options *options,
+    struct context *context, const char *path, bool menu);
+static char itemtype(int dirfd, const char *name, enum entrykind kind,
+    FILE *out);
+static bool open_file(struct context *context, int *fd);
+static bool lookup_file(const char *selector, const char *path,
+    struct response *response);
+static void cache_file(const char *selector, char type,
+    struct response *response);
+static bool parent_covered(const char *selector);
+static enum entrykind entry_kind(const struct dirent *entry);
+static enum entrykind type_kind(int type);
+static int entry_compare(const void *a, const void *b);
+static bool check_rights(int dirfd, const char *name, char type, FILE *out);
+static bool parse_page(char *selector, size_t *page);
+
+/*
+ * Serves a single request. The request has to fit into LINE_MAX bytes and
+ * its line terminator is stripped in place. If false is returned an error
+ * message has already been sent. Everything allocated from arena is released
+ * before returning.
+ */
+bool
+request_handle(struct opt_options *options, struct arena *arena,
+    char *request, struct response *response)
+{
+	assert(options != NULL);
+	assert(arena != NULL);
+	assert(request != NULL);
+	assert(response != NULL);
+	assert(response->out != NULL);
+
+	response->fd = -1;
+	response->text = false;
+	response->cached = NULL;
+	response->data = NULL;
+	response->datalen = 0;
+	response->type = IT_ERROR;
+
+	tool_strip_crlf(request);
+
+	if (metrics_enabled() && strcmp(request, METRICS_SELECTOR) == 0) {
+		if (!accesslog_enabled())
+			syslog(LOG_INFO, "selector: \"%s\"", request);
+		metrics_write(response->out);
+		response->type = IT_FILE;
+		return (true);
+	}
+
+	char *query;
+	if (opt_get_search(options) != NULL &&
+	    (query = search_request(request, SEARCH_SELECTOR)) != NULL)
+		return (handle_search(options, SEARCH_SELECTOR, query,
+		    response));
+	if (opt_get_findindex(options) != NULL &&
+	    (query = search_request(request, FINDINDEX_SELECTOR)) != NULL)
+		return (handle_search(options, FINDINDEX_SELECTOR, query,
+		    response));
+
+	/* Scripts are passed what follows a tab, just like searches. */
+	const char *scriptquery = "";
+	if (script_enabled() && (query = strchr(request, '\t')) != NULL) {
+		*query++ = '\0';
+		query[strcspn(query, "\t")] = '\0';
+		scriptquery = query;
+	}
+
+	char selector[LINE_MAX];
+	size_t page = 0;
+	if (!request_canonicalize(request, selector) ||
+	    ((opt_get_pagesize(options) > 0 || pack_enabled()) &&
+	    !parse_page(selector, &page))) {
+		syslog(LOG_NOTICE, "invalid request: \"%s\"", request);
+		metrics_request(IT_ERROR);
+		send_error(response->out, "E: request", request);
+		send_info(response->out, "I: Your request seems to be invalid.",
+		    NULL);
+		send_eom(response->out);
+		return (false);
+	}
+
+	if (!accesslog_enabled())
+		syslog(LOG_INFO, "selector: \"%s\"", selector);
+
+	if (pack_enabled())
+		return (handle_pack(selector, page, response));
+
+	char *path = tool_join_path(arena, opt_get_root(options), selector,
+	    response->out);
+	if (path == NULL) {
+		metrics_request(IT_ERROR);
+		send_eom(response->out);
+		arena_reset(arena);
+		return (false);
+	}
+	syslog(LOG_DEBUG, "path: \"%s\"", path);
+
+	/* Only directories have pages, and they are never in the file cache. */
+	bool script = is_script(AT_FDCWD, path);
+	if (!script && page == 0 && filecache_enabled() &&
+	    lookup_file(selector, path, response)) {
+		syslog(LOG_DEBUG, "serving cached file");
+		metrics_count(METRICS_FILECACHE_HIT, 1);
+		response->type = filecache_type(response->cached);
+		metrics_request(response->type);
+		arena_reset(arena);
+		return (true);
+	}
+
+	struct context context = {
+		.selector = selector,
+		.path = path,
+		.page = page,
+		.query = scriptquery,
+		.peer = response->peer,
+		.peerlen = response->peerlen,
+		.out = response->out,
+		.arena = arena
+	};
+
+	char type = itemtype(AT_FDCWD, context.path, ENTRY_UNKNOWN,
+	    context.out);
+	if (page > 0 && type != IT_DIR)
+		type = IT_IGNORE;
+	metrics_request(type == IT_IGNORE ? IT_ERROR : type);
+
+	bool success;
+	switch (type) {
+	case IT_FILE:
+		if (script) {
+			syslog(LOG_DEBUG, "serving script");
+			success = write_script(options, &context, path, false);
+			break;
+		}
+		syslog(LOG_DEBUG, "serving text file");
+		success = open_file(&context, &response->fd);
+		response->text = true;
+		if (success && filecache_enabled())
+			cache_file(selector, type, response);
+		break;
+	case IT_ARCHIVE:
+	case IT_BINARY:
+	case IT_GIF:
+	case IT_HTML:
+	case IT_IMAGE:
+	case IT_AUDIO:
+		syslog(LOG_DEBUG, "serving binary file");
+		success = open_file(&context, &response->fd);
+		if (success && filecache_enabled())
+			cache_file(selector, type, response);
+		break;
+	case IT_DIR:
+		syslog(LOG_DEBUG, "serving directory");
+		success = handle_directory(options, &context);
+		break;
+	case IT_IGNORE:
+	default:
+		syslog(LOG_NOTICE, "invalid item: \"%s\"", context.path);
+		send_error(context.out, "E: request", selector);
+		send_info(context.out, "I: You requested an invalid item.",
+		    NULL);
+		send_eom(context.out);
+		success = false;
+	}
+
+	if (success)
+		response->type = type;
+	arena_reset(arena);
+
+	return (success);
+}
+
+/*
+ * Determines the item type of the file at path just like request_handle()
+ * does.
+ */
+char
+request_itemtype(const char *path, FILE *out)
+{
+	assert(path != NULL);
+	assert(out != NULL);
+
+	return (itemtype(AT_FDCWD, path, ENTRY_UNKNOWN, out));
+}
+
+/*
+ * Tells whether the item of type type at path would be listed in a menu,
+ * checking the access rights just like request_handle() does.
+ */
+bool
+request_listed(const char *path, char type, FILE *out)
+{
+	assert(path != NULL);
+	assert(out != NULL);
+
+	return (check_rights(AT_FDCWD, path, type, out));
+}
+
+/*
+ * Validates the request and writes its canonical form to selector in a
+ * single pass: a leading slash, no empty components and no trailing slash.
+ * The empty request becomes "/". Components starting with a dot or a
+ * backslash are rejected, as are requests not starting with a slash. The
+ * selector buffer has to be at least as large as the request buffer.
+ */
+bool
+request_canonicalize(const char *request, char *selector)
+{
+	assert(request != NULL);
+	assert(selector != NULL);
+
+	if (*request != '/' && *request != '\0')
+		return (false);
+
+	const char *r = request;
+	char *w = selector;
+	while (*r != '\0') {
+		while (*r == '/')
+			r++;
+		if (*r == '\0')
+			break;
+		if (*r == '.' || *r == '\\')
+			return (false);
+
+		*w++ = '/';
+		while (*r != '/' && *r != '\0')
+			*w++ = *r++;
+	}
+	if (w == selector)
+		*w++ = '/';
+	*w = '\0';
+
+	return (true);
+}
+
+/*
+ * Strips a trailing page parameter from the canonical selector. A selector
+ * without one is left alone, a malformed one is rejected.
+ */
+static bool
+parse_page(char *selector, size_t *page)
+{
+	assert(selector != NULL);
+	assert(page != NULL);
+
+	char *q = strrchr(selector, '?');
+	if (q == NULL || strncmp(q, PAGEPARAM, strlen(PAGEPARAM)) != 0)
+		return (true);
+
+	const char *digits = q + strlen(PAGEPARAM);
+	if (*digits < '0' || *digits > '9')
+		return (false);
+	char *end;
+	errno = 0;
+	unsigned long long n = strtoull(digits, &end, 10);
+	if (errno != 0 || *end != '\0' || n == 0 || n > SIZE_MAX)
+		return (false);
+
+	if (q - 1 > selector && q[-1] == '/')
+		q--;
+	*q = '\0';
+	*page = n;
+
+	return (true);
+}
+
+static bool
+handle_directory(struct opt_options *options, struct context *context)
+{
+	assert(options != NULL);
+	assert(context != NULL);
+
+	char *map = tool_join_path(context->arena, context->path, GOPHERMAP,
+	    context->out);
+	if (map == NULL) {
+		send_eom(context->out);
+		return (false);
+	}
+
+	/*
+	 * Menus of watched directories are invalidated as soon as something
+	 * changes, unwatched ones have to be validated against the file
+	 * system. Only the first page of a menu is cached.
+	 */
+	bool firstpage = (context->page <= 1);
+	if (firstpage && menucache_enabled() &&
+	    watch_covers(context->selector)) {
+		size_t len;
+		const char *menu = menucache_get(context->selector,
+		    opt_get_host(options), opt_get_port(options), NULL, NULL,
+		    &len);
+		if (menu != NULL) {
+			metrics_count(METRICS_MENUCACHE_HIT, 1);
+			fwrite(menu, 1, len, context->out);
+			return (true);
+		}
+	}
+
+	int dirfd = open(context->path, O_RDONLY | O_DIRECTORY);
+	if (dirfd == -1) {
+		syslog(LOG_ERR, "open error: %m");
+		send_error(context->out, "E: open", strerror(errno));
+		send_info(context->out, "I: I could not open a directory.",
+		    context->path);
+		send_eom(context->out);
+		return (false);
+	}
+
+	/* The menus of executable gophermaps are never reused. */
+	struct stat dir, ms;
+	bool hasmap = (fstatat(dirfd, GOPHERMAP, &ms, 0) == 0);
+	bool dynamic = (hasmap && script_enabled() &&
+	    faccessat(dirfd, GOPHERMAP, X_OK, 0) == 0);
+	bool hasdir = (firstpage && !dynamic &&
+	    (menucache_enabled() || siteindex_enabled()) &&
+	    fstat(dirfd, &dir) == 0);
+	bool cacheable = (menucache_enabled() && hasdir);
+	if (hasdir && siteindex_enabled()) {
+		size_t len;
+		const char *menu = siteindex_menu(context->selector, &dir,
+		    hasmap ? &ms : NULL, &len);
+		if (menu != NULL) {
+			metrics_count(METRICS_INDEXMENU_HIT, 1);
+			fwrite(menu, 1, len, context->out);
+			close(dirfd);
+			return (true);
+		}
+		metrics_count(METRICS_INDEXMENU_MISS, 1);
+	}
+	if (cacheable) {
+		size_t len;
+		const char *menu = menucache_get(context->selector,
+		    opt_get_host(options), opt_get_port(options), &dir,
+		    hasmap ? &ms : NULL, &len);
+		if (menu != NULL) {
+			metrics_count(METRICS_MENUCACHE_HIT, 1);
+			fwrite(menu, 1, len, context->out);
+			close(dirfd);
+			return (true);
+		}
+		metrics_count(METRICS_MENUCACHE_MISS, 1);
+	}
+
+	FILE *out = context->out;
+	char *buf = NULL;
+	size_t len = 0;
+	if (cacheable) {
+		context->out = open_memstream(&buf, &len);
+		if (context->out == NULL) {
+			syslog(LOG_ERR, "open_memstream error: %m");
+			context->out = out;
+			cacheable = false;
+		}
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	bool success;
+	if (!hasmap ||
+	    !check_rights(dirfd, GOPHERMAP, IT_FILE, context->out))
+		success = write_menu(options, context, dirfd);
+	else if (!firstpage)
+		success = invalid_page(context);
+	else if (dynamic)
+		success = write_script(options, context, map, true);
+	else
+		success = write_gophermap(options, context, dirfd, map);
+	close(dirfd);
+
+	uint64_t usec = metrics_observe(METRICS_MENU, &start);
+	if (usec >= SLOWMENU)
+		syslog(LOG_NOTICE, "slow menu \"%s\": %ju ms",
+		    context->selector, (uintmax_t)usec / 1000);
+
+	if (cacheable) {
+		if (fclose(context->out) == EOF) {
+			syslog(LOG_ERR, "fclose error: %m");
+			success = false;
+		}
+		context->out = out;
+		fwrite(buf, 1, len, out);
+
+		if (success)
+			menucache_put(context->selector, opt_get_host(options),
+			    opt_get_port(options), &dir, hasmap ? &ms : NULL,
+			    buf, len);
+		else
+			free(buf);
+	}
+
+	return (success);
+}
+
+/*
+ * Lists the directory dirfd. Entries are looked at relative to dirfd, so the
+ * kernel does not have to resolve the whole path for each of them, and d_type
+ * saves the stat(2) call where it is conclusive.
+ */
+static bool
+write_menu(struct opt_options *options, struct context *context, int dirfd)
+{
+	assert(options != NULL);
+	assert(context != NULL);
+	assert(dirfd != -1);
+
+	if (opt_get_pagesize(options) > 0)
+		return (write_page(options, context, dirfd));
+	if (opt_get_stream(options))
+		return (write_stream(options, context, dirfd));
+
+	int fd = dup(dirfd);
+	DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		syslog(LOG_ERR, "fdopendir error: %m");
+		send_error(context->out, "E: fdopendir", strerror(errno));
+		send_info(context->out, "I: I have a problem scanning a "
+		    "directory.", context->path);
+		send_eom(context->out);
+		if (fd != -1)
+			close(fd);
+		return (false);
+	}
+
+	struct entry *entries = NULL;
+	size_t used = 0;
+	size_t capacity = 0;
+	size_t scanned = 0;
+	struct dirent *dirent;
+	for (;;) {
+		errno = 0;
+		if ((dirent = readdir(dir)) == NULL)
+			break;
+		scanned++;
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		if (used == capacity) {
+			capacity = (capacity == 0) ? 64 : capacity * 2;
+			void *e = realloc(entries, capacity * sizeof(*entries));
+			if (e == NULL) {
+				syslog(LOG_ERR, "realloc error: %m");
+				send_error(context->out, "E: realloc",
+				    strerror(errno));
+				send_info(context->out, "I: I could not "
+				    "allocate memory.", NULL);
+				send_eom(context->out);
+				exit(EXIT_FAILURE);
+			}
+			entries = e;
+		}
+
+		entries[used].name = arena_strndup(context->arena,
+		    dirent->d_name, strlen(dirent->d_name));
+		if (entries[used].name == NULL) {
+			syslog(LOG_ERR, "malloc error: %m");
+			send_error(context->out, "E: malloc", strerror(errno));
+			send_info(context->out, "I: I could not allocate "
+			    "memory.", NULL);
+			send_eom(context->out);
+			exit(EXIT_FAILURE);
+		}
+		entries[used].kind = entry_kind(dirent);
+		used++;
+	}
+	metrics_count(METRICS_DIRENTS, scanned);
+	if (errno != 0) {
+		syslog(LOG_ERR, "readdir error: %m");
+		send_error(context->out, "E: readdir", strerror(errno));
+		send_info(context->out, "I: I have a problem scanning a "
+		    "directory.", context->path);
+		send_eom(context->out);
+		closedir(dir);
+		free(entries);
+		return (false);
+	}
+	closedir(dir);
+
+	if (used > 0)
+		qsort(entries, used, sizeof(*entries), &entry_compare);
+
+	char *tail = send_tail(context->arena, opt_get_host(options),
+	    opt_get_port(options));
+	if (tail == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		send_error(context->out, "E: malloc", strerror(errno));
+		send_info(context->out, "I: I could not allocate memory.",
+		    NULL);
+		send_eom(context->out);
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < used; i++)
+		write_entry(context, dirfd, entries[i].name, entries[i].kind,
+		    tail);
+	write_search_items(options, context, tail);
+	send_eom(context->out);
+
+	free(entries);
+
+	return (true);
+}
+
+/*
+ * Lists the directory dirfd in the order the entries are read, so the first
+ * items are sent while the directory is still being read and nothing but
+ * the current entry is held in memory.
+ */
+static bool
+write_stream(struct opt_options *options, struct context *context, int dirfd)
+{
+	assert(options != NULL);
+	assert(context != NULL);
+	assert(dirfd != -1);
+
+	char *tail = send_tail(context->arena, opt_get_host(options),
+	    opt_get_port(options));
+	if (tail == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		send_error(context->out, "E: malloc", strerror(errno));
+		send_info(context->out, "I: I could not allocate memory.",
+		    NULL);
+		send_eom(context->out);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = dup(dirfd);
+	DIR *dir = (fd == -1) ? NULL : fdopendir(fd);
+	if (dir == NULL) {
+		syslog(LOG_ERR, "fdopendir error: %m");
+		send_error(context->out, "E: fdopendir", strerror(errno));
+		send_info(context->out, "I: I have a problem scanning a "
+		    "directory.", context->path);
+		send_eom(context->out);
+		if (fd != -1)
+			close(fd);
+		return (false);
+	}
+
+	size_t scanned = 0;
+	struct dirent *dirent;
+	for (;;) {
+		errno = 0;
+		if ((dirent = readdir(dir)) == NULL)
+			break;
+		scanned++;
+		if (dirent->d_name[0] == '.')
+			continue;
+
+		write_entry(context, dirfd, dirent->d_name,
+		    entry_kind(dirent), tail);
+	}
+	metrics_count(METRICS_DIRENTS, scanned);
+	if (errno != 0) {
+		syslog(LOG_ERR, "readdir error: %m");
+		send_error(context->out, "E: readdir", strerror(errno));
+		send_info(context->out, "I: I have a problem scanning a "
+		    "directory.", context->path);
+		send_eom(context->out);
+		closedir(dir);
+		return (false);
+	}
+	closedir(dir);
+	write_search_items(options, context, tail);
+	send_eom(context->out);
+
+	return (true);
+}
+
+/*
+ * Lists a single page of the directory dirfd from its name index, followed
+ * by links to the neighbouring pages. Only the entries of the page are
+ * looked at.
+ */
+static bool
+write_page(struct opt_options *options, struct context *context, int dirfd)
+{
+	assert(options != NULL);
+	assert(context != NULL);
+	assert(dirfd != -1);
+
+	size_t pagesize = opt_get_pagesize(options);
+	struct nameindex *ni = nameindex_open(opt_get_namedir(options),
+	    context->selector, dirfd, pagesize + 1, context->arena,
+	    context->out);
+	if (ni == NULL) {
+		send_eom(context->out);
+		return (false);
+	}
+
+	size_t count = nameindex_count(ni);
+	size_t pages = (count == 0) ? 1 : (count - 1) / pagesize + 1;
+	size_t page = (context->page == 0) ? 1 : context->page;
+	if (page > pages) {
+		nameindex_close(ni);
+		return (invalid_page(context));
+	}
+
+	char *tail = send_tail(context->arena, opt_get_host(options),
+	    opt_get_port(options));
+	if (tail == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		send_error(context->out, "E: malloc", strerror(errno));
+		send_info(context->out, "I: I could not allocate memory.",
+		    NULL);
+		send_eom(context->out);
+		exit(EXIT_FAILURE);
+	}
+
+	size_t first = (page - 1) * pagesize;
+	size_t last = (count - first < pagesize) ? count : first + pagesize;
+	for (size_t i = first; i < last; i++) {
+		int type;
+		const char *name = nameindex_name(ni, i, &type);
+		if (name == NULL)
+			continue;
+		write_entry(context, dirfd, name, type_kind(type), tail);
+	}
+	nameindex_close(ni);
+	write_search_items(options, context, tail);
+
+	if (pages > 1) {
+		char line[64];
+		snprintf(line, sizeof(line), "Page %zu of %zu", page, pages);
+		send_info(context->out, "", NULL);
+		send_info(context->out, line, NULL);
+
+		/* A selector, the page parameter and up to 20 digits. */
+		char sel[LINE_MAX + sizeof(PAGEPARAM) + 20];
+		if (page > 1) {
+			snprintf(sel, sizeof(sel), "%s" PAGEPARAM "%zu",
+			    context->selector, page - 1);
+			send_local_item(context->out, IT_DIR, "Previous page",
+			    sel, tail);
+		}
+		if (page < pages) {
+			snprintf(sel, sizeof(sel), "%s" PAGEPARAM "%zu",
+			    context->selector, page + 1);
+			send_local_item(context->out, IT_DIR, "Next page", sel,
+			    tail);
+		}
+	}
+	send_eom(context->out);
+
+	return (true);
+}
+
+static void
+write_entry(struct context *context, int dirfd, const char *name,
+    enum entrykind kind, const char *tail)
+{
+	assert(context != NULL);
+	assert(name != NULL);
+	assert(tail != NULL);
+
+	struct arena_mark mark = arena_mark(context->arena);
+	char *sel = tool_join_path(context->arena, context->selector, name,
+	    context->out);
+	if (sel == NULL) {
+		arena_rewind(context->arena, mark);
+		return;
+	}
+	/*
+	 * Entries that may be files are checked for read access before their
+	 * content is identified, so an unreadable one is just left out.
+	 */
+	char type = IT_IGNORE;
+	if (kind == ENTRY_DIRECTORY || kind == ENTRY_OTHER ||
+	    check_rights(dirfd, name, IT_FILE, context->out))
+		type = itemtype(dirfd, name, kind, context->out);
+
+	if (!check_rights(dirfd, name, type, context->out)) {
+		syslog(LOG_DEBUG, "missing rights: \"%s\"", sel);
+		arena_rewind(context->arena, mark);
+		return;
+	}
+
+	send_local_item(context->out, type, name, sel, tail);
+
+	arena_rewind(context->arena, mark);
+}
+
+/*
+ * Adds the searches to the end of the root menu, if there are indexes for
+ * them.
+ */
+static void
+write_search_items(struct opt_options *options, struct context *context,
+    const char *tail)
+{
+	assert(options != NULL);
+	assert(context != NULL);
+	assert(tail != NULL);
+
+	if (context->page > 1 || strcmp(context->selector, "/") != 0)
+		return;
+
+	if (opt_get_search(options) != NULL)
+		send_local_item(context->out, IT_SEARCH, "Search",
+		    SEARCH_SELECTOR, tail);
+	if (opt_get_findindex(options) != NULL)
+		send_local_item(context->out, IT_SEARCH, "Find files",
+		    FINDINDEX_SELECTOR, tail);
+}
+
+/*
+ * Returns the query if request is for the search at selector, or NULL. The
+ * query follows the selector after a tab, as sent by clients for type 7
+ * items, and is terminated in place.
+ */
+static char *
+search_request(char *request, const char *selector)
+{
+	assert(request != NULL);
+	assert(selector != NULL);
+
+	size_t len = strlen(selector);
+	if (strncmp(request, selector, len) != 0 ||
+	    (request[len] != '\0' && request[len] != '\t'))
+		return (NULL);
+
+	char *query = request + len;
+	if (*query == '\t')
+		query++;
+	query[strcspn(query, "\t")] = '\0';
+
+	return (query);
+}
+
+/*
+ * Answers a full-text search or a search for file names, depending on
+ * selector.
+ */
+static bool
+handle_search(struct opt_options *options, const char *selector,
+    const char *query, struct response *response)
+{
+	assert(options != NULL);
+	assert(selector != NULL);
+	assert(query != NULL);
+	assert(response != NULL);
+
+	bool find = (strcmp(selector, FINDINDEX_SELECTOR) == 0);
+
+	if (!accesslog_enabled())
+		syslog(LOG_INFO, "%s: \"%s\"", find ? "find" : "search",
+		    query);
+
+	if (find ? !findindex_enabled() : !search_enabled()) {
+		metrics_request(IT_ERROR);
+		send_error(response->out, "E: search", selector);
+		send_info(response->out, "I: The search index is not "
+		    "available.", NULL);
+		send_eom(response->out);
+		return (false);
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (find)
+		findindex_query(query, response->out, opt_get_host(options),
+		    opt_get_port(options));
+	else
+		search_query(query, response->out, opt_get_host(options),
+		    opt_get_port(options));
+	send_eom(response->out);
+	metrics_observe(METRICS_SEARCH, &start);
+
+	metrics_request(IT_SEARCH);
+	response->type = IT_SEARCH;
+
+	return (true);
+}
+
+/*
+ * Serves selector from the pack. Pages beyond the first are packed under
+ * the selector they are linked with.
+ */
+static bool
+handle_pack(const char *selector, size_t page, struct response *response)
+{
+	assert(selector != NULL);
+	assert(response != NULL);
+
+	char key[LINE_MAX + sizeof(PAGEPARAM) + 20];
+	if (page > 1)
+		snprintf(key, sizeof(key), "%s" PAGEPARAM "%zu", selector,
+		    page);
+	else
+		snprintf(key, sizeof(key), "%s", selector);
+
+	char type;
+	if (!pack_lookup(key, &type, &response->data, &response->datalen)) {
+		syslog(LOG_NOTICE, "invalid item: \"%s\"", key);
+		metrics_request(IT_ERROR);
+		send_error(response->out, "E: request", key);
+		send_info(response->out, "I: You requested an invalid item.",
+		    NULL);
+		send_eom(response->out);
+		return (false);
+	}
+
+	metrics_request(type);
+	response->type = type;
+
+	return (true);
+}
+
+static bool
+invalid_page(struct context *context)
+{
+	assert(context != NULL);
+
+	syslog(LOG_NOTICE, "invalid page %zu of \"%s\"", context->page,
+	    context->selector);
+	send_error(context->out, "E: page", context->selector);
+	send_info(context->out, "I: The requested page does not exist.",
+	    NULL);
+	send_eom(context->out);
+
+	return (false);
+}
+
+static bool
+check_rights(int dirfd, const char *name, char type, FILE *out)
+{
+	assert(name != NULL);
+	assert(out != NULL);
+
+	int mode;
+	switch (type) {
+	case IT_FILE:
+	case IT_ARCHIVE:
+	case IT_BINARY:
+	case IT_GIF:
+	case IT_HTML:
+	case IT_IMAGE:
+	case IT_AUDIO:
+		mode = R_OK;
+		break;
+	case IT_DIR:
+		mode = R_OK | X_OK;
+		break;
+	case IT_IGNORE:
+	default:
+		return (false);
+	}
+
+	if (faccessat(dirfd, name, mode, 0) == -1) {
+		if (errno != EACCES && errno != ENOENT) {
+			syslog(LOG_ERR, "faccessat error: %m");
+			send_error(out, "E: faccessat", strerror(errno));
+			send_info(out, "I: I couldn't check access rights "
+			    "for an item.", name);
+		}
+		return (false);
+	}
+
+	return (true);
+}
+
+static enum entrykind
+entry_kind(const struct dirent *entry)
+{
+	assert(entry != NULL);
+
+#ifdef DT_UNKNOWN
+	return (type_kind(entry->d_type));
+#else
+	return (ENTRY_UNKNOWN);
+#endif
+}
+
+/*
+ * Maps a d_type, as also kept by the name index, to what it tells.
+ */
+static enum entrykind
+type_kind(int type)
+{
+#ifdef DT_UNKNOWN
+	switch (type) {
+	case DT_UNKNOWN:
+		return (ENTRY_UNKNOWN);
+	case DT_REG:
+		return (ENTRY_REGULAR);
+	case DT_DIR:
+		return (ENTRY_DIRECTORY);
+	default:
+		return (ENTRY_OTHER);
+	}
+#else
+	(void)type;
+	return (ENTRY_UNKNOWN);
+#endif
+}
+
+/*
+ * Plain byte order: the menu must not depend on the locale of the server.
+ */
+static int
+entry_compare(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	const struct entry *ea = a;
+	const struct entry *eb = b;
+
+	return (strcmp(ea->name, eb->name));
+}
+
+/*
+ * Determines the item type of name relative to dirfd, which may be AT_FDCWD.
+ * Symbolic links are never followed. If kind already tells the answer, the
+ * file system is not consulted at all.
+ */
+static char
+itemtype(int dirfd, const char *name, enum entrykind kind, FILE *out)
+{
+	assert(name != NULL);
+
+	switch (kind) {
+	case ENTRY_DIRECTORY:
+		return (IT_DIR);
+	case ENTRY_OTHER:
+		return (IT_IGNORE);
+	case ENTRY_REGULAR:
+	case ENTRY_UNKNOWN:
+	default:
+		break;
+	}
+
+	char it = is_script(dirfd, name) ? IT_FILE :
+	    classify_extension(name);
+	if (it != '\0' && kind == ENTRY_REGULAR)
+		return (it);
+
+	struct stat s;
+	if (fstatat(dirfd, name, &s, AT_SYMLINK_NOFOLLOW) == -1) {
+		syslog(LOG_ERR, "fstatat error: %m");
+		send_error(out, "E: fstatat", strerror(errno));
+		send_info(out, "I: I could not get file status.", name);
+		return (IT_IGNORE);
+	}
+
+	if (S_ISREG(s.st_mode)) {
+		if (it != '\0')
+			return (it);
+
+		it = typecache_get(&s);
+		if (it != '\0') {
+			metrics_count(METRICS_TYPECACHE_HIT, 1);
+			return (it);
+		}
+		metrics_count(METRICS_TYPECACHE_MISS, 1);
+
+		if (siteindex_enabled()) {
+			it = siteindex_type(&s);
+			if (it != '\0') {
+				metrics_count(METRICS_INDEXTYPE_HIT, 1);
+				typecache_put(&s, it);
+				return (it);
+			}
+			metrics_count(METRICS_INDEXTYPE_MISS, 1);
+		}
+
+		const char *mime = tool_mimetype(dirfd, name, out);
+		if (mime == NULL)
+			return (IT_IGNORE);
+
+		it = classify_mime(mime);
+		typecache_put(&s, it);
+	} else if (S_ISDIR(s.st_mode))
+		it = IT_DIR;
+	else
+		it = IT_IGNORE;
+
+	return (it);
+}
+
+/*
+ * Looks the file up in the file cache. Files in watched directories are
+ * served without touching the file system at all, all others are validated
+ * with a single stat(2).
+ */
+static bool
+lookup_file(const char *selector, const char *path, struct response *response)
+{
+	assert(selector != NULL);
+	assert(path != NULL);
+	assert(response != NULL);
+
+	struct cachedfile *f;
+	if (parent_covered(selector))
+		f = filecache_get(selector, NULL);
+	else {
+		struct stat s;
+		if (lstat(path, &s) == -1 || !S_ISREG(s.st_mode))
+			return (false);
+		f = filecache_get(selector, &s);
+	}
+	if (f == NULL)
+		return (false);
+
+	response->cached = f;
+
+	return (true);
+}
+
+/*
+ * Replaces the opened file of the response by its cached wire bytes if it is
+ * small enough and has been asked for before.
+ */
+static void
+cache_file(const char *selector, char type, struct response *response)
+{
+	assert(selector != NULL);
+	assert(response != NULL);
+	assert(response->fd != -1);
+
+	metrics_count(METRICS_FILECACHE_MISS, 1);
+
+	struct stat s;
+	if (fstat(response->fd, &s) == -1) {
+		syslog(LOG_ERR, "fstat error: %m");
+		return;
+	}
+	if ((uintmax_t)s.st_size > filecache_maxsize() ||
+	    !filecache_admit(selector))
+		return;
+
+	char *data;
+	size_t len;
+	if (!transfer_load(response->fd, response->text, &data, &len))
+		return;
+
+	struct cachedfile *f = filecache_put(selector, &s, type, data, len);
+	if (f == NULL)
+		return;
+
+	close(response->fd);
+	response->fd = -1;
+	response->text = false;
+	response->cached = f;
+}
+
+static bool
+parent_covered(const char *selector)
+{
+	assert(selector != NULL);
+	assert(*selector == '/');
+
+	char parent[LINE_MAX];
+	const char *slash = strrchr(selector, '/');
+	size_t l = (slash == selector) ? 1 : (size_t)(slash - selector);
+	memcpy(parent, selector, l);
+	parent[l] = '\0';
+
+	return (watch_covers(parent));
+}
+
+static bool
+open_file(struct context *context, int *fd)
+{
+	assert(context != NULL);
+	assert(fd != NULL);
+
+	*fd = open(context->path, O_RDONLY);
+	if (*fd == -1) {
+		syslog(LOG_ERR, "open error: %m");
+		send_error(context->out, "E: open", strerror(errno));
+		send_info(context->out, "I: I could not open the requested "
+		    "item.", context->path);
+		send_eom(context->out);
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool
+write_gophermap(struct opt_options *options, struct context *context,
+    int dirfd, const char *map)
+{
+	assert(options != NULL);
+	assert(context != NULL);
+	assert(map != NULL);
+
+	int fd = openat(dirfd, GOPHERMAP, O_RDONLY);
+	FILE *in = (fd == -1) ? NULL : fdopen(fd, "r");
+	if (in == NULL) {
+		syslog(LOG_ERR, "open error: %m");
+		send_error(context->out, "E: open", strerror(errno));
+		send_info(context->out, "I: I could not open a gophermap.",
+		    map);
+		send_eom(context->out);
+		if (fd != -1)
+			close(fd);
+		return (false);
+	}
+
+	char *line = arena_alloc(context->arena, LINE_MAX);
+	if (line == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		send_error(context->out, "E: malloc", strerror(errno));
+		send_info(context->out, "I: I could not allocate memory.",
+		    NULL);
+		send_eom(context->out);
+		exit(EXIT_FAILURE);
+	}
+
+	bool success = true;
+	while (fgets(line, LINE_MAX, in) != NULL) {
+		tool_strip_crlf(line);
+		write_map_line(options, context, line, map);
+	}
+	if (ferror(in)) {
+		syslog(LOG_ERR, "fgets error: %m");
+		send_error(context->out, "E: fgets", strerror(errno));
+		send_info(context->out, "I: I have a problem reading a "
+		    "gophermap.", map);
+		success = false;
+	}
+	send_eom(context->out);
+
+	fclose(in);
+
+	return (success);
+}
+
+/*
+ * Sends a line of a gophermap: lines with a tab are items, all others are
+ * informational messages.
+ */
+static void
+write_map_line(struct opt_options *options, struct context *context,
+    char *line, const char *map)
+{
+	assert(options != NULL);
+	assert(context != NULL);
+	assert(line != NULL);
+	assert(map != NULL);
+
+	if (strchr(line, '\t') == NULL) {
+		send_info(context->out, line, NULL);
+		return;
+	}
+
+	struct arena_mark mark = arena_mark(context->arena);
+	struct item item;
+	if (gophermap_parse_item(options, context->arena, &item,
+	    context->selector, line, context->out))
+		send_item(context->out, &item);
+	else
+		send_info(context->out, "I: I encountered a problem parsing a "
+		    "gophermap.", map);
+	arena_rewind(context->arena, mark);
+}
+
+/*
+ * Tells whether name is a script to be run instead of being sent.
+ */
+static bool
+is_script(int dirfd, const char *name)
+{
+	assert(name != NULL);
+
+	if (!script_enabled())
+		return (false);
+
+	size_t len = strlen(name);
+	size_t suffix = strlen(SCRIPT_SUFFIX);
+
+	return (len > suffix &&
+	    strcmp(name + len - suffix, SCRIPT_SUFFIX) == 0 &&
+	    faccessat(dirfd, name, X_OK, 0) == 0);
+}
+
+/*
+ * Runs the script at path and sends its answer, either as a gophermap if
+ * menu is set or as a text file.
+ */
+static bool
+write_script(struct opt_options *options, struct context *context,
+    const char *path, bool menu)
+{
+	assert(options != NULL);
+	assert(context != NULL);
+	assert(path != NULL);
+
+	char peer[NI_MAXHOST] = "-";
+	if (context->peerlen > 0 && getnameinfo(context->peer,
+	    context->peerlen, peer, sizeof(peer), NULL, 0,
+	    NI_NUMERICHOST) != 0)
+		strcpy(peer, "-");
+
+	struct script *s = script_request(path, context->selector,
+	    context->query, peer);
+	if (s == NULL) {
+		send_error(context->out, "E: script", context->selector);
+		send_info(context->out, "I: I could not run a script.", path);
+		send_eom(context->out);
+		return (false);
+	}
+
+	char *line = arena_alloc(context->arena, LINE_MAX);
+	if (line == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		send_error(context->out, "E: malloc", strerror(errno));
+		send_info(context->out, "I: I could not allocate memory.",
+		    NULL);
+		send_eom(context->out);
+		exit(EXIT_FAILURE);
+	}
+
+	int r;
+	while ((r = script_line(s, line, LINE_MAX)) == 1) {
+		if (menu) {
+			write_map_line(options, context, line, path);
+			continue;
+		}
+#ifdef STRICT_RFC1436
+		if (*line == '.')
+			fputc('.', context->out);
+#endif
+		fprintf(context->out, "%s\r\n", line);
+	}
+	if (r == -1) {
+		send_error(context->out, "E: script", context->selector);
+		send_info(context->out, "I: A script failed.", path);
+	}
+	send_eom(context->out);
+
+	return (r == 0);
+}
@@ -0,0 +1,51 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "arena.h"
+#include "filecache.h"
+#include "options.h"
+
+/*
+ * A response consists of everything written to out, optionally followed by
+ * the contents of the file descriptor fd. The latter is used for files, so
+ * the caller may choose how to transfer them. If text is set, fd has to be
+ * transferred as a text file entity. Instead of fd, cached may reference a
+ * file from the file cache whose data is to be sent as is. The reference has
+ * to be released with filecache_release(). Items served from a pack are
+ * given as data instead, which stays mapped and is sent as is, too. type is
+ * set to the item type of the requested item, or to IT_ERROR if it could not
+ * be served. peer is the address of the client, if known, and is passed on
+ * to scripts.
+ */
+struct response {
+	FILE *out;
+	const struct sockaddr *peer;
+	socklen_t peerlen;
+	int fd;
+	bool text;
+	struct cachedfile *cached;
+	const char *data;
+	size_t datalen;
+	char type;
+};
+
+bool request_handle(struct opt_options *_options, struct arena *_arena,
+    char *_request, struct response *_response);
+char request_itemtype(const char *_path, FILE *_out);
+bool request_listed(const char *_path, char _type, FILE *_out);
+bool request_canonicalize(const char *_request, char *_selector);
+
+#endif /* !REQUEST_H */
@@ -0,0 +1,374 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "script.h"
+
+#define BUFSIZE		4096
+
+/*
+ * Executable gophermaps and scripts are not run once per request but kept
+ * running, each connected to mgopherd through a Unix domain socket on its
+ * standard input and output. A request is written as three lines holding
+ * the selector, the query and the address of the client:
+ *
+ *	selector LF query LF peer LF
+ *
+ * The script answers with any number of lines, terminated by a line holding
+ * a single period. Lines of the answer starting with a period get an extra
+ * one, which is removed. The script is then expected to wait for the next
+ * request; it is stopped once mgopherd exits or needs its slot for another
+ * script.
+ */
+struct script {
+	char *path;
+	pid_t pid;
+	int fd;
+	uint64_t used;
+	struct timespec deadline;
+	size_t start;
+	size_t end;
+	char buf[BUFSIZE];
+};
+
+extern char **environ;
+
+static struct script **scripts;
+static size_t nscripts;
+static size_t maxscripts;
+static long timeout;
+static uint64_t tick;
+
+static struct script *start_script(const char *path);
+static void stop_script(struct script *s);
+static bool send_request(struct script *s, const char *selector,
+    const char *query, const char *peer);
+static int remaining(const struct timespec *deadline);
+
+/*
+ * Allows up to max scripts to be kept running by this process. A script
+ * taking longer than timeout seconds to answer is stopped; 0 waits forever.
+ */
+void
+script_init(size_t max, long t)
+{
+	scripts = calloc(max, sizeof(struct script *));
+	if (scripts == NULL) {
+		syslog(LOG_ERR, "calloc error: %m");
+		exit(EXIT_FAILURE);
+	}
+	maxscripts = max;
+	timeout = t;
+}
+
+bool
+script_enabled(void)
+{
+	return (maxscripts > 0);
+}
+
+/*
+ * Passes a request to the script at path, starting it if it is not
+ * running yet. The answer is read with script_line(). NULL is returned if
+ * the script could not be started.
+ */
+struct script *
+script_request(const char *path, const char *selector, const char *query,
+    const char *peer)
+{
+	assert(path != NULL);
+	assert(selector != NULL);
+	assert(query != NULL);
+	assert(peer != NULL);
+	assert(maxscripts > 0);
+
+	struct script *s = NULL;
+	for (size_t i = 0; i < nscripts; i++)
+		if (strcmp(scripts[i]->path, path) == 0) {
+			s = scripts[i];
+			break;
+		}
+
+	/*
+	 * A running script may have exited since its last answer, so a
+	 * request it does not take is retried with a new one.
+	 */
+	if (s != NULL) {
+		if (s->start == s->end &&
+		    send_request(s, selector, query, peer))
+			return (s);
+		syslog(LOG_NOTICE, "restarting script \"%s\"", path);
+		stop_script(s);
+	}
+
+	s = start_script(path);
+	if (s == NULL)
+		return (NULL);
+	if (!send_request(s, selector, query, peer)) {
+		stop_script(s);
+		return (NULL);
+	}
+
+	return (s);
+}
+
+/*
+ * Reads the next line of the answer of s into line, a buffer of size bytes,
+ * without its line terminator. Longer lines are split. Returns 1 for a
+ * line, 0 at the end of the answer and -1 if the script failed, in which
+ * case it is stopped and s must not be used any more.
+ */
+int
+script_line(struct script *s, char *line, size_t size)
+{
+	assert(s != NULL);
+	assert(line != NULL);
+	assert(size > 1);
+
+	for (;;) {
+		char *p = s->buf + s->start;
+		size_t avail = s->end - s->start;
+		char *nl = memchr(p, '\n', avail);
+		if (nl != NULL || avail >= size - 1 ||
+		    (s->start == 0 && s->end == BUFSIZE)) {
+			size_t len = (nl != NULL) ? (size_t)(nl - p) : avail;
+			size_t skip = (nl != NULL) ? len + 1 : len;
+			if (len > size - 1) {
+				len = size - 1;
+				skip = len;
+			}
+			memcpy(line, p, len);
+			line[len] = '\0';
+			s->start += skip;
+			if (len > 0 && line[len - 1] == '\r')
+				line[len - 1] = '\0';
+
+			if (strcmp(line, ".") == 0)
+				return (0);
+			if (line[0] == '.')
+				memmove(line, line + 1, strlen(line));
+			return (1);
+		}
+
+		if (s->start > 0) {
+			memmove(s->buf, p, avail);
+			s->start = 0;
+			s->end = avail;
+		}
+
+		struct pollfd pfd = {
+			.fd = s->fd,
+			.events = POLLIN
+		};
+		int r = poll(&pfd, 1, remaining(&s->deadline));
+		if (r == -1 && errno == EINTR)
+			continue;
+		if (r == 0) {
+			syslog(LOG_NOTICE, "script \"%s\" timed out", s->path);
+			stop_script(s);
+			return (-1);
+		}
+
+		ssize_t n = read(s->fd, s->buf + s->end, BUFSIZE - s->end);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == -1)
+				syslog(LOG_ERR, "read script error: %m");
+			else
+				syslog(LOG_NOTICE, "script \"%s\" exited",
+				    s->path);
+			stop_script(s);
+			return (-1);
+		}
+		s->end += n;
+	}
+}
+
+/*
+ * Starts the script at path in its directory and its own process group,
+ * with both its standard input and output connected to a new socket and its
+ * standard error discarded.
+ * If all slots are taken, the script used least recently is stopped.
+ */
+static struct script *
+start_script(const char *path)
+{
+	assert(path != NULL);
+
+	if (nscripts == maxscripts) {
+		struct script *lru = scripts[0];
+		for (size_t i = 1; i < nscripts; i++)
+			if (scripts[i]->used < lru->used)
+				lru = scripts[i];
+		stop_script(lru);
+	}
+
+	struct script *s = calloc(1, sizeof(struct script));
+	char *dir = strdup(path);
+	if (s == NULL || dir == NULL || (s->path = strdup(path)) == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		free(dir);
+		free(s);
+		return (NULL);
+	}
+	char *slash = strrchr(dir, '/');
+	if (slash != NULL)
+		slash[slash == dir ? 1 : 0] = '\0';
+
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		syslog(LOG_ERR, "socketpair error: %m");
+		free(dir);
+		free(s->path);
+		free(s);
+		return (NULL);
+	}
+
+	/* Only async-signal-safe calls are made between fork and exec. */
+	long maxfd = sysconf(_SC_OPEN_MAX);
+	if (maxfd == -1)
+		maxfd = 1024;
+	char *argv[] = { s->path, NULL };
+	sigset_t none;
+	sigemptyset(&none);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		syslog(LOG_ERR, "fork error: %m");
+		close(sv[0]);
+		close(sv[1]);
+		free(dir);
+		free(s->path);
+		free(s);
+		return (NULL);
+	}
+	if (pid == 0) {
+		int null = open("/dev/null", O_WRONLY);
+		if (dup2(sv[1], STDIN_FILENO) == -1 ||
+		    dup2(sv[1], STDOUT_FILENO) == -1 ||
+		    (null != -1 && dup2(null, STDERR_FILENO) == -1))
+			_exit(127);
+		for (long fd = STDERR_FILENO + 1; fd < maxfd; fd++)
+			close(fd);
+		setpgid(0, 0);
+		signal(SIGPIPE, SIG_DFL);
+		sigprocmask(SIG_SETMASK, &none, NULL);
+		if (chdir(dir) == -1)
+			_exit(127);
+		execve(s->path, argv, environ);
+		_exit(127);
+	}
+
+	setpgid(pid, pid);
+	close(sv[1]);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	free(dir);
+	s->pid = pid;
+	s->fd = sv[0];
+	scripts[nscripts++] = s;
+	metrics_count(METRICS_SCRIPT_STARTS, 1);
+	syslog(LOG_DEBUG, "started script \"%s\": %ld", path, (long)pid);
+
+	return (s);
+}
+
+static void
+stop_script(struct script *s)
+{
+	assert(s != NULL);
+
+	/* Children the script started share its process group. */
+	close(s->fd);
+	kill(-s->pid, SIGKILL);
+	while (waitpid(s->pid, NULL, 0) == -1 && errno == EINTR)
+		continue;
+
+	for (size_t i = 0; i < nscripts; i++)
+		if (scripts[i] == s) {
+			scripts[i] = scripts[--nscripts];
+			break;
+		}
+	free(s->path);
+	free(s);
+}
+
+static bool
+send_request(struct script *s, const char *selector, const char *query,
+    const char *peer)
+{
+	assert(s != NULL);
+	assert(selector != NULL);
+	assert(query != NULL);
+	assert(peer != NULL);
+
+	size_t len = strlen(selector) + strlen(query) + strlen(peer) + 4;
+	char *request = malloc(len);
+	if (request == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		return (false);
+	}
+	len = snprintf(request, len, "%s\n%s\n%s\n", selector, query, peer);
+
+	bool success = true;
+	for (size_t off = 0; off < len;) {
+		ssize_t n = send(s->fd, request + off, len - off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			success = false;
+			break;
+		}
+		off += n;
+	}
+	free(request);
+
+	s->used = ++tick;
+	clock_gettime(CLOCK_MONOTONIC, &s->deadline);
+	s->deadline.tv_sec += timeout;
+
+	return (success);
+}
+
+/*
+ * Returns the milliseconds left until deadline for poll(2).
+ */
+static int
+remaining(const struct timespec *deadline)
+{
+	assert(deadline != NULL);
+
+	if (timeout == 0)
+		return (-1);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	long ms = (deadline->tv_sec - now.tv_sec) * 1000 +
+	    (deadline->tv_nsec - now.tv_nsec) / 1000000;
+
+	return (ms > 0 ? (int)ms : 0);
+}
@@ -0,0 +1,25 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Executable files with this suffix are run instead of being sent. */
+#define SCRIPT_SUFFIX	".cgi"
+
+struct script;
+
+void script_init(size_t _max, long _timeout);
+bool script_enabled(void);
+struct script *script_request(const char *_path, const char *_selector,
+    const char *_query, const char *_peer);
+int script_line(struct script *_s, char *_line, size_t _size);
+
+#endif /* !SCRIPT_H */
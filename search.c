@@ -0,0 +1,1356 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "itemtypes.h"
+#include "search.h"
+#include "send.h"
+#include "tools.h"
+
+#define MAGIC		"MGOPHFT"
+#define VERSION		2
+#define BYTEORDER	0x01020304
+#define MAXTERM		64		/* longer words are not indexed */
+#define MAXWORDS	(4 << 20)	/* indexed words per document */
+#define MAXTERMS	16		/* words per query */
+#define MAXRESULTS	100
+#define READSIZE	(64 * 1024)
+#define NONE		UINT64_MAX
+
+/*
+ * A search index is written by mgopherd-index and mapped read-only by
+ * mgopherd. It consists of a header, a table of documents, a table of terms
+ * sorted by the term, a heap holding all strings and the postings. All
+ * offsets are relative to the start of the file.
+ *
+ * A term is a run of ASCII letters and digits or bytes beyond ASCII, folded
+ * to lower case. Its postings list every document it occurs in and every
+ * position it occurs at, counted in words from the start of the document.
+ * They are stored as variable length integers of seven bits each, documents
+ * as the distance to the previous document of the list and positions as the
+ * distance to the previous position within the document. The positions
+ * are preceded by their length in bytes, so documents can be skipped
+ * without decoding them:
+ *
+ *	doc delta, number of positions, length, position delta, ...
+ *
+ * Every document carries the stat(2) stamp of its file, so a new index can
+ * take the postings of unchanged files from the old one without reading
+ * them again.
+ */
+struct header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t size;
+	uint64_t docs;
+	uint64_t ndocs;
+	uint64_t terms;
+	uint64_t nterms;
+};
+
+struct docrecord {
+	uint64_t selector;
+	struct tool_stamp stamp;
+};
+
+struct termrecord {
+	uint64_t term;
+	uint64_t postings;
+	uint64_t len;
+	uint64_t ndocs;
+};
+
+/*
+ * A mapped index: the one served, or the previous one of a builder.
+ */
+struct index {
+	char *map;
+	size_t size;
+	const struct header *header;
+	const struct docrecord *docs;
+	const struct termrecord *terms;
+};
+
+/*
+ * While an index is built, the postings of a term are collected in buf in
+ * the order the documents are added, each entry starting with the absolute
+ * document number. They are sorted and delta encoded when the index is
+ * written.
+ */
+struct term {
+	char *name;
+	uint32_t hash;
+	struct term *next;
+	unsigned char *buf;
+	size_t len;
+	size_t capacity;
+	uint64_t ndocs;
+	uint64_t lastdoc;	/* document + 1 counted for last */
+	size_t count;
+	size_t slot;
+};
+
+struct doc {
+	char *selector;
+	struct tool_stamp stamp;
+};
+
+struct occurrence {
+	struct term *term;
+	uint32_t position;
+};
+
+struct search_builder {
+	struct index old;
+	uint64_t *oldbuckets;	/* old document + 1 by selector hash */
+	size_t noldbuckets;
+	uint64_t *remap;	/* old document to new document or NONE */
+	struct term **buckets;
+	size_t nbuckets;
+	size_t nterms;
+	struct doc *docs;
+	size_t ndocs;
+	size_t docscapacity;
+	struct occurrence *occ;
+	struct term **touched;
+	uint32_t *positions;
+	size_t nocc;
+	size_t occcapacity;
+	size_t reused;
+};
+
+struct tokenizer {
+	char word[MAXTERM + 1];
+	size_t len;
+	bool toolong;
+	uint32_t position;
+};
+
+struct entry {
+	uint64_t doc;
+	size_t start;
+	size_t end;
+};
+
+struct cursor {
+	const unsigned char *p;
+	const unsigned char *end;
+	uint64_t doc;
+	uint64_t npos;
+	const unsigned char *positions;
+};
+
+/*
+ * A word of a query. Words in double quotes form a phrase and have to
+ * occur at consecutive positions; they share a group and are numbered by
+ * offset within it.
+ */
+struct queryterm {
+	char name[MAXTERM + 1];
+	int group;
+	uint32_t offset;
+	struct cursor cursor;
+	uint32_t *pos;
+	size_t npos;
+	size_t poscapacity;
+};
+
+struct result {
+	uint64_t doc;
+	uint64_t score;
+};
+
+static struct index served;
+
+static bool map_index(struct index *ix, const char *path);
+static const struct termrecord *find_term(const struct index *ix,
+    const char *name);
+static bool word_byte(unsigned char c);
+static bool tokenize(struct search_builder *b, struct tokenizer *t,
+    const char *buf, size_t len);
+static bool add_occurrence(struct search_builder *b, struct tokenizer *t);
+static bool add_postings(struct search_builder *b, uint64_t doc);
+static bool add_doc(struct search_builder *b, const char *selector,
+    const struct tool_stamp *stamp);
+static uint64_t find_old(const struct search_builder *b,
+    const char *selector);
+static bool carry_old(struct search_builder *b);
+static struct term *intern(struct search_builder *b, const char *name);
+static bool grow_terms(struct search_builder *b);
+static bool finish_postings(struct term *t);
+static bool put(struct term *t, const void *data, size_t len);
+static bool put_varint(struct term *t, uint64_t v);
+static bool get_varint(const unsigned char **p, const unsigned char *end,
+    uint64_t *v);
+static size_t varint_size(uint64_t v);
+static bool get_positions(const unsigned char **p, const unsigned char *end,
+    uint64_t *npos, const unsigned char **positions);
+static size_t parse_query(const char *query, struct queryterm *terms);
+static bool cursor_next(struct cursor *c);
+static bool cursor_positions(struct queryterm *qt);
+static bool match_phrases(struct queryterm *terms, size_t nterms);
+static void add_result(struct result *results, size_t *nresults,
+    uint64_t doc, uint64_t score);
+static uint32_t hash(const char *s);
+static int compare_terms(const void *a, const void *b);
+static int compare_entries(const void *a, const void *b);
+static int compare_results(const void *a, const void *b);
+
+/*
+ * Maps the index at path. An index that cannot be read or is damaged is
+ * logged and ignored; searches are then answered with an error message.
+ */
+void
+search_open(const char *path)
+{
+	assert(path != NULL);
+
+	if (!map_index(&served, path)) {
+		syslog(LOG_ERR, "ignoring search index \"%s\"", path);
+		return;
+	}
+
+	syslog(LOG_INFO, "search index \"%s\": %ju documents, %ju terms",
+	    path, (uintmax_t)served.header->ndocs,
+	    (uintmax_t)served.header->nterms);
+}
+
+bool
+search_enabled(void)
+{
+	return (served.map != NULL);
+}
+
+/*
+ * Answers query with a menu of the matching documents, those holding the
+ * most occurrences of the words first. The menu is not terminated.
+ */
+void
+search_query(const char *query, FILE *out, const char *host,
+    const char *port)
+{
+	assert(query != NULL);
+	assert(out != NULL);
+	assert(host != NULL);
+	assert(port != NULL);
+	assert(served.map != NULL);
+
+	struct queryterm terms[MAXTERMS];
+	size_t nterms = parse_query(query, terms);
+	if (nterms == 0) {
+		send_info(out, "Enter one or more words to search for.",
+		    NULL);
+		return;
+	}
+
+	bool phrases = false;
+	bool found = true;
+	for (size_t i = 0; i < nterms; i++) {
+		const struct termrecord *t = find_term(&served, terms[i].name);
+		if (t == NULL) {
+			found = false;
+			break;
+		}
+		terms[i].cursor.p = (const unsigned char *)served.map +
+		    t->postings;
+		terms[i].cursor.end = terms[i].cursor.p + t->len;
+		terms[i].cursor.doc = 0;
+		if (!cursor_next(&terms[i].cursor))
+			found = false;
+		if (terms[i].offset > 0)
+			phrases = true;
+	}
+
+	struct result results[MAXRESULTS];
+	size_t nresults = 0;
+	uint64_t total = 0;
+	while (found) {
+		uint64_t target = 0;
+		for (size_t i = 0; i < nterms; i++)
+			if (terms[i].cursor.doc > target)
+				target = terms[i].cursor.doc;
+
+		bool aligned = true;
+		for (size_t i = 0; found && i < nterms; i++) {
+			while (found && terms[i].cursor.doc < target)
+				found = cursor_next(&terms[i].cursor);
+			if (terms[i].cursor.doc != target)
+				aligned = false;
+		}
+		if (!found)
+			break;
+		if (!aligned)
+			continue;
+
+		if (target < served.header->ndocs &&
+		    (!phrases || match_phrases(terms, nterms))) {
+			uint64_t score = 0;
+			for (size_t i = 0; i < nterms; i++)
+				score += terms[i].cursor.npos;
+			add_result(results, &nresults, target, score);
+			total++;
+		}
+		found = cursor_next(&terms[0].cursor);
+	}
+	for (size_t i = 0; i < nterms; i++)
+		free(terms[i].pos);
+
+	char line[128];
+	if (total > nresults)
+		snprintf(line, sizeof(line), "%" PRIu64 " documents found, "
+		    "showing the best %zu.", total, nresults);
+	else
+		snprintf(line, sizeof(line), "%" PRIu64 " documents found.",
+		    total);
+	send_info(out, line, NULL);
+
+	qsort(results, nresults, sizeof(struct result), &compare_results);
+	for (size_t i = 0; i < nresults; i++) {
+		char *selector = served.map +
+		    served.docs[results[i].doc].selector;
+		struct item item = {
+			.type = IT_FILE,
+			.display = selector,
+			.selector = selector,
+			.host = (char *)host,
+			.port = (char *)port
+		};
+		send_item(out, &item);
+	}
+}
+
+/*
+ * Starts a new index. If old names an existing index, the postings of files
+ * that did not change since it was written are taken from it.
+ */
+struct search_builder *
+search_builder_new(const char *old)
+{
+	struct search_builder *b = calloc(1, sizeof(struct search_builder));
+	if (b == NULL)
+		return (NULL);
+
+	if (!grow_terms(b)) {
+		search_builder_free(b);
+		return (NULL);
+	}
+
+	if (old == NULL || access(old, F_OK) == -1 || !map_index(&b->old, old))
+		return (b);
+
+	uint64_t ndocs = b->old.header->ndocs;
+	b->noldbuckets = 1;
+	while (b->noldbuckets < ndocs * 2)
+		b->noldbuckets *= 2;
+	b->oldbuckets = calloc(b->noldbuckets, sizeof(uint64_t));
+	b->remap = malloc((ndocs > 0 ? ndocs : 1) * sizeof(uint64_t));
+	if (b->oldbuckets == NULL || b->remap == NULL) {
+		search_builder_free(b);
+		return (NULL);
+	}
+	for (uint64_t d = 0; d < ndocs; d++) {
+		b->remap[d] = NONE;
+		size_t i = hash(b->old.map + b->old.docs[d].selector) &
+		    (b->noldbuckets - 1);
+		while (b->oldbuckets[i] != 0)
+			i = (i + 1) & (b->noldbuckets - 1);
+		b->oldbuckets[i] = d + 1;
+	}
+
+	return (b);
+}
+
+/*
+ * Adds the text file at path under selector. Files that cannot be read are
+ * logged and left out. False is returned if no memory is left.
+ */
+bool
+search_builder_add(struct search_builder *b, const char *selector,
+    const char *path, const struct stat *s)
+{
+	assert(b != NULL);
+	assert(selector != NULL);
+	assert(path != NULL);
+	assert(s != NULL);
+
+	struct tool_stamp stamp;
+	tool_make_stamp(&stamp, s);
+
+	uint64_t old = find_old(b, selector);
+	if (old != NONE && tool_same_stamp(&b->old.docs[old].stamp, s, false)) {
+		b->remap[old] = b->ndocs;
+		b->reused++;
+		return (add_doc(b, selector, &stamp));
+	}
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		syslog(LOG_WARNING, "open \"%s\" error: %m", path);
+		return (true);
+	}
+
+	char *buf = malloc(READSIZE);
+	if (buf == NULL) {
+		close(fd);
+		return (false);
+	}
+
+	struct tokenizer t = {
+		.len = 0
+	};
+	b->nocc = 0;
+	bool success = true;
+	for (;;) {
+		ssize_t r = read(fd, buf, READSIZE);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_WARNING, "read \"%s\" error: %m", path);
+			free(buf);
+			close(fd);
+			return (true);
+		}
+		if (r == 0)
+			break;
+		if (!tokenize(b, &t, buf, r)) {
+			success = false;
+			break;
+		}
+	}
+	free(buf);
+	close(fd);
+
+	if (!success || !tokenize(b, &t, " ", 1))
+		return (false);
+
+	return (add_postings(b, b->ndocs) && add_doc(b, selector, &stamp));
+}
+
+/*
+ * Writes the index to a temporary file next to path and renames it into
+ * place, so running servers keep the index they have mapped.
+ */
+bool
+search_builder_write(struct search_builder *b, const char *path)
+{
+	assert(b != NULL);
+	assert(path != NULL);
+
+	if (b->old.map != NULL && !carry_old(b))
+		return (false);
+	syslog(LOG_INFO, "search index: %zu documents, %zu taken from the "
+	    "previous index", b->ndocs, b->reused);
+
+	struct term **terms = malloc((b->nterms > 0 ? b->nterms : 1) *
+	    sizeof(struct term *));
+	if (terms == NULL)
+		return (false);
+	size_t n = 0;
+	for (size_t i = 0; i < b->nbuckets; i++)
+		for (struct term *t = b->buckets[i]; t != NULL; t = t->next)
+			terms[n++] = t;
+	qsort(terms, n, sizeof(struct term *), &compare_terms);
+	for (size_t i = 0; i < n; i++)
+		if (!finish_postings(terms[i])) {
+			free(terms);
+			return (false);
+		}
+
+	struct header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(h.magic));
+	h.version = VERSION;
+	h.byteorder = BYTEORDER;
+	h.docs = sizeof(struct header);
+	h.ndocs = b->ndocs;
+	h.terms = h.docs + b->ndocs * sizeof(struct docrecord);
+	h.nterms = n;
+
+	/* The heap holds the selectors, the terms and then the postings. */
+	uint64_t strings = h.terms + n * sizeof(struct termrecord);
+	uint64_t postings = strings;
+	for (size_t i = 0; i < b->ndocs; i++)
+		postings += strlen(b->docs[i].selector) + 1;
+	for (size_t i = 0; i < n; i++)
+		postings += strlen(terms[i]->name) + 1;
+	h.size = postings;
+	for (size_t i = 0; i < n; i++)
+		h.size += terms[i]->len;
+
+	size_t l = strlen(path) + sizeof(".tmp");
+	char *tmp = malloc(l);
+	if (tmp == NULL) {
+		free(terms);
+		return (false);
+	}
+	snprintf(tmp, l, "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		free(tmp);
+		free(terms);
+		return (false);
+	}
+
+	bool success = tool_write_all(f, &h, sizeof(h));
+	uint64_t offset = strings;
+	for (size_t i = 0; success && i < b->ndocs; i++) {
+		struct docrecord d = {
+			.selector = offset,
+			.stamp = b->docs[i].stamp
+		};
+		offset += strlen(b->docs[i].selector) + 1;
+		success = tool_write_all(f, &d, sizeof(d));
+	}
+	for (size_t i = 0; success && i < n; i++) {
+		struct termrecord t = {
+			.term = offset,
+			.postings = postings,
+			.len = terms[i]->len,
+			.ndocs = terms[i]->ndocs
+		};
+		offset += strlen(terms[i]->name) + 1;
+		postings += terms[i]->len;
+		success = tool_write_all(f, &t, sizeof(t));
+	}
+	for (size_t i = 0; success && i < b->ndocs; i++)
+		success = tool_write_all(f, b->docs[i].selector,
+		    strlen(b->docs[i].selector) + 1);
+	for (size_t i = 0; success && i < n; i++)
+		success = tool_write_all(f, terms[i]->name,
+		    strlen(terms[i]->name) + 1);
+	for (size_t i = 0; success && i < n; i++)
+		success = tool_write_all(f, terms[i]->buf, terms[i]->len);
+	free(terms);
+
+	if (fclose(f) == EOF)
+		success = false;
+	if (success && rename(tmp, path) == -1)
+		success = false;
+	if (!success) {
+		int error = errno;
+		unlink(tmp);
+		errno = error;
+	}
+	free(tmp);
+
+	return (success);
+}
+
+void
+search_builder_free(struct search_builder *b)
+{
+	if (b == NULL)
+		return;
+
+	for (size_t i = 0; i < b->nbuckets; i++) {
+		struct term *t = b->buckets[i];
+		while (t != NULL) {
+			struct term *next = t->next;
+			free(t->name);
+			free(t->buf);
+			free(t);
+			t = next;
+		}
+	}
+	for (size_t i = 0; i < b->ndocs; i++)
+		free(b->docs[i].selector);
+	if (b->old.map != NULL)
+		munmap(b->old.map, b->old.size);
+	free(b->buckets);
+	free(b->docs);
+	free(b->occ);
+	free(b->touched);
+	free(b->positions);
+	free(b->oldbuckets);
+	free(b->remap);
+	free(b);
+}
+
+/*
+ * Maps and checks the index at path, so later lookups can not lead to reads
+ * outside the mapping. Postings are checked as they are decoded.
+ */
+static bool
+map_index(struct index *ix, const char *path)
+{
+	assert(ix != NULL);
+	assert(path != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		syslog(LOG_ERR, "open search index error: %m");
+		return (false);
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) == -1) {
+		syslog(LOG_ERR, "fstat search index error: %m");
+		close(fd);
+		return (false);
+	}
+	if ((uintmax_t)s.st_size < sizeof(struct header) ||
+	    (uintmax_t)s.st_size > SIZE_MAX) {
+		syslog(LOG_ERR, "search index \"%s\" has an invalid size",
+		    path);
+		close(fd);
+		return (false);
+	}
+
+	void *m = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		syslog(LOG_ERR, "mmap search index error: %m");
+		return (false);
+	}
+
+	ix->map = m;
+	ix->size = s.st_size;
+	ix->header = m;
+	const struct header *h = ix->header;
+	if (memcmp(h->magic, MAGIC, sizeof(h->magic)) != 0 ||
+	    h->version != VERSION || h->byteorder != BYTEORDER) {
+		syslog(LOG_ERR, "search index has an unknown format");
+		goto fail;
+	}
+	if (h->size != ix->size || h->docs != sizeof(struct header) ||
+	    h->ndocs > (ix->size - h->docs) / sizeof(struct docrecord) ||
+	    h->terms != h->docs + h->ndocs * sizeof(struct docrecord) ||
+	    h->nterms > (ix->size - h->terms) / sizeof(struct termrecord)) {
+		syslog(LOG_ERR, "search index is truncated");
+		goto fail;
+	}
+
+	ix->docs = (const struct docrecord *)(ix->map + h->docs);
+	ix->terms = (const struct termrecord *)(ix->map + h->terms);
+	for (uint64_t i = 0; i < h->ndocs; i++)
+		if (!tool_check_string(ix->map, ix->size,
+		    ix->docs[i].selector)) {
+			syslog(LOG_ERR, "search index is damaged");
+			goto fail;
+		}
+	for (uint64_t i = 0; i < h->nterms; i++) {
+		const struct termrecord *t = &ix->terms[i];
+		if (!tool_check_string(ix->map, ix->size, t->term) ||
+		    t->postings > ix->size ||
+		    t->len > ix->size - t->postings) {
+			syslog(LOG_ERR, "search index is damaged");
+			goto fail;
+		}
+	}
+
+	return (true);
+
+fail:
+	munmap(ix->map, ix->size);
+	memset(ix, 0, sizeof(*ix));
+	return (false);
+}
+
+static const struct termrecord *
+find_term(const struct index *ix, const char *name)
+{
+	assert(ix != NULL);
+	assert(name != NULL);
+
+	size_t lo = 0;
+	size_t hi = ix->header->nterms;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = strcmp(name, ix->map + ix->terms[mid].term);
+		if (cmp < 0)
+			hi = mid;
+		else if (cmp > 0)
+			lo = mid + 1;
+		else
+			return (&ix->terms[mid]);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Bytes beyond ASCII are taken as letters, so UTF-8 encoded words are kept
+ * together.
+ */
+static bool
+word_byte(unsigned char c)
+{
+	return ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	    (c >= '0' && c <= '9') || c >= 0x80);
+}
+
+/*
+ * Splits buf into words. A word may continue in the next buffer, so the
+ * state is kept in t.
+ */
+static bool
+tokenize(struct search_builder *b, struct tokenizer *t, const char *buf,
+    size_t len)
+{
+	assert(b != NULL);
+	assert(t != NULL);
+	assert(buf != NULL);
+
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = buf[i];
+		if (word_byte(c)) {
+			if (t->len < MAXTERM) {
+				if (c >= 'A' && c <= 'Z')
+					c += 'a' - 'A';
+				t->word[t->len++] = c;
+			} else
+				t->toolong = true;
+			continue;
+		}
+		if (t->len > 0 && !add_occurrence(b, t))
+			return (false);
+	}
+
+	return (true);
+}
+
+static bool
+add_occurrence(struct search_builder *b, struct tokenizer *t)
+{
+	assert(b != NULL);
+	assert(t != NULL);
+
+	t->word[t->len] = '\0';
+	bool skip = (t->toolong || t->position >= MAXWORDS);
+	uint32_t position = t->position++;
+	t->len = 0;
+	t->toolong = false;
+	if (skip)
+		return (true);
+
+	struct term *term = intern(b, t->word);
+	if (term == NULL)
+		return (false);
+
+	if (b->nocc == b->occcapacity) {
+		size_t c = (b->occcapacity == 0) ? 4096 : b->occcapacity * 2;
+		void *o = realloc(b->occ, c * sizeof(struct occurrence));
+		if (o == NULL)
+			return (false);
+		b->occ = o;
+		o = realloc(b->touched, c * sizeof(struct term *));
+		if (o == NULL)
+			return (false);
+		b->touched = o;
+		o = realloc(b->positions, c * sizeof(uint32_t));
+		if (o == NULL)
+			return (false);
+		b->positions = o;
+		b->occcapacity = c;
+	}
+	b->occ[b->nocc].term = term;
+	b->occ[b->nocc].position = position;
+	b->nocc++;
+
+	return (true);
+}
+
+/*
+ * Appends the occurrences collected for document doc to the postings of
+ * their terms. They are grouped by term with a counting sort, which keeps
+ * the positions of every term in order.
+ */
+static bool
+add_postings(struct search_builder *b, uint64_t doc)
+{
+	assert(b != NULL);
+
+	size_t ntouched = 0;
+	for (size_t i = 0; i < b->nocc; i++) {
+		struct term *t = b->occ[i].term;
+		if (t->lastdoc != doc + 1) {
+			t->lastdoc = doc + 1;
+			t->count = 0;
+			b->touched[ntouched++] = t;
+		}
+		t->count++;
+	}
+
+	size_t slot = 0;
+	for (size_t k = 0; k < ntouched; k++) {
+		b->touched[k]->slot = slot;
+		slot += b->touched[k]->count;
+	}
+	for (size_t i = 0; i < b->nocc; i++)
+		b->positions[b->occ[i].term->slot++] = b->occ[i].position;
+
+	const uint32_t *p = b->positions;
+	for (size_t k = 0; k < ntouched; k++) {
+		struct term *t = b->touched[k];
+		size_t len = 0;
+		uint32_t previous = 0;
+		for (size_t i = 0; i < t->count; i++) {
+			len += varint_size(p[i] - previous);
+			previous = p[i];
+		}
+
+		if (!put_varint(t, doc) || !put_varint(t, t->count) ||
+		    !put_varint(t, len))
+			return (false);
+		previous = 0;
+		for (size_t i = 0; i < t->count; i++, p++) {
+			if (!put_varint(t, *p - previous))
+				return (false);
+			previous = *p;
+		}
+		t->ndocs++;
+	}
+	b->nocc = 0;
+
+	return (true);
+}
+
+static bool
+add_doc(struct search_builder *b, const char *selector,
+    const struct tool_stamp *stamp)
+{
+	assert(b != NULL);
+	assert(selector != NULL);
+	assert(stamp != NULL);
+
+	if (b->ndocs == b->docscapacity) {
+		size_t c = (b->docscapacity == 0) ? 256 :
+		    b->docscapacity * 2;
+		void *d = realloc(b->docs, c * sizeof(struct doc));
+		if (d == NULL)
+			return (false);
+		b->docs = d;
+		b->docscapacity = c;
+	}
+
+	b->docs[b->ndocs].selector = strdup(selector);
+	if (b->docs[b->ndocs].selector == NULL)
+		return (false);
+	b->docs[b->ndocs].stamp = *stamp;
+	b->ndocs++;
+
+	return (true);
+}
+
+static uint64_t
+find_old(const struct search_builder *b, const char *selector)
+{
+	assert(b != NULL);
+	assert(selector != NULL);
+
+	if (b->old.map == NULL)
+		return (NONE);
+
+	size_t i = hash(selector) & (b->noldbuckets - 1);
+	while (b->oldbuckets[i] != 0) {
+		uint64_t d = b->oldbuckets[i] - 1;
+		if (strcmp(b->old.map + b->old.docs[d].selector, selector) == 0)
+			return (d);
+		i = (i + 1) & (b->noldbuckets - 1);
+	}
+
+	return (NONE);
+}
+
+/*
+ * Copies the postings of all documents taken over from the old index. Their
+ * positions are copied as they are, only the document number changes.
+ */
+static bool
+carry_old(struct search_builder *b)
+{
+	assert(b != NULL);
+	assert(b->old.map != NULL);
+
+	if (b->reused == 0)
+		return (true);
+
+	for (uint64_t i = 0; i < b->old.header->nterms; i++) {
+		const struct termrecord *r = &b->old.terms[i];
+		const unsigned char *p = (const unsigned char *)b->old.map +
+		    r->postings;
+		const unsigned char *end = p + r->len;
+		struct term *t = NULL;
+		uint64_t doc = 0;
+		while (p < end) {
+			uint64_t delta, npos;
+			const unsigned char *positions;
+			if (!get_varint(&p, end, &delta))
+				break;
+			doc += delta;
+			const unsigned char *start = p;
+			if (!get_positions(&p, end, &npos, &positions) ||
+			    doc >= b->old.header->ndocs)
+				break;
+			if (b->remap[doc] == NONE)
+				continue;
+
+			if (t == NULL &&
+			    (t = intern(b, b->old.map + r->term)) == NULL)
+				return (false);
+			if (!put_varint(t, b->remap[doc]) ||
+			    !put(t, start, p - start))
+				return (false);
+			t->ndocs++;
+		}
+	}
+
+	return (true);
+}
+
+static struct term *
+intern(struct search_builder *b, const char *name)
+{
+	assert(b != NULL);
+	assert(name != NULL);
+
+	uint32_t h = hash(name);
+	size_t i = h & (b->nbuckets - 1);
+	for (struct term *t = b->buckets[i]; t != NULL; t = t->next)
+		if (t->hash == h && strcmp(t->name, name) == 0)
+			return (t);
+
+	if (b->nterms >= b->nbuckets) {
+		if (!grow_terms(b))
+			return (NULL);
+		i = h & (b->nbuckets - 1);
+	}
+
+	struct term *t = calloc(1, sizeof(struct term));
+	if (t == NULL)
+		return (NULL);
+	t->hash = h;
+	t->name = strdup(name);
+	if (t->name == NULL) {
+		free(t);
+		return (NULL);
+	}
+	t->next = b->buckets[i];
+	b->buckets[i] = t;
+	b->nterms++;
+
+	return (t);
+}
+
+static bool
+grow_terms(struct search_builder *b)
+{
+	assert(b != NULL);
+
+	size_t n = (b->nbuckets == 0) ? 4096 : b->nbuckets * 2;
+	struct term **buckets = calloc(n, sizeof(struct term *));
+	if (buckets == NULL)
+		return (false);
+
+	for (size_t i = 0; i < b->nbuckets; i++) {
+		struct term *t = b->buckets[i];
+		while (t != NULL) {
+			struct term *next = t->next;
+			size_t k = t->hash & (n - 1);
+			t->next = buckets[k];
+			buckets[k] = t;
+			t = next;
+		}
+	}
+	free(b->buckets);
+	b->buckets = buckets;
+	b->nbuckets = n;
+
+	return (true);
+}
+
+/*
+ * Sorts the collected postings of t by document and replaces the absolute
+ * document numbers by deltas.
+ */
+static bool
+finish_postings(struct term *t)
+{
+	assert(t != NULL);
+
+	struct entry *entries = malloc((t->ndocs > 0 ? t->ndocs : 1) *
+	    sizeof(struct entry));
+	if (entries == NULL)
+		return (false);
+
+	const unsigned char *base = t->buf;
+	const unsigned char *p = base;
+	const unsigned char *end = base + t->len;
+	size_t n = 0;
+	while (p < end && n < t->ndocs) {
+		uint64_t npos;
+		const unsigned char *positions;
+		get_varint(&p, end, &entries[n].doc);
+		entries[n].start = p - base;
+		get_positions(&p, end, &npos, &positions);
+		entries[n].end = p - base;
+		n++;
+	}
+	qsort(entries, n, sizeof(struct entry), &compare_entries);
+
+	unsigned char *old = t->buf;
+	t->buf = NULL;
+	t->len = 0;
+	t->capacity = 0;
+	uint64_t previous = 0;
+	bool success = true;
+	for (size_t i = 0; success && i < n; i++) {
+		success = (put_varint(t, entries[i].doc - previous) &&
+		    put(t, old + entries[i].start,
+		    entries[i].end - entries[i].start));
+		previous = entries[i].doc;
+	}
+	free(old);
+	free(entries);
+
+	return (success);
+}
+
+static bool
+put(struct term *t, const void *data, size_t len)
+{
+	assert(t != NULL);
+	assert(data != NULL);
+
+	if (t->len + len > t->capacity) {
+		size_t c = (t->capacity == 0) ? 16 : t->capacity;
+		while (c < t->len + len)
+			c *= 2;
+		void *buf = realloc(t->buf, c);
+		if (buf == NULL)
+			return (false);
+		t->buf = buf;
+		t->capacity = c;
+	}
+	memcpy(t->buf + t->len, data, len);
+	t->len += len;
+
+	return (true);
+}
+
+static bool
+put_varint(struct term *t, uint64_t v)
+{
+	assert(t != NULL);
+
+	unsigned char buf[10];
+	size_t n = 0;
+	while (v >= 0x80) {
+		buf[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	buf[n++] = v;
+
+	return (put(t, buf, n));
+}
+
+static bool
+get_varint(const unsigned char **p, const unsigned char *end, uint64_t *v)
+{
+	assert(p != NULL && *p != NULL);
+	assert(end != NULL);
+	assert(v != NULL);
+
+	*v = 0;
+	for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+		unsigned char c = *(*p)++;
+		*v |= (uint64_t)(c & 0x7f) << shift;
+		if ((c & 0x80) == 0)
+			return (true);
+	}
+
+	return (false);
+}
+
+static size_t
+varint_size(uint64_t v)
+{
+	size_t n = 1;
+	for (; v >= 0x80; v >>= 7)
+		n++;
+
+	return (n);
+}
+
+/*
+ * Reads the number and length of the positions of a document and skips
+ * them.
+ */
+static bool
+get_positions(const unsigned char **p, const unsigned char *end,
+    uint64_t *npos, const unsigned char **positions)
+{
+	assert(p != NULL && *p != NULL);
+	assert(end != NULL);
+	assert(npos != NULL);
+	assert(positions != NULL);
+
+	uint64_t len;
+	if (!get_varint(p, end, npos) || !get_varint(p, end, &len) ||
+	    len > (uint64_t)(end - *p))
+		return (false);
+	*positions = *p;
+	*p += len;
+
+	return (true);
+}
+
+/*
+ * Splits the query into words like documents are. Words beyond MAXTERMS
+ * are ignored.
+ */
+static size_t
+parse_query(const char *query, struct queryterm *terms)
+{
+	assert(query != NULL);
+	assert(terms != NULL);
+
+	size_t n = 0;
+	int group = -1;
+	uint32_t offset = 0;
+	bool quoted = false;
+	bool newgroup = true;
+	char word[MAXTERM + 1];
+	size_t len = 0;
+	bool toolong = false;
+	for (const char *q = query;; q++) {
+		unsigned char c = *q;
+		if (c != '\0' && word_byte(c)) {
+			if (len < MAXTERM)
+				word[len++] = (c >= 'A' && c <= 'Z') ?
+				    c + 'a' - 'A' : c;
+			else
+				toolong = true;
+			continue;
+		}
+
+		if (len > 0 && !toolong && n < MAXTERMS) {
+			if (!quoted || newgroup) {
+				group++;
+				offset = 0;
+				newgroup = false;
+			}
+			memset(&terms[n], 0, sizeof(terms[n]));
+			memcpy(terms[n].name, word, len);
+			terms[n].name[len] = '\0';
+			terms[n].group = group;
+			terms[n].offset = offset++;
+			n++;
+		}
+		len = 0;
+		toolong = false;
+
+		if (c == '\0')
+			break;
+		if (c == '"') {
+			quoted = !quoted;
+			newgroup = true;
+		}
+	}
+
+	return (n);
+}
+
+static bool
+cursor_next(struct cursor *c)
+{
+	assert(c != NULL);
+
+	if (c->p >= c->end)
+		return (false);
+
+	uint64_t delta;
+	if (!get_varint(&c->p, c->end, &delta) ||
+	    !get_positions(&c->p, c->end, &c->npos, &c->positions))
+		return (false);
+	c->doc += delta;
+
+	return (true);
+}
+
+/*
+ * Decodes the positions of the current document of qt.
+ */
+static bool
+cursor_positions(struct queryterm *qt)
+{
+	assert(qt != NULL);
+
+	struct cursor *c = &qt->cursor;
+	if (c->npos > qt->poscapacity) {
+		void *pos = realloc(qt->pos, c->npos * sizeof(uint32_t));
+		if (pos == NULL)
+			return (false);
+		qt->pos = pos;
+		qt->poscapacity = c->npos;
+	}
+
+	const unsigned char *p = c->positions;
+	uint64_t position = 0;
+	for (uint64_t k = 0; k < c->npos; k++) {
+		uint64_t delta;
+		if (!get_varint(&p, c->p, &delta))
+			return (false);
+		position += delta;
+		qt->pos[k] = position;
+	}
+	qt->npos = c->npos;
+
+	return (true);
+}
+
+/*
+ * Checks that every phrase occurs in the current document. The positions
+ * of the first word of a phrase are narrowed down to those followed by each
+ * further word at its offset, merging the sorted lists of positions.
+ */
+static bool
+match_phrases(struct queryterm *terms, size_t nterms)
+{
+	assert(terms != NULL);
+
+	for (size_t first = 0; first < nterms; first++) {
+		if (first + 1 == nterms ||
+		    terms[first + 1].group != terms[first].group)
+			continue;
+		if (!cursor_positions(&terms[first]))
+			return (false);
+
+		uint32_t *candidates = terms[first].pos;
+		size_t n = terms[first].npos;
+		for (; first + 1 < nterms &&
+		    terms[first + 1].group == terms[first].group; first++) {
+			struct queryterm *qt = &terms[first + 1];
+			if (!cursor_positions(qt))
+				return (false);
+
+			size_t k = 0;
+			size_t j = 0;
+			size_t m = 0;
+			while (k < n && j < qt->npos) {
+				uint32_t want = candidates[k] + qt->offset;
+				if (qt->pos[j] < want)
+					j++;
+				else {
+					if (qt->pos[j] == want)
+						candidates[m++] = candidates[k];
+					k++;
+				}
+			}
+			n = m;
+		}
+		if (n == 0)
+			return (false);
+	}
+
+	return (true);
+}
+
+/*
+ * Keeps the MAXRESULTS results with the highest scores.
+ */
+static void
+add_result(struct result *results, size_t *nresults, uint64_t doc,
+    uint64_t score)
+{
+	assert(results != NULL);
+	assert(nresults != NULL);
+
+	if (*nresults < MAXRESULTS) {
+		results[*nresults].doc = doc;
+		results[*nresults].score = score;
+		(*nresults)++;
+		return;
+	}
+
+	size_t min = 0;
+	for (size_t i = 1; i < MAXRESULTS; i++)
+		if (results[i].score < results[min].score)
+			min = i;
+	if (score > results[min].score) {
+		results[min].doc = doc;
+		results[min].score = score;
+	}
+}
+
+static uint32_t
+hash(const char *s)
+{
+	assert(s != NULL);
+
+	uint32_t h = 2166136261u;
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char)*s;
+		h *= 16777619u;
+	}
+
+	return (h);
+}
+
+static int
+compare_terms(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	const struct term *ta = *(struct term * const *)a;
+	const struct term *tb = *(struct term * const *)b;
+
+	return (strcmp(ta->name, tb->name));
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	const struct entry *ea = a;
+	const struct entry *eb = b;
+
+	if (ea->doc != eb->doc)
+		return (ea->doc < eb->doc ? -1 : 1);
+	return (0);
+}
+
+/*
+ * Best results first, equal ones in the order of the documents.
+ */
+static int
+compare_results(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	const struct result *ra = a;
+	const struct result *rb = b;
+
+	if (ra->score != rb->score)
+		return (ra->score > rb->score ? -1 : 1);
+	if (ra->doc != rb->doc)
+		return (ra->doc < rb->doc ? -1 : 1);
+	return (0);
+}
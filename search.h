@@ -0,0 +1,35 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/*
+ * The selector of the search item. Components starting with a dot are
+ * rejected by the request validation, so it cannot hide a file.
+ */
+#define SEARCH_SELECTOR	"/.search"
+
+struct search_builder;
+
+void search_open(const char *_path);
+bool search_enabled(void);
+void search_query(const char *_query, FILE *_out, const char *_host,
+    const char *_port);
+
+struct search_builder *search_builder_new(const char *_old);
+bool search_builder_add(struct search_builder *_b, const char *_selector,
+    const char *_path, const struct stat *_s);
+bool search_builder_write(struct search_builder *_b, const char *_path);
+void search_builder_free(struct search_builder *_b);
+
+#endif /* !SEARCH_H */
@@ -7,6 +7,9 @@
 
 #define _POSIX_C_SOURCE 200809
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #include <assert.h>
 #include <errno.h>
 #include <limits.h>
@@ -14,8 +17,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
+#include "arena.h"
 #include "itemtypes.h"
+#include "metrics.h"
 #include "send.h"
 
 static void send_fake_item(FILE *out, char type, const char *info,
@@ -27,8 +33,61 @@ send_item(FILE *out, struct item *it)
 	assert(out != NULL);
 	assert(it != NULL);
 
-	fprintf(out, "%c%s\t%s\t%s\t%s\r\n", it->type, it->display,
-	    it->selector, it->host, it->port);
+	putc(it->type, out);
+	fputs(it->display, out);
+	putc('\t', out);
+	fputs(it->selector, out);
+	putc('\t', out);
+	fputs(it->host, out);
+	putc('\t', out);
+	fputs(it->port, out);
+	fputs("\r\n", out);
+}
+
+/*
+ * Every item the server generates itself ends in the same host and port.
+ * That tail is built once and then appended verbatim by send_local_item().
+ * NULL is returned if no memory is left.
+ */
+char *
+send_tail(struct arena *arena, const char *host, const char *port)
+{
+	assert(arena != NULL);
+	assert(host != NULL);
+	assert(port != NULL);
+
+	size_t hostlen = strlen(host);
+	size_t portlen = strlen(port);
+	char *tail = arena_alloc(arena, hostlen + portlen + 5);
+	if (tail == NULL)
+		return (NULL);
+
+	char *t = tail;
+	*t++ = '\t';
+	memcpy(t, host, hostlen);
+	t += hostlen;
+	*t++ = '\t';
+	memcpy(t, port, portlen);
+	t += portlen;
+	memcpy(t, "\r\n", 3);
+
+	return (tail);
+}
+
+void
+send_local_item(FILE *out, char type, const char *display,
+    const char *selector, const char *tail)
+{
+	assert(out != NULL);
+	assert(display != NULL);
+	assert(selector != NULL);
+	assert(tail != NULL);
+
+	putc(type, out);
+	fputs(display, out);
+	putc('\t', out);
+	fputs(selector, out);
+	fputs(tail, out);
 }
 
 void
@@ -37,6 +96,7 @@ send_error(FILE *out, const char *error, const char *detail)
 	assert(out != NULL);
 	assert(error != NULL);
 
+	metrics_error(error);
 	send_fake_item(out, IT_ERROR, error, detail);
 }
 
@@ -65,11 +125,13 @@ send_line(FILE *out, const char *line)
 	 *
 	 * Nonetheless every tested client (gopher, lynx, OverbiteFF) is not
 	 * stripping leading periods. That is the reason the following lines are
-	 * commented out. If you want a strict RFC compliant server, feel free
-	 * to uncomment these lines.
+	 * only compiled in if STRICT_RFC1436 is defined. Text files are sent
+	 * by transfer.c, which honours the same define.
 	 */
-	// if (*line == '.')
-	// 	fputc('.', out);
+#ifdef STRICT_RFC1436
+	if (*line == '.')
+		fputc('.', out);
+#endif
 
 	fprintf(out, "%s\r\n", line);
 }
@@ -82,23 +144,110 @@ send_eom(FILE *out)
 	fputs(".\r\n", out);
 }
 
+void
+send_iov_init(struct send_iov *v)
+{
+	assert(v != NULL);
+
+	v->used = 0;
+	v->first = 0;
+	v->sent = 0;
+}
+
+/*
+ * Appends a segment. False is returned if the list is full, in which case it
+ * has to be flushed first.
+ */
+bool
+send_iov_add(struct send_iov *v, const void *base, size_t len)
+{
+	assert(v != NULL);
+	assert(base != NULL || len == 0);
+
+	if (len == 0)
+		return (true);
+	if (v->used == SEND_IOVMAX)
+		return (false);
+
+	v->iov[v->used].iov_base = (void *)base;
+	v->iov[v->used].iov_len = len;
+	v->used++;
+
+	return (true);
+}
+
+bool
+send_iov_pending(const struct send_iov *v)
+{
+	assert(v != NULL);
+
+	return (v->first < v->used);
+}
+
+/*
+ * Writes the gathered segments to fd. A partial write leaves the list
+ * positioned at the first unsent byte, so on a non-blocking descriptor the
+ * flush is simply repeated once fd is writable again. SEND_DONE empties the
+ * list but keeps its count of sent bytes.
+ */
+enum send_status
+send_iov_flush(struct send_iov *v, int fd)
+{
+	assert(v != NULL);
+	assert(fd != -1);
+
+	while (v->first < v->used) {
+		ssize_t w = writev(fd, v->iov + v->first, v->used - v->first);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (SEND_AGAIN);
+			return (SEND_ERROR);
+		}
+		send_iov_advance(v, w);
+	}
+
+	v->used = 0;
+	v->first = 0;
+
+	return (SEND_DONE);
+}
+
+/*
+ * Positions the list behind the first n bytes, which have been written by
+ * other means than send_iov_flush().
+ */
+void
+send_iov_advance(struct send_iov *v, size_t n)
+{
+	assert(v != NULL);
+
+	metrics_count(METRICS_BYTES, n);
+	v->sent += n;
+
+	while (v->first < v->used && n >= v->iov[v->first].iov_len) {
+		n -= v->iov[v->first].iov_len;
+		v->first++;
+	}
+	if (n > 0) {
+		v->iov[v->first].iov_base =
+		    (char *)v->iov[v->first].iov_base + n;
+		v->iov[v->first].iov_len -= n;
+	}
+}
+
 static void
 send_fake_item(FILE *out, char type, const char *info, const char *detail)
 {
 	assert(out != NULL);
 	assert(info != NULL);
 
-	char *display = malloc(LINE_MAX);
-	if (display == NULL) {
-		/* Explicitely do not use gopherized messages to avoid
-		 * recursions. */
-		syslog(LOG_ERR, "malloc error: %m");
-		fprintf(stderr, "malloc: %s\n", strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-	if (detail == NULL)
+	char display[LINE_MAX];
+	if (detail == NULL) {
 		strncpy(display, info, LINE_MAX-1);
-	else
+		display[LINE_MAX-1] = '\0';
+	} else
 		snprintf(display, LINE_MAX, "%s: %s", info, detail);
 
 	char selector[sizeof(FAKESELECTOR)];
@@ -119,6 +268,4 @@ send_fake_item(FILE *out, char type, const char *info, const char *detail)
 	};
 
 	send_item(out, &it);
-
-	free(display);
 }
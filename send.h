@@ -8,12 +8,21 @@
 #ifndef SEND_H
 #define SEND_H
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 
+#include "arena.h"
+
 #define FAKEHOST	"fake"
 #define FAKEPORT	"1"
 #define FAKESELECTOR	"/"
 
+#define SEND_IOVMAX	64
+
 struct item {
 	char type;
 	char *display;
@@ -22,10 +31,36 @@ struct item {
 	char *port;
 };
 
+/*
+ * A list of memory segments gathered for a single writev(2). The segments are
+ * not copied and have to stay valid until they are flushed. sent counts the
+ * bytes written since the list was initialized.
+ */
+struct send_iov {
+	struct iovec iov[SEND_IOVMAX];
+	int used;
+	int first;
+	size_t sent;
+};
+
+enum send_status {
+	SEND_DONE,
+	SEND_AGAIN,
+	SEND_ERROR
+};
+
 void send_item(FILE *_out, struct item *_it);
+char *send_tail(struct arena *_arena, const char *_host, const char *_port);
+void send_local_item(FILE *_out, char _type, const char *_display,
+    const char *_selector, const char *_tail);
 void send_error(FILE *_out, const char *_error, const char *_detail);
 void send_info(FILE *_out, const char *_info, const char *_detail);
 void send_line(FILE *_out, const char *_line);
 void send_eom(FILE *_out);
+void send_iov_init(struct send_iov *_v);
+bool send_iov_add(struct send_iov *_v, const void *_base, size_t _len);
+bool send_iov_pending(const struct send_iov *_v);
+enum send_status send_iov_flush(struct send_iov *_v, int _fd);
+void send_iov_advance(struct send_iov *_v, size_t _n);
 
 #endif /* !SEND_H */
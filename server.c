@@ -0,0 +1,1300 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+#ifdef __linux__
+#define _GNU_SOURCE	/* sched_setaffinity(2) */
+#endif
+
+#include <sys/types.h>
+#ifdef __FreeBSD__
+#include <sys/param.h>
+#include <sys/cpuset.h>
+#endif
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <netinet/in.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "accesslog.h"
+#include "arena.h"
+#include "filecache.h"
+#include "itemtypes.h"
+#include "menucache.h"
+#include "metrics.h"
+#include "options.h"
+#include "ratelimit.h"
+#include "request.h"
+#include "send.h"
+#include "server.h"
+#include "timer.h"
+#include "transfer.h"
+#include "uring.h"
+#include "watch.h"
+
+#define LISTENBACKLOG	128
+#define MAXEVENTS	64
+#define MAXLISTENERS	8
+#define RESPAWNDELAY	1
+#define RINGENTRIES	256
+#define ACCEPTDEPTH	16
+#define NBLOCKS		64
+#define BLOCKSIZE	(64 * 1024)
+#define RATEWINDOW	10000	/* milliseconds */
+#define ACCEPTDELAY	100	/* milliseconds */
+#define ACCEPTLOG	1000	/* milliseconds */
+
+enum conn_state {
+	CONN_LISTEN,
+	CONN_PAUSED,
+	CONN_ACCEPT,
+	CONN_WATCH,
+	CONN_READ,
+	CONN_WRITE,
+	CONN_FILL,
+	CONN_TICK
+};
+
+struct conn {
+	enum conn_state state;
+	int fd;
+	char request[LINE_MAX];
+	size_t reqlen;
+	char *buf;
+	size_t buflen;
+	struct send_iov out;
+	struct cachedfile *cached;
+	bool body;
+	struct transfer transfer;
+	struct timespec start;
+	struct sockaddr_storage peer;
+	socklen_t peerlen;
+	char type;
+	enum accesslog_status result;
+	enum accesslog_status status;
+	bool admitted;
+	struct timer timer;
+	int64_t since;
+	int64_t progress;
+	uint64_t windowsent;
+	char *block;		/* io_uring only */
+	int blockindex;
+	size_t blocklen;
+	size_t blockoff;
+};
+
+static volatile sig_atomic_t quit;
+static struct uring *ring;
+static struct timer_wheel wheel;
+static int64_t now;
+static int64_t firstbyte;
+static int64_t requesttimeout;
+static int64_t idletimeout;
+static uint64_t minrate;
+static int64_t acceptlogged = INT64_MIN;
+
+static void handle_signal(int sig);
+static pid_t spawn_worker(struct opt_options *options, int slot);
+static void run_worker(struct opt_options *options);
+static void run_epoll(struct opt_options *options, struct arena *arena,
+    int watchfd);
+static bool run_uring(struct opt_options *options, struct arena *arena,
+    int watchfd);
+static void pin_worker(int slot);
+static int open_listeners(struct opt_options *options, int ep,
+    struct conn *listeners);
+static void accept_conns(int ep, struct conn *listener);
+static void pause_accept(int ep, struct conn *listener);
+static void resume_accept(int ep, struct conn *listener);
+static void read_request(struct opt_options *options, struct arena *arena,
+    int ep, struct conn *conn);
+static bool request_received(struct conn *conn, size_t r);
+static bool prepare_response(struct opt_options *options,
+    struct arena *arena, struct conn *conn);
+static void write_response(struct conn *conn);
+static void submit_accept(int listener);
+static void accept_completed(struct conn *conn, int res);
+static void recv_completed(struct opt_options *options, struct arena *arena,
+    struct conn *conn, int res);
+static void write_completed(struct conn *conn, int res);
+static void fill_completed(struct conn *conn, int res);
+static void submit_next(struct conn *conn);
+static void admit_conn(struct conn *conn);
+static void start_deadlines(struct conn *conn);
+static void run_timers(int ep);
+static void check_deadlines(struct conn *conn);
+static void expire_conn(struct conn *conn, enum metrics_counter deadline);
+static uint64_t conn_sent(const struct conn *conn);
+static void close_conn(struct conn *conn);
+static bool set_nonblock(int fd);
+static int64_t now_ms(void);
+
+/*
+ * The master process pre-forks the workers, every one of them with its own
+ * SO_REUSEPORT listening sockets, and respawns workers that terminate until
+ * it is told to shut down.
+ */
+void
+server_run(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = &handle_signal;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+
+	long nworkers = opt_get_workers(options);
+	if (nworkers == 0)
+		nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers < 1)
+		nworkers = 1;
+
+	if (opt_get_metrics(options))
+		metrics_init(nworkers);
+
+	/* Fail early if the port is not available at all. */
+	struct conn probe[MAXLISTENERS];
+	int nprobe = open_listeners(options, -1, probe);
+	if (nprobe == 0) {
+		fprintf(stderr, "could not listen on port %s\n",
+		    opt_get_port(options));
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < nprobe; i++)
+		close(probe[i].fd);
+
+	pid_t *workers = calloc(nworkers, sizeof(pid_t));
+	time_t *started = calloc(nworkers, sizeof(time_t));
+	if (workers == NULL || started == NULL) {
+		syslog(LOG_ERR, "calloc error: %m");
+		fprintf(stderr, "calloc workers: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	for (long i = 0; i < nworkers; i++)
+		workers[i] = -1;
+	syslog(LOG_NOTICE, "listening on port %s with %ld workers",
+	    opt_get_port(options), nworkers);
+
+	while (!quit) {
+		/*
+		 * Empty slots are filled on every pass, and while a fork keeps
+		 * failing it is retried every RESPAWNDELAY seconds.
+		 */
+		bool missing = false;
+		for (long i = 0; i < nworkers; i++) {
+			if (workers[i] != -1)
+				continue;
+			workers[i] = spawn_worker(options, i);
+			started[i] = time(NULL);
+			if (workers[i] == -1) {
+				syslog(LOG_ERR, "could not start worker %ld, "
+				    "retrying", i);
+				missing = true;
+			}
+		}
+
+		int status;
+		pid_t pid = waitpid(-1, &status, missing ? WNOHANG : 0);
+		if (pid == 0 || (pid == -1 && errno == ECHILD && missing)) {
+			sleep(RESPAWNDELAY);
+			continue;
+		}
+		if (pid == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "waitpid error: %m");
+			break;
+		}
+
+		long slot;
+		for (slot = 0; slot < nworkers; slot++)
+			if (workers[slot] == pid)
+				break;
+		if (slot == nworkers)
+			continue;
+
+		if (WIFSIGNALED(status))
+			syslog(LOG_ERR, "worker %ld (pid %ld) killed by signal "
+			    "%d", slot, (long)pid, WTERMSIG(status));
+		else
+			syslog(LOG_ERR, "worker %ld (pid %ld) exited with "
+			    "status %d", slot, (long)pid, WEXITSTATUS(status));
+		workers[slot] = -1;
+
+		/* Do not spin if a worker dies right after its start. */
+		if (time(NULL) - started[slot] < RESPAWNDELAY)
+			sleep(RESPAWNDELAY);
+	}
+
+	syslog(LOG_NOTICE, "shutting down");
+
+	for (long i = 0; i < nworkers; i++)
+		if (workers[i] > 0)
+			kill(workers[i], SIGTERM);
+	for (long i = 0; i < nworkers; i++)
+		if (workers[i] > 0)
+			while (waitpid(workers[i], NULL, 0) == -1 &&
+			    errno == EINTR)
+				;
+
+	free(started);
+	free(workers);
+}
+
+static pid_t
+spawn_worker(struct opt_options *options, int slot)
+{
+	assert(options != NULL);
+
+	pid_t pid = fork();
+	if (pid == -1) {
+		syslog(LOG_ERR, "fork error: %m");
+		return (-1);
+	}
+	if (pid > 0)
+		return (pid);
+
+	if (opt_get_affinity(options))
+		pin_worker(slot);
+	metrics_attach(slot);
+
+	run_worker(options);
+
+	exit(EXIT_SUCCESS);
+}
+
+static void
+run_worker(struct opt_options *options)
+{
+	assert(options != NULL);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGPIPE, &sa, NULL);
+
+	accesslog_start();
+
+	firstbyte = opt_get_firstbyte(options) * 1000;
+	requesttimeout = opt_get_requesttimeout(options) * 1000;
+	idletimeout = opt_get_idletimeout(options) * 1000;
+	minrate = opt_get_minrate(options);
+	now = now_ms();
+	timer_init(&wheel, now);
+
+	struct arena *arena = arena_new();
+	if (arena == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	int watchfd = -1;
+	if (menucache_enabled() || filecache_enabled())
+		watchfd = watch_init(opt_get_root(options));
+
+	if (!opt_get_uring(options) || !run_uring(options, arena, watchfd))
+		run_epoll(options, arena, watchfd);
+
+	arena_free(arena);
+	accesslog_close();
+}
+
+static void
+run_epoll(struct opt_options *options, struct arena *arena, int watchfd)
+{
+	assert(options != NULL);
+	assert(arena != NULL);
+
+	int ep = epoll_create1(0);
+	if (ep == -1) {
+		syslog(LOG_ERR, "epoll_create1 error: %m");
+		exit(EXIT_FAILURE);
+	}
+
+	struct conn listeners[MAXLISTENERS];
+	int nlisteners = open_listeners(options, ep, listeners);
+	if (nlisteners == 0) {
+		syslog(LOG_ERR, "could not listen on port %s",
+		    opt_get_port(options));
+		exit(EXIT_FAILURE);
+	}
+
+	struct conn watcher = {
+		.state = CONN_WATCH,
+		.fd = watchfd
+	};
+	if (watcher.fd != -1) {
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = &watcher
+		};
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, watcher.fd, &ev) == -1)
+			syslog(LOG_ERR, "epoll_ctl error: %m");
+	}
+
+	struct epoll_event events[MAXEVENTS];
+	while (!quit) {
+		int n = epoll_wait(ep, events, MAXEVENTS,
+		    wheel.pending > 0 ? TIMER_TICK : -1);
+		now = now_ms();
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "epoll_wait error: %m");
+			exit(EXIT_FAILURE);
+		}
+
+		for (int i = 0; i < n; i++) {
+			struct conn *conn = events[i].data.ptr;
+
+			switch (conn->state) {
+			case CONN_LISTEN:
+				accept_conns(ep, conn);
+				break;
+			case CONN_WATCH:
+				watch_process();
+				break;
+			case CONN_READ:
+				read_request(options, arena, ep, conn);
+				break;
+			case CONN_WRITE:
+				write_response(conn);
+				break;
+			default:
+				break;
+			}
+		}
+
+		run_timers(ep);
+	}
+
+	for (int i = 0; i < nlisteners; i++)
+		close(listeners[i].fd);
+	close(ep);
+}
+
+/*
+ * Serves the connections through io_uring(7) instead. Accepts, reads of the
+ * selector, reads of the served files and writes to the clients are queued
+ * as operations on a ring and every completion queues the next step of its
+ * connection, so a single system call submits the operations of all
+ * connections and collects their results. Files are moved in blocks
+ * registered with the ring. False is returned if the ring cannot be set up.
+ */
+static bool
+run_uring(struct opt_options *options, struct arena *arena, int watchfd)
+{
+	assert(options != NULL);
+	assert(arena != NULL);
+
+	ring = uring_new(RINGENTRIES, NBLOCKS, BLOCKSIZE);
+	if (ring == NULL) {
+		syslog(LOG_NOTICE, "io_uring setup error: %m, using epoll");
+		return (false);
+	}
+
+	struct conn listeners[MAXLISTENERS];
+	int nlisteners = open_listeners(options, -1, listeners);
+	if (nlisteners == 0) {
+		syslog(LOG_ERR, "could not listen on port %s",
+		    opt_get_port(options));
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Non-blocking descriptors would fail with EAGAIN instead of being
+	 * waited for by the ring. Accepted sockets are blocking, too.
+	 */
+	for (int i = 0; i < nlisteners; i++) {
+		int flags = fcntl(listeners[i].fd, F_GETFL);
+		if (flags != -1)
+			fcntl(listeners[i].fd, F_SETFL, flags & ~O_NONBLOCK);
+		for (int j = 0; j < ACCEPTDEPTH; j++)
+			submit_accept(listeners[i].fd);
+	}
+
+	struct conn watcher = {
+		.state = CONN_WATCH,
+		.fd = watchfd
+	};
+	if (watcher.fd != -1)
+		uring_poll(ring, watcher.fd, &watcher);
+
+	/* The timer wheel is advanced by a timeout while it is in use. */
+	struct conn ticker = {
+		.state = CONN_TICK,
+		.fd = -1
+	};
+	bool ticking = false;
+
+	while (!quit) {
+		if (!ticking && wheel.pending > 0) {
+			uring_timeout(ring, TIMER_TICK, &ticker);
+			ticking = true;
+		}
+
+		bool submitted = uring_submit(ring);
+		now = now_ms();
+		if (!submitted) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EBUSY && errno != EAGAIN) {
+				syslog(LOG_ERR, "io_uring_enter error: %m");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		void *data;
+		int res;
+		while (uring_complete(ring, &data, &res)) {
+			struct conn *conn = data;
+
+			switch (conn->state) {
+			case CONN_ACCEPT:
+				accept_completed(conn, res);
+				break;
+			case CONN_WATCH:
+				watch_process();
+				uring_poll(ring, conn->fd, conn);
+				break;
+			case CONN_READ:
+				recv_completed(options, arena, conn, res);
+				break;
+			case CONN_WRITE:
+				write_completed(conn, res);
+				break;
+			case CONN_FILL:
+				fill_completed(conn, res);
+				break;
+			case CONN_TICK:
+				ticking = false;
+				break;
+			default:
+				break;
+			}
+		}
+
+		run_timers(-1);
+	}
+
+	for (int i = 0; i < nlisteners; i++)
+		close(listeners[i].fd);
+	uring_free(ring);
+	ring = NULL;
+
+	return (true);
+}
+
+static void
+pin_worker(int slot)
+{
+#if defined(__linux__)
+	cpu_set_t available;
+	if (sched_getaffinity(0, sizeof(available), &available) == -1) {
+		syslog(LOG_ERR, "sched_getaffinity error: %m");
+		return;
+	}
+
+	int ncpus = CPU_COUNT(&available);
+	int nth = slot % ncpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &available) || nth-- > 0)
+			continue;
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set) == -1)
+			syslog(LOG_ERR, "sched_setaffinity error: %m");
+		return;
+	}
+#elif defined(__FreeBSD__)
+	cpuset_t available;
+	if (cpuset_getaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+	    sizeof(available), &available) == -1) {
+		syslog(LOG_ERR, "cpuset_getaffinity error: %m");
+		return;
+	}
+
+	int ncpus = CPU_COUNT(&available);
+	int nth = slot % ncpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (!CPU_ISSET(cpu, &available) || nth-- > 0)
+			continue;
+
+		cpuset_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (cpuset_setaffinity(CPU_LEVEL_WHICH, CPU_WHICH_PID, -1,
+		    sizeof(set), &set) == -1)
+			syslog(LOG_ERR, "cpuset_setaffinity error: %m");
+		return;
+	}
+#else
+	(void)slot;
+	syslog(LOG_NOTICE, "CPU affinity is not supported on this platform");
+#endif
+}
+
+static void
+handle_signal(int sig)
+{
+	(void)sig;
+
+	quit = 1;
+}
+
+static int
+open_listeners(struct opt_options *options, int ep, struct conn *listeners)
+{
+	assert(options != NULL);
+	assert(listeners != NULL);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+
+	struct addrinfo *res;
+	int ret = getaddrinfo(NULL, opt_get_port(options), &hints, &res);
+	if (ret != 0) {
+		syslog(LOG_ERR, "getaddrinfo error: %s", gai_strerror(ret));
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(ret));
+		exit(EXIT_FAILURE);
+	}
+
+	int n = 0;
+	for (struct addrinfo *ai = res; ai != NULL && n < MAXLISTENERS;
+	    ai = ai->ai_next) {
+		int fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol);
+		if (fd == -1) {
+			syslog(LOG_ERR, "socket error: %m");
+			continue;
+		}
+
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on,
+		    sizeof(on)) == -1)
+			syslog(LOG_ERR, "setsockopt SO_REUSEPORT error: %m");
+		if (ai->ai_family == AF_INET6)
+			setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on,
+			    sizeof(on));
+
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+		    listen(fd, LISTENBACKLOG) == -1 || !set_nonblock(fd)) {
+			syslog(LOG_ERR, "bind/listen error: %m");
+			close(fd);
+			continue;
+		}
+
+		memset(&listeners[n], 0, sizeof(listeners[n]));
+		listeners[n].state = CONN_LISTEN;
+		listeners[n].fd = fd;
+		listeners[n].timer.data = &listeners[n];
+
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = &listeners[n]
+		};
+		if (ep != -1 && epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			syslog(LOG_ERR, "epoll_ctl error: %m");
+			close(fd);
+			continue;
+		}
+
+		n++;
+	}
+
+	freeaddrinfo(res);
+
+	return (n);
+}
+
+static void
+accept_conns(int ep, struct conn *listener)
+{
+	assert(listener != NULL);
+
+	for (;;) {
+		struct sockaddr_storage peer;
+		socklen_t peerlen = sizeof(peer);
+		int fd = accept(listener->fd, (struct sockaddr *)&peer,
+		    &peerlen);
+		if (fd == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				pause_accept(ep, listener);
+			return;
+		}
+
+		if (!set_nonblock(fd)) {
+			syslog(LOG_ERR, "fcntl error: %m");
+			close(fd);
+			continue;
+		}
+
+		struct conn *conn = calloc(1, sizeof(struct conn));
+		if (conn == NULL) {
+			syslog(LOG_ERR, "calloc error: %m");
+			close(fd);
+			continue;
+		}
+		conn->state = CONN_READ;
+		conn->fd = fd;
+		conn->peer = peer;
+		conn->peerlen = peerlen;
+		conn->status = ACCESSLOG_ABORTED;
+		clock_gettime(CLOCK_MONOTONIC, &conn->start);
+		metrics_count(METRICS_CONNECTIONS, 1);
+		admit_conn(conn);
+		start_deadlines(conn);
+
+		struct epoll_event ev = {
+			.events = EPOLLIN,
+			.data.ptr = conn
+		};
+		if (epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			syslog(LOG_ERR, "epoll_ctl error: %m");
+			close_conn(conn);
+		}
+	}
+}
+
+/*
+ * Stops accepting on listener for a while after accept failed, typically for
+ * lack of descriptors. The listener would otherwise be reported ready at once
+ * and fail again and again. The error is logged at most every ACCEPTLOG
+ * milliseconds. With io_uring, listener is the connection whose accept
+ * failed, and it is queued again later.
+ */
+static void
+pause_accept(int ep, struct conn *listener)
+{
+	assert(listener != NULL);
+
+	if (now >= acceptlogged + ACCEPTLOG) {
+		syslog(LOG_ERR, "accept error: %m");
+		acceptlogged = now;
+	}
+
+	if (ring == NULL &&
+	    epoll_ctl(ep, EPOLL_CTL_DEL, listener->fd, NULL) == -1)
+		syslog(LOG_ERR, "epoll_ctl error: %m");
+	listener->state = CONN_PAUSED;
+	timer_set(&wheel, &listener->timer, now + ACCEPTDELAY);
+}
+
+static void
+resume_accept(int ep, struct conn *listener)
+{
+	assert(listener != NULL);
+
+	if (ring != NULL) {
+		listener->state = CONN_ACCEPT;
+		listener->peerlen = sizeof(listener->peer);
+		uring_accept(ring, listener->fd,
+		    (struct sockaddr *)&listener->peer, &listener->peerlen,
+		    listener);
+		return;
+	}
+
+	listener->state = CONN_LISTEN;
+
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.ptr = listener
+	};
+	if (epoll_ctl(ep, EPOLL_CTL_ADD, listener->fd, &ev) == -1)
+		syslog(LOG_ERR, "epoll_ctl error: %m");
+}
+
+static void
+read_request(struct opt_options *options, struct arena *arena, int ep,
+    struct conn *conn)
+{
+	assert(options != NULL);
+	assert(arena != NULL);
+	assert(conn != NULL);
+
+	bool complete = false;
+	while (!complete) {
+		size_t room = sizeof(conn->request) - 1 - conn->reqlen;
+		ssize_t r = read(conn->fd, conn->request + conn->reqlen, room);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			close_conn(conn);
+			return;
+		}
+		complete = request_received(conn, r);
+	}
+	conn->request[conn->reqlen] = '\0';
+
+	if (!prepare_response(options, arena, conn)) {
+		close_conn(conn);
+		return;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLOUT,
+		.data.ptr = conn
+	};
+	if (epoll_ctl(ep, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+		syslog(LOG_ERR, "epoll_ctl error: %m");
+		close_conn(conn);
+		return;
+	}
+
+	write_response(conn);
+}
+
+/*
+ * Accounts for r bytes read into the request buffer. The selector is
+ * collected incrementally and is complete as soon as a LF arrives, the peer
+ * stops sending or the buffer is full. The latter mimics the behaviour of
+ * fgets(3) in inetd mode.
+ */
+static bool
+request_received(struct conn *conn, size_t r)
+{
+	assert(conn != NULL);
+
+	char *lf = memchr(conn->request + conn->reqlen, '\n', r);
+	conn->reqlen += r;
+	if (lf != NULL)
+		conn->reqlen = lf - conn->request + 1;
+
+	return (r == 0 || lf != NULL ||
+	    conn->reqlen == sizeof(conn->request) - 1);
+}
+
+/*
+ * Handles the complete request of conn and sets up its response. False is
+ * returned if the connection has to be closed.
+ */
+static bool
+prepare_response(struct opt_options *options, struct arena *arena,
+    struct conn *conn)
+{
+	assert(options != NULL);
+	assert(arena != NULL);
+	assert(conn != NULL);
+
+	send_iov_init(&conn->out);
+	conn->since = now;
+	conn->progress = now;
+	conn->windowsent = 0;
+
+	/* A limited client costs no more than its prepared answer. */
+	if (!conn->admitted) {
+		size_t len;
+		const char *data = ratelimit_response(&len);
+		send_iov_add(&conn->out, data, len);
+		conn->type = IT_ERROR;
+		conn->result = ACCESSLOG_ERROR;
+		conn->state = CONN_WRITE;
+		metrics_count(METRICS_RATELIMITED, 1);
+		check_deadlines(conn);
+		return (true);
+	}
+
+	FILE *out = open_memstream(&conn->buf, &conn->buflen);
+	if (out == NULL) {
+		syslog(LOG_ERR, "open_memstream error: %m");
+		return (false);
+	}
+
+	struct response response = {
+		.out = out,
+		.peer = (struct sockaddr *)&conn->peer,
+		.peerlen = conn->peerlen,
+		.fd = -1,
+		.text = false,
+		.cached = NULL,
+		.data = NULL
+	};
+	if (request_handle(options, arena, conn->request, &response))
+		conn->result = ACCESSLOG_OK;
+	else
+		conn->result = ACCESSLOG_ERROR;
+	conn->type = response.type;
+
+	if (fclose(out) == EOF) {
+		syslog(LOG_ERR, "fclose error: %m");
+		if (response.fd != -1)
+			close(response.fd);
+		return (false);
+	}
+
+	conn->state = CONN_WRITE;
+	send_iov_add(&conn->out, conn->buf, conn->buflen);
+	if (response.cached != NULL) {
+		size_t len;
+		const char *data = filecache_data(response.cached, &len);
+		conn->cached = response.cached;
+		send_iov_add(&conn->out, data, len);
+	}
+	if (response.data != NULL)
+		send_iov_add(&conn->out, response.data, response.datalen);
+	if (response.fd != -1) {
+		conn->body = true;
+		if (!transfer_init(&conn->transfer, response.fd, conn->fd,
+		    response.text))
+			return (false);
+	}
+
+	/* Without read deadlines, no timer may be pending yet. */
+	check_deadlines(conn);
+
+	return (true);
+}
+
+static void
+write_response(struct conn *conn)
+{
+	assert(conn != NULL);
+
+	uint64_t sent = conn_sent(conn);
+	switch (send_iov_flush(&conn->out, conn->fd)) {
+	case SEND_AGAIN:
+		if (conn_sent(conn) != sent)
+			conn->progress = now;
+		return;
+	case SEND_ERROR:
+		syslog(LOG_DEBUG, "writev error: %m");
+		close_conn(conn);
+		return;
+	case SEND_DONE:
+		break;
+	}
+
+	if (conn->body) {
+		switch (transfer_run(&conn->transfer, conn->fd)) {
+		case TRANSFER_AGAIN:
+			if (conn_sent(conn) != sent)
+				conn->progress = now;
+			return;
+		case TRANSFER_ERROR:
+			syslog(LOG_DEBUG, "transfer error: %m");
+			close_conn(conn);
+			return;
+		case TRANSFER_DONE:
+			break;
+		}
+	}
+
+	conn->status = conn->result;
+	close_conn(conn);
+}
+
+/*
+ * Queues an accept on listener into a fresh connection.
+ */
+static void
+submit_accept(int listener)
+{
+	struct conn *conn = calloc(1, sizeof(struct conn));
+	if (conn == NULL) {
+		syslog(LOG_ERR, "calloc error: %m");
+		return;
+	}
+	conn->state = CONN_ACCEPT;
+	conn->fd = listener;
+	conn->peerlen = sizeof(conn->peer);
+	conn->timer.data = conn;
+
+	uring_accept(ring, conn->fd, (struct sockaddr *)&conn->peer,
+	    &conn->peerlen, conn);
+}
+
+static void
+accept_completed(struct conn *conn, int res)
+{
+	assert(conn != NULL);
+
+	if (res < 0) {
+		errno = -res;
+		if (errno == EINTR || errno == ECONNABORTED) {
+			conn->peerlen = sizeof(conn->peer);
+			uring_accept(ring, conn->fd,
+			    (struct sockaddr *)&conn->peer, &conn->peerlen,
+			    conn);
+		} else
+			pause_accept(-1, conn);
+		return;
+	}
+
+	submit_accept(conn->fd);
+
+	conn->state = CONN_READ;
+	conn->fd = res;
+	conn->status = ACCESSLOG_ABORTED;
+	clock_gettime(CLOCK_MONOTONIC, &conn->start);
+	metrics_count(METRICS_CONNECTIONS, 1);
+	admit_conn(conn);
+	start_deadlines(conn);
+
+	uring_recv(ring, conn->fd, conn->request, sizeof(conn->request) - 1,
+	    conn);
+}
+
+static void
+recv_completed(struct opt_options *options, struct arena *arena,
+    struct conn *conn, int res)
+{
+	assert(options != NULL);
+	assert(arena != NULL);
+	assert(conn != NULL);
+
+	if (res < 0 || conn->status == ACCESSLOG_TIMEOUT) {
+		close_conn(conn);
+		return;
+	}
+
+	if (!request_received(conn, res)) {
+		size_t room = sizeof(conn->request) - 1 - conn->reqlen;
+		uring_recv(ring, conn->fd, conn->request + conn->reqlen, room,
+		    conn);
+		return;
+	}
+	conn->request[conn->reqlen] = '\0';
+
+	if (!prepare_response(options, arena, conn)) {
+		close_conn(conn);
+		return;
+	}
+
+	submit_next(conn);
+}
+
+static void
+write_completed(struct conn *conn, int res)
+{
+	assert(conn != NULL);
+
+	if (conn->status == ACCESSLOG_TIMEOUT) {
+		close_conn(conn);
+		return;
+	}
+	if (res < 0) {
+		errno = -res;
+		syslog(LOG_DEBUG, "write error: %m");
+		close_conn(conn);
+		return;
+	}
+
+	conn->progress = now;
+	if (send_iov_pending(&conn->out))
+		send_iov_advance(&conn->out, res);
+	else {
+		conn->blockoff += res;
+		conn->transfer.sent += res;
+		metrics_count(METRICS_BYTES, res);
+	}
+
+	submit_next(conn);
+}
+
+static void
+fill_completed(struct conn *conn, int res)
+{
+	assert(conn != NULL);
+
+	if (conn->status == ACCESSLOG_TIMEOUT) {
+		close_conn(conn);
+		return;
+	}
+	if (res < 0) {
+		errno = -res;
+		syslog(LOG_DEBUG, "read error: %m");
+		close_conn(conn);
+		return;
+	}
+
+	conn->transfer.offset += res;
+	conn->blocklen = res;
+	conn->blockoff = 0;
+	if (res == 0)	/* the file shrank */
+		conn->transfer.size = conn->transfer.offset;
+
+	submit_next(conn);
+}
+
+/*
+ * Queues the next step of the response: the gathered segments first, then
+ * the file block by block. Text files are converted synchronously into the
+ * block, other files are read into it by the ring.
+ */
+static void
+submit_next(struct conn *conn)
+{
+	assert(conn != NULL);
+
+	if (send_iov_pending(&conn->out)) {
+		conn->state = CONN_WRITE;
+		uring_writev(ring, conn->fd, conn->out.iov + conn->out.first,
+		    conn->out.used - conn->out.first, conn);
+		return;
+	}
+
+	struct transfer *t = &conn->transfer;
+	if (conn->body) {
+		if (conn->block == NULL) {
+			conn->block = uring_block(ring, &conn->blockindex);
+			if (conn->block == NULL) {
+				syslog(LOG_ERR, "malloc error: %m");
+				close_conn(conn);
+				return;
+			}
+		}
+
+		if (conn->blockoff == conn->blocklen &&
+		    t->method == TRANSFER_TEXT) {
+			conn->blockoff = 0;
+			if (!transfer_convert(t, conn->block, BLOCKSIZE,
+			    &conn->blocklen)) {
+				syslog(LOG_DEBUG, "transfer error: %m");
+				close_conn(conn);
+				return;
+			}
+		} else if (conn->blockoff == conn->blocklen &&
+		    t->offset < t->size) {
+			size_t count = BLOCKSIZE;
+			if (t->size - t->offset < (off_t)count)
+				count = t->size - t->offset;
+			conn->state = CONN_FILL;
+			uring_read(ring, t->in, conn->block, count, t->offset,
+			    conn->blockindex, conn);
+			return;
+		}
+
+		if (conn->blockoff < conn->blocklen) {
+			conn->state = CONN_WRITE;
+			uring_write(ring, conn->fd,
+			    conn->block + conn->blockoff,
+			    conn->blocklen - conn->blockoff, conn->blockindex,
+			    conn);
+			return;
+		}
+	}
+
+	conn->status = conn->result;
+	close_conn(conn);
+}
+
+/*
+ * Checks a new connection against the rate limits. A connection that is
+ * not admitted is still read from, but only gets the error message of
+ * ratelimit_response() in return.
+ */
+static void
+admit_conn(struct conn *conn)
+{
+	assert(conn != NULL);
+
+	conn->admitted = ratelimit_admit((struct sockaddr *)&conn->peer);
+}
+
+/*
+ * Starts the deadlines of a new connection: the first byte of the request
+ * and the complete request have to arrive in time. Once the response is
+ * being sent, it must not stall and may have to keep a minimum rate.
+ */
+static void
+start_deadlines(struct conn *conn)
+{
+	assert(conn != NULL);
+
+	conn->timer.data = conn;
+	conn->since = now;
+	check_deadlines(conn);
+}
+
+static void
+run_timers(int ep)
+{
+	struct timer *t = timer_expire(&wheel, now);
+	while (t != NULL) {
+		struct timer *next = t->next;
+		struct conn *conn = t->data;
+		if (conn->state == CONN_PAUSED)
+			resume_accept(ep, conn);
+		else
+			check_deadlines(conn);
+		t = next;
+	}
+}
+
+/*
+ * Expires conn if it missed a deadline and otherwise sets its timer to the
+ * next one. The timer is not moved as the connection makes progress; it
+ * rather finds out when it expires whether the deadline has moved on.
+ */
+static void
+check_deadlines(struct conn *conn)
+{
+	assert(conn != NULL);
+
+	int64_t next = INT64_MAX;
+	if (conn->state == CONN_READ) {
+		if (conn->reqlen == 0 && firstbyte > 0) {
+			if (now >= conn->since + firstbyte) {
+				expire_conn(conn, METRICS_TIMEOUT_FIRSTBYTE);
+				return;
+			}
+			next = conn->since + firstbyte;
+		}
+		if (requesttimeout > 0) {
+			if (now >= conn->since + requesttimeout) {
+				expire_conn(conn, METRICS_TIMEOUT_REQUEST);
+				return;
+			}
+			if (conn->since + requesttimeout < next)
+				next = conn->since + requesttimeout;
+		}
+	} else {
+		if (idletimeout > 0) {
+			if (now >= conn->progress + idletimeout) {
+				expire_conn(conn, METRICS_TIMEOUT_IDLE);
+				return;
+			}
+			next = conn->progress + idletimeout;
+		}
+		if (minrate > 0) {
+			if (now >= conn->since + RATEWINDOW) {
+				uint64_t sent = conn_sent(conn);
+				if (sent - conn->windowsent <
+				    minrate * RATEWINDOW / 1000) {
+					expire_conn(conn,
+					    METRICS_TIMEOUT_THROUGHPUT);
+					return;
+				}
+				conn->since = now;
+				conn->windowsent = sent;
+			}
+			if (conn->since + RATEWINDOW < next)
+				next = conn->since + RATEWINDOW;
+		}
+	}
+
+	if (next != INT64_MAX)
+		timer_set(&wheel, &conn->timer, next);
+}
+
+/*
+ * With io_uring an operation of conn is still in flight. Shutting the socket
+ * down makes it complete right away, and its completion closes conn.
+ */
+static void
+expire_conn(struct conn *conn, enum metrics_counter deadline)
+{
+	assert(conn != NULL);
+
+	metrics_count(deadline, 1);
+	conn->status = ACCESSLOG_TIMEOUT;
+
+	if (ring != NULL)
+		shutdown(conn->fd, SHUT_RDWR);
+	else
+		close_conn(conn);
+}
+
+static uint64_t
+conn_sent(const struct conn *conn)
+{
+	assert(conn != NULL);
+
+	uint64_t sent = conn->out.sent;
+	if (conn->body)
+		sent += conn->transfer.sent;
+
+	return (sent);
+}
+
+static void
+close_conn(struct conn *conn)
+{
+	assert(conn != NULL);
+
+	metrics_observe(METRICS_REQUEST, &conn->start);
+	if (accesslog_enabled()) {
+		struct accesslog_entry entry = {
+			.start = conn->start,
+			.peer = (struct sockaddr *)&conn->peer,
+			.peerlen = conn->peerlen,
+			.selector = conn->request,
+			.type = conn->type,
+			.status = conn->status,
+			.bytes = conn_sent(conn)
+		};
+		accesslog_log(&entry);
+	}
+
+	if (conn->admitted)
+		ratelimit_release((struct sockaddr *)&conn->peer);
+	timer_cancel(&wheel, &conn->timer);
+
+	/* Closing the descriptor removes it from the epoll set as well. */
+	close(conn->fd);
+	if (conn->body)
+		transfer_free(&conn->transfer);
+	if (conn->cached != NULL)
+		filecache_release(conn->cached);
+	if (conn->block != NULL)
+		uring_release(ring, conn->block, conn->blockindex);
+	free(conn->buf);
+	free(conn);
+}
+
+static bool
+set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+	if (flags == -1)
+		return (false);
+
+	return (fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1);
+}
+
+static int64_t
+now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ((int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
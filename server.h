@@ -0,0 +1,15 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "options.h"
+
+void server_run(struct opt_options *_options);
+
+#endif /* !SERVER_H */
@@ -0,0 +1,511 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "siteindex.h"
+#include "tools.h"
+
+#define MAGIC		"MGOPHIX"
+#define VERSION		1
+#define BYTEORDER	0x01020304
+
+/*
+ * A site index is written once by mgopherd-index and mapped read-only by
+ * mgopherd. It consists of a header, a table of directories sorted by
+ * selector, a table of regular files sorted by inode and a heap holding all
+ * strings and pre-rendered menus. All offsets are relative to the start of
+ * the file. The index is only valid for the host and port it was rendered
+ * for and for the byte order of the machine that wrote it.
+ *
+ * Every entry carries the stat(2) stamp of what it describes. A menu is only
+ * used while the directory and its gophermap still carry the same stamps,
+ * a type only while the file has the same inode, size and modification time.
+ */
+struct header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byteorder;
+	uint64_t size;
+	uint64_t host;
+	uint64_t port;
+	uint64_t dirs;
+	uint64_t ndirs;
+	uint64_t files;
+	uint64_t nfiles;
+};
+
+struct dirrecord {
+	uint64_t selector;
+	uint64_t menu;
+	uint64_t menulen;
+	struct tool_stamp dir;
+	struct tool_stamp map;
+	uint32_t hasmap;
+	uint32_t pad;
+};
+
+struct filerecord {
+	struct tool_stamp stamp;
+	uint32_t type;
+	uint32_t pad;
+};
+
+struct direntry {
+	char *selector;
+	char *data;
+	size_t len;
+	struct dirrecord record;
+};
+
+struct siteindex {
+	char *host;
+	char *port;
+	struct direntry *dirs;
+	size_t ndirs;
+	size_t dirscapacity;
+	struct filerecord *files;
+	size_t nfiles;
+	size_t filescapacity;
+};
+
+static const char *map;
+static size_t mapsize;
+static const struct header *header;
+static const struct dirrecord *dirs;
+static const struct filerecord *files;
+
+static bool check_index(const char *host, const char *port);
+static int compare_dirs(const void *a, const void *b);
+static int compare_files(const void *a, const void *b);
+
+/*
+ * Maps the index at path. An index that cannot be read, is damaged or was
+ * rendered for a different host or port is logged and ignored; requests are
+ * then served from the file system as usual.
+ */
+void
+siteindex_open(const char *path, const char *host, const char *port)
+{
+	assert(path != NULL);
+	assert(host != NULL);
+	assert(port != NULL);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		syslog(LOG_ERR, "open index error: %m");
+		return;
+	}
+
+	struct stat s;
+	if (fstat(fd, &s) == -1) {
+		syslog(LOG_ERR, "fstat index error: %m");
+		close(fd);
+		return;
+	}
+	if ((uintmax_t)s.st_size < sizeof(struct header) ||
+	    (uintmax_t)s.st_size > SIZE_MAX) {
+		syslog(LOG_ERR, "index \"%s\" has an invalid size", path);
+		close(fd);
+		return;
+	}
+
+	void *m = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		syslog(LOG_ERR, "mmap index error: %m");
+		return;
+	}
+
+	map = m;
+	mapsize = s.st_size;
+	if (!check_index(host, port)) {
+		syslog(LOG_ERR, "ignoring index \"%s\"", path);
+		munmap(m, mapsize);
+		map = NULL;
+		mapsize = 0;
+		return;
+	}
+
+	syslog(LOG_INFO, "index \"%s\": %ju directories, %ju files", path,
+	    (uintmax_t)header->ndirs, (uintmax_t)header->nfiles);
+}
+
+bool
+siteindex_enabled(void)
+{
+	return (map != NULL);
+}
+
+/*
+ * Returns the pre-rendered menu of selector if it is still valid for the
+ * given stat(2) results of the directory and its gophermap. map is NULL if
+ * there is no gophermap.
+ */
+const char *
+siteindex_menu(const char *selector, const struct stat *dir,
+    const struct stat *mapstat, size_t *len)
+{
+	assert(selector != NULL);
+	assert(dir != NULL);
+	assert(len != NULL);
+
+	if (map == NULL)
+		return (NULL);
+
+	size_t lo = 0;
+	size_t hi = header->ndirs;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct dirrecord *d = &dirs[mid];
+		int cmp = strcmp(selector, map + d->selector);
+		if (cmp < 0) {
+			hi = mid;
+			continue;
+		}
+		if (cmp > 0) {
+			lo = mid + 1;
+			continue;
+		}
+
+		if (!tool_same_stamp(&d->dir, dir, true) ||
+		    (d->hasmap != 0) != (mapstat != NULL) ||
+		    (mapstat != NULL &&
+		    !tool_same_stamp(&d->map, mapstat, true)))
+			return (NULL);
+
+		*len = d->menulen;
+		return (map + d->menu);
+	}
+
+	return (NULL);
+}
+
+/*
+ * Returns the recorded item type of a regular file or '\0'.
+ */
+char
+siteindex_type(const struct stat *s)
+{
+	assert(s != NULL);
+
+	if (map == NULL)
+		return ('\0');
+
+	uint64_t ino = s->st_ino;
+	uint64_t dev = s->st_dev;
+	size_t lo = 0;
+	size_t hi = header->nfiles;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct filerecord *f = &files[mid];
+		if (ino < f->stamp.ino ||
+		    (ino == f->stamp.ino && dev < f->stamp.dev)) {
+			hi = mid;
+			continue;
+		}
+		if (ino > f->stamp.ino || dev > f->stamp.dev) {
+			lo = mid + 1;
+			continue;
+		}
+
+		if (!tool_same_stamp(&f->stamp, s, false))
+			return ('\0');
+		return ((char)f->type);
+	}
+
+	return ('\0');
+}
+
+struct siteindex *
+siteindex_new(const char *host, const char *port)
+{
+	assert(host != NULL);
+	assert(port != NULL);
+
+	struct siteindex *index = calloc(1, sizeof(struct siteindex));
+	if (index == NULL)
+		return (NULL);
+
+	index->host = strdup(host);
+	index->port = strdup(port);
+	if (index->host == NULL || index->port == NULL) {
+		siteindex_free(index);
+		return (NULL);
+	}
+
+	return (index);
+}
+
+/*
+ * Records the rendered menu of a directory. The index takes ownership of
+ * data, even if false is returned.
+ */
+bool
+siteindex_add_menu(struct siteindex *index, const char *selector,
+    const struct stat *dir, const struct stat *mapstat, char *data,
+    size_t len)
+{
+	assert(index != NULL);
+	assert(selector != NULL);
+	assert(dir != NULL);
+	assert(data != NULL);
+
+	if (index->ndirs == index->dirscapacity) {
+		size_t c = (index->dirscapacity == 0) ? 64 :
+		    index->dirscapacity * 2;
+		void *d = realloc(index->dirs, c * sizeof(struct direntry));
+		if (d == NULL) {
+			free(data);
+			return (false);
+		}
+		index->dirs = d;
+		index->dirscapacity = c;
+	}
+
+	struct direntry *e = &index->dirs[index->ndirs];
+	memset(e, 0, sizeof(*e));
+	e->selector = strdup(selector);
+	if (e->selector == NULL) {
+		free(data);
+		return (false);
+	}
+	e->data = data;
+	e->len = len;
+	tool_make_stamp(&e->record.dir, dir);
+	e->record.hasmap = (mapstat != NULL);
+	if (mapstat != NULL)
+		tool_make_stamp(&e->record.map, mapstat);
+	index->ndirs++;
+
+	return (true);
+}
+
+bool
+siteindex_add_file(struct siteindex *index, const struct stat *s, char type)
+{
+	assert(index != NULL);
+	assert(s != NULL);
+
+	if (index->nfiles == index->filescapacity) {
+		size_t c = (index->filescapacity == 0) ? 256 :
+		    index->filescapacity * 2;
+		void *f = realloc(index->files, c * sizeof(struct filerecord));
+		if (f == NULL)
+			return (false);
+		index->files = f;
+		index->filescapacity = c;
+	}
+
+	struct filerecord *f = &index->files[index->nfiles];
+	memset(f, 0, sizeof(*f));
+	tool_make_stamp(&f->stamp, s);
+	f->type = (unsigned char)type;
+	index->nfiles++;
+
+	return (true);
+}
+
+/*
+ * Writes the index to a temporary file next to path and renames it into
+ * place, so running servers keep the index they have mapped.
+ */
+bool
+siteindex_write(struct siteindex *index, const char *path)
+{
+	assert(index != NULL);
+	assert(path != NULL);
+
+	if (index->ndirs > 0)
+		qsort(index->dirs, index->ndirs, sizeof(struct direntry),
+		    &compare_dirs);
+	if (index->nfiles > 0)
+		qsort(index->files, index->nfiles, sizeof(struct filerecord),
+		    &compare_files);
+
+	/* Lay out the heap behind the tables, every string NUL-terminated. */
+	uint64_t offset = sizeof(struct header) +
+	    index->ndirs * sizeof(struct dirrecord) +
+	    index->nfiles * sizeof(struct filerecord);
+
+	struct header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(h.magic));
+	h.version = VERSION;
+	h.byteorder = BYTEORDER;
+	h.dirs = sizeof(struct header);
+	h.ndirs = index->ndirs;
+	h.files = h.dirs + index->ndirs * sizeof(struct dirrecord);
+	h.nfiles = index->nfiles;
+	h.host = offset;
+	offset += strlen(index->host) + 1;
+	h.port = offset;
+	offset += strlen(index->port) + 1;
+	for (size_t i = 0; i < index->ndirs; i++) {
+		struct direntry *e = &index->dirs[i];
+		e->record.selector = offset;
+		offset += strlen(e->selector) + 1;
+		e->record.menu = offset;
+		e->record.menulen = e->len;
+		offset += e->len + 1;
+	}
+	h.size = offset;
+
+	size_t l = strlen(path) + sizeof(".tmp");
+	char *tmp = malloc(l);
+	if (tmp == NULL)
+		return (false);
+	snprintf(tmp, l, "%s.tmp", path);
+
+	FILE *f = fopen(tmp, "w");
+	if (f == NULL) {
+		free(tmp);
+		return (false);
+	}
+
+	bool success = tool_write_all(f, &h, sizeof(h));
+	for (size_t i = 0; success && i < index->ndirs; i++)
+		success = tool_write_all(f, &index->dirs[i].record,
+		    sizeof(struct dirrecord));
+	if (success && index->nfiles > 0)
+		success = tool_write_all(f, index->files,
+		    index->nfiles * sizeof(struct filerecord));
+	if (success)
+		success = (tool_write_all(f, index->host,
+		    strlen(index->host) + 1) &&
+		    tool_write_all(f, index->port, strlen(index->port) + 1));
+	for (size_t i = 0; success && i < index->ndirs; i++) {
+		struct direntry *e = &index->dirs[i];
+		success = (tool_write_all(f, e->selector,
+		    strlen(e->selector) + 1) &&
+		    tool_write_all(f, e->data, e->len) &&
+		    tool_write_all(f, "", 1));
+	}
+
+	if (fclose(f) == EOF)
+		success = false;
+	if (success && rename(tmp, path) == -1)
+		success = false;
+	if (!success) {
+		int error = errno;
+		unlink(tmp);
+		errno = error;
+	}
+	free(tmp);
+
+	return (success);
+}
+
+void
+siteindex_free(struct siteindex *index)
+{
+	if (index == NULL)
+		return;
+
+	for (size_t i = 0; i < index->ndirs; i++) {
+		free(index->dirs[i].selector);
+		free(index->dirs[i].data);
+	}
+	free(index->dirs);
+	free(index->files);
+	free(index->host);
+	free(index->port);
+	free(index);
+}
+
+/*
+ * Checks everything later lookups rely on, so a damaged index can not lead
+ * to reads outside the mapping.
+ */
+static bool
+check_index(const char *host, const char *port)
+{
+	assert(map != NULL);
+
+	header = (const struct header *)map;
+	if (memcmp(header->magic, MAGIC, sizeof(header->magic)) != 0 ||
+	    header->version != VERSION || header->byteorder != BYTEORDER) {
+		syslog(LOG_ERR, "index has an unknown format");
+		return (false);
+	}
+	if (header->size != mapsize ||
+	    header->dirs != sizeof(struct header) ||
+	    header->ndirs > (mapsize - header->dirs) /
+	    sizeof(struct dirrecord) ||
+	    header->files != header->dirs + header->ndirs *
+	    sizeof(struct dirrecord) ||
+	    header->nfiles > (mapsize - header->files) /
+	    sizeof(struct filerecord)) {
+		syslog(LOG_ERR, "index is truncated");
+		return (false);
+	}
+	if (!tool_check_string(map, mapsize, header->host) ||
+	    !tool_check_string(map, mapsize, header->port)) {
+		syslog(LOG_ERR, "index is damaged");
+		return (false);
+	}
+	if (strcmp(map + header->host, host) != 0 ||
+	    strcmp(map + header->port, port) != 0) {
+		syslog(LOG_NOTICE, "index was built for %s:%s",
+		    map + header->host, map + header->port);
+		return (false);
+	}
+
+	dirs = (const struct dirrecord *)(map + header->dirs);
+	files = (const struct filerecord *)(map + header->files);
+	for (uint64_t i = 0; i < header->ndirs; i++)
+		if (!tool_check_string(map, mapsize, dirs[i].selector) ||
+		    dirs[i].menu > mapsize ||
+		    dirs[i].menulen > mapsize - dirs[i].menu) {
+			syslog(LOG_ERR, "index is damaged");
+			return (false);
+		}
+
+	return (true);
+}
+
+static int
+compare_dirs(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	const struct direntry *da = a;
+	const struct direntry *db = b;
+
+	return (strcmp(da->selector, db->selector));
+}
+
+static int
+compare_files(const void *a, const void *b)
+{
+	assert(a != NULL);
+	assert(b != NULL);
+
+	const struct tool_stamp *fa = &((const struct filerecord *)a)->stamp;
+	const struct tool_stamp *fb = &((const struct filerecord *)b)->stamp;
+
+	if (fa->ino != fb->ino)
+		return (fa->ino < fb->ino ? -1 : 1);
+	if (fa->dev != fb->dev)
+		return (fa->dev < fb->dev ? -1 : 1);
+	return (0);
+}
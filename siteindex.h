@@ -0,0 +1,33 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef SITEINDEX_H
+#define SITEINDEX_H
+
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct siteindex;
+
+void siteindex_open(const char *_path, const char *_host, const char *_port);
+bool siteindex_enabled(void);
+const char *siteindex_menu(const char *_selector, const struct stat *_dir,
+    const struct stat *_map, size_t *_len);
+char siteindex_type(const struct stat *_s);
+
+struct siteindex *siteindex_new(const char *_host, const char *_port);
+bool siteindex_add_menu(struct siteindex *_index, const char *_selector,
+    const struct stat *_dir, const struct stat *_map, char *_data,
+    size_t _len);
+bool siteindex_add_file(struct siteindex *_index, const struct stat *_s,
+    char _type);
+bool siteindex_write(struct siteindex *_index, const char *_path);
+void siteindex_free(struct siteindex *_index);
+
+#endif /* !SITEINDEX_H */
@@ -0,0 +1,140 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <limits.h>
+#include <regex.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../request.h"
+
+/*
+ * Compares request_canonicalize() with the regular expression mgopherd used
+ * to validate requests before, for every request of up to MAXLEN characters
+ * over ALPHABET. Both have to agree, except in the two ways the rules were
+ * changed on purpose:
+ *
+ *  - requests with trailing slashes are accepted, and
+ *  - components starting with a dot or a backslash are rejected even if
+ *    they follow an empty component, as in "//..".
+ *
+ * The canonical selector has to be the request with its empty components
+ * removed, or "/" if none remain.
+ */
+
+#define REQUESTREGEX	"^(/|(/[^\\.][^/]*)*)$"
+#define ALPHABET	"/.a\\"
+#define MAXLEN		9
+
+static regex_t re;
+static unsigned long checked;
+static unsigned long trailing;
+static unsigned long hidden;
+static unsigned long failed;
+
+static void check(const char *request);
+static bool regex_valid(const char *request);
+static void canonical(const char *request, char *selector);
+
+int
+main(void)
+{
+	if (regcomp(&re, REQUESTREGEX, REG_EXTENDED | REG_NOSUB) != 0) {
+		fputs("regcomp failed\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	char request[MAXLEN + 1];
+	size_t n = strlen(ALPHABET);
+	for (size_t len = 0; len <= MAXLEN; len++) {
+		size_t digits[MAXLEN] = { 0 };
+		for (;;) {
+			for (size_t i = 0; i < len; i++)
+				request[i] = ALPHABET[digits[i]];
+			request[len] = '\0';
+			check(request);
+
+			size_t i = 0;
+			while (i < len && ++digits[i] == n)
+				digits[i++] = 0;
+			if (i == len)
+				break;
+		}
+	}
+	regfree(&re);
+
+	printf("%lu requests, %lu with trailing slashes accepted, "
+	    "%lu with hidden components rejected, %lu failed\n", checked,
+	    trailing, hidden, failed);
+
+	return (failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static void
+check(const char *request)
+{
+	char selector[LINE_MAX];
+	bool valid = request_canonicalize(request, selector);
+	bool old = regex_valid(request);
+	checked++;
+
+	if (valid && !old && *request != '\0' &&
+	    request[strlen(request) - 1] == '/')
+		trailing++;
+	else if (!valid && old && (strstr(request, "//.") != NULL ||
+	    strstr(request, "//\\") != NULL))
+		hidden++;
+	else if (valid != old) {
+		printf("\"%s\": %s, but the regex %s it\n", request,
+		    valid ? "accepted" : "rejected",
+		    old ? "accepted" : "rejected");
+		failed++;
+		return;
+	}
+
+	if (valid) {
+		char expected[LINE_MAX];
+		canonical(request, expected);
+		if (strcmp(selector, expected) != 0) {
+			printf("\"%s\": canonical form \"%s\", expected "
+			    "\"%s\"\n", request, selector, expected);
+			failed++;
+		}
+	}
+}
+
+static bool
+regex_valid(const char *request)
+{
+	return (regexec(&re, request, 0, NULL, 0) == 0);
+}
+
+static void
+canonical(const char *request, char *selector)
+{
+	*selector = '\0';
+
+	char *copy = strdup(request);
+	if (copy == NULL) {
+		perror("strdup");
+		exit(EXIT_FAILURE);
+	}
+	char *last;
+	for (char *c = strtok_r(copy, "/", &last); c != NULL;
+	    c = strtok_r(NULL, "/", &last)) {
+		strcat(selector, "/");
+		strcat(selector, c);
+	}
+	free(copy);
+
+	if (*selector == '\0')
+		strcpy(selector, "/");
+}
@@ -0,0 +1,144 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../arena.h"
+#include "../classify.h"
+#include "../options.h"
+#include "../request.h"
+
+/*
+ * Lists a directory holding a readable and an unreadable file whose types
+ * have to be identified by their content. The menu has to list the readable
+ * file only, without any error lines for the other one. Access rights do
+ * not apply to root, so the test runs as nobody if started as root.
+ */
+
+static char dir[] = "/tmp/mgopherd-listing.XXXXXX";
+
+static void drop_root(void);
+static void make_file(const char *name, mode_t mode);
+static void cleanup(void);
+
+int
+main(void)
+{
+	drop_root();
+
+	if (mkdtemp(dir) == NULL) {
+		perror("mkdtemp");
+		exit(EXIT_FAILURE);
+	}
+	atexit(cleanup);
+	make_file("readable.dat", 0644);
+	make_file("unreadable.dat", 0);
+
+	char *argv[] = { "listing", "-r", dir, "-H", "localhost", "-p", "70",
+	    NULL };
+	struct opt_options *options = opt_parse(7, argv);
+	classify_load(NULL);
+	struct arena *arena = arena_new();
+	if (arena == NULL) {
+		perror("arena_new");
+		exit(EXIT_FAILURE);
+	}
+
+	char *buf = NULL;
+	size_t len = 0;
+	FILE *out = open_memstream(&buf, &len);
+	if (out == NULL) {
+		perror("open_memstream");
+		exit(EXIT_FAILURE);
+	}
+	struct response response = {
+		.out = out,
+		.fd = -1
+	};
+	char request[LINE_MAX] = "/";
+	bool handled = request_handle(options, arena, request, &response);
+	fclose(out);
+
+	bool failed = !handled;
+	if (strstr(buf, "readable.dat\t/readable.dat\t") == NULL) {
+		puts("the readable file is not listed");
+		failed = true;
+	}
+	if (strstr(buf, "unreadable.dat") != NULL) {
+		puts("the unreadable file is listed");
+		failed = true;
+	}
+	for (char *line = buf; line != NULL && *line != '\0';) {
+		if (*line == '3') {
+			puts("the menu holds an error");
+			failed = true;
+		}
+		line = strchr(line, '\n');
+		if (line != NULL)
+			line++;
+	}
+	if (failed)
+		fputs(buf, stdout);
+	else
+		puts("unreadable entries are left out");
+	free(buf);
+	arena_free(arena);
+
+	return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void
+drop_root(void)
+{
+	if (geteuid() != 0)
+		return;
+
+	struct passwd *pw = getpwnam("nobody");
+	if (pw == NULL || setgid(pw->pw_gid) == -1 ||
+	    setuid(pw->pw_uid) == -1) {
+		perror("cannot run as nobody");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+make_file(const char *name, mode_t mode)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	FILE *f = fopen(path, "w");
+	if (f == NULL || fputs("plain text\n", f) == EOF || fclose(f) == EOF ||
+	    chmod(path, mode) == -1) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+cleanup(void)
+{
+	char path[PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/readable.dat", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/unreadable.dat", dir);
+	unlink(path);
+	rmdir(dir);
+}
@@ -0,0 +1,190 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "timer.h"
+
+#define SLOTBITS	6	/* log2(TIMER_SLOTS) */
+#define SLOTMASK	(TIMER_SLOTS - 1)
+#define RANGE		((uint64_t)1 << (SLOTBITS * TIMER_LEVELS))
+
+/*
+ * A hierarchical timer wheel. The first level has a slot for each of the
+ * next TIMER_SLOTS ticks, every further level covers TIMER_SLOTS times the
+ * range of the previous one with the same number of slots. Setting and
+ * cancelling a timer is a constant time list operation. Whenever the lower
+ * level wraps around, the timers of the next slot of the level above are
+ * distributed down, so a timer moves at most TIMER_LEVELS - 1 times before
+ * it expires. With 100 ms ticks, four levels of 64 slots cover nineteen
+ * days; timers further away are parked in the last level until they come
+ * into range.
+ */
+
+static void add(struct timer_wheel *w, struct timer *t, uint64_t earliest);
+static void cascade(struct timer_wheel *w, int level);
+static void unlink_timer(struct timer *t);
+
+/*
+ * Times are given in milliseconds of an arbitrary monotonic clock.
+ */
+void
+timer_init(struct timer_wheel *w, int64_t now)
+{
+	assert(w != NULL);
+
+	memset(w, 0, sizeof(*w));
+	w->now = now / TIMER_TICK;
+}
+
+/*
+ * Sets t to expire at when, or rather at the first tick after it. A pending
+ * timer is moved.
+ */
+void
+timer_set(struct timer_wheel *w, struct timer *t, int64_t when)
+{
+	assert(w != NULL);
+	assert(t != NULL);
+
+	if (t->pprev != NULL)
+		unlink_timer(t);
+	else
+		w->pending++;
+
+	t->expires = (when + TIMER_TICK - 1) / TIMER_TICK;
+	add(w, t, w->now + 1);
+}
+
+void
+timer_cancel(struct timer_wheel *w, struct timer *t)
+{
+	assert(w != NULL);
+	assert(t != NULL);
+
+	if (t->pprev == NULL)
+		return;
+
+	unlink_timer(t);
+	w->pending--;
+}
+
+bool
+timer_pending(const struct timer *t)
+{
+	assert(t != NULL);
+
+	return (t->pprev != NULL);
+}
+
+/*
+ * Advances the wheel to now and returns the timers that expired meanwhile
+ * as a list linked through next. They are no longer pending, so they may be
+ * set again right away.
+ */
+struct timer *
+timer_expire(struct timer_wheel *w, int64_t now)
+{
+	assert(w != NULL);
+
+	uint64_t target = now / TIMER_TICK;
+	struct timer *expired = NULL;
+
+	while (w->now < target) {
+		if (w->pending == 0) {
+			w->now = target;
+			break;
+		}
+
+		w->now++;
+		for (int level = 1; level < TIMER_LEVELS; level++) {
+			if ((w->now >> (SLOTBITS * (level - 1)) & SLOTMASK) !=
+			    0)
+				break;
+			cascade(w, level);
+		}
+
+		struct timer **slot = &w->slots[0][w->now & SLOTMASK];
+		while (*slot != NULL) {
+			struct timer *t = *slot;
+			unlink_timer(t);
+			w->pending--;
+			t->next = expired;
+			expired = t;
+		}
+	}
+
+	return (expired);
+}
+
+/*
+ * Links t into the slot it expires in, but not before earliest: the slot of
+ * the current tick is only still to come while it is being cascaded into.
+ */
+static void
+add(struct timer_wheel *w, struct timer *t, uint64_t earliest)
+{
+	assert(w != NULL);
+	assert(t != NULL);
+
+	uint64_t expires = t->expires;
+	if (expires < earliest)
+		expires = earliest;
+	if (expires - w->now >= RANGE)
+		expires = w->now + RANGE - 1;
+
+	uint64_t delta = expires - w->now;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 &&
+	    delta >= (uint64_t)1 << (SLOTBITS * (level + 1)))
+		level++;
+
+	struct timer **slot =
+	    &w->slots[level][expires >> (SLOTBITS * level) & SLOTMASK];
+	t->next = *slot;
+	if (t->next != NULL)
+		t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void
+cascade(struct timer_wheel *w, int level)
+{
+	assert(w != NULL);
+	assert(level > 0 && level < TIMER_LEVELS);
+
+	struct timer **slot =
+	    &w->slots[level][w->now >> (SLOTBITS * level) & SLOTMASK];
+	struct timer *t = *slot;
+	*slot = NULL;
+
+	while (t != NULL) {
+		struct timer *next = t->next;
+		add(w, t, w->now);
+		t = next;
+	}
+}
+
+static void
+unlink_timer(struct timer *t)
+{
+	assert(t != NULL);
+	assert(t->pprev != NULL);
+
+	*t->pprev = t->next;
+	if (t->next != NULL)
+		t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
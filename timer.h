@@ -0,0 +1,42 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK	100	/* milliseconds */
+#define TIMER_LEVELS	4
+#define TIMER_SLOTS	64	/* per level, must be a power of two */
+
+/*
+ * A timer is embedded into the object it belongs to, data points back to
+ * that object. It is pending as long as pprev is set.
+ */
+struct timer {
+	struct timer *next;
+	struct timer **pprev;
+	uint64_t expires;
+	void *data;
+};
+
+struct timer_wheel {
+	struct timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+	uint64_t now;
+	size_t pending;
+};
+
+void timer_init(struct timer_wheel *_w, int64_t _now);
+void timer_set(struct timer_wheel *_w, struct timer *_t, int64_t _when);
+void timer_cancel(struct timer_wheel *_w, struct timer *_t);
+bool timer_pending(const struct timer *_t);
+struct timer *timer_expire(struct timer_wheel *_w, int64_t _now);
+
+#endif /* !TIMER_H */
@@ -7,106 +7,127 @@
 
 #define _POSIX_C_SOURCE 200809
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <magic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 
+#include "arena.h"
+#include "metrics.h"
 #include "send.h"
 #include "tools.h"
 
 #define INITIALCAPACITY	32
 
-char *
-tool_mimetype(const char *path, FILE *out)
+static magic_t mh;
+
+/*
+ * Identifies the file name relative to the directory descriptor dirfd, which
+ * may be AT_FDCWD. The magic database is loaded on first use and kept for the
+ * lifetime of the process. The returned string is only valid until the next
+ * call.
+ */
+const char *
+tool_mimetype(int dirfd, const char *name, FILE *out)
 {
-	assert(path != NULL);
+	assert(name != NULL);
 	assert(out != NULL);
 
-	magic_t mh = magic_open(MAGIC_MIME_TYPE);
 	if (mh == NULL) {
-		syslog(LOG_ERR, "magic_open error: %m");
-		send_error(out, "E: magic_open", strerror(errno));
-		send_info(out, "I: I could not open a libmagic handle.", NULL);
-		send_eom(out);
-		exit(EXIT_FAILURE);
+		mh = magic_open(MAGIC_MIME_TYPE);
+		if (mh == NULL) {
+			syslog(LOG_ERR, "magic_open error: %m");
+			send_error(out, "E: magic_open", strerror(errno));
+			send_info(out, "I: I could not open a libmagic handle.",
+			    NULL);
+			send_eom(out);
+			exit(EXIT_FAILURE);
+		}
+
+		if (magic_load(mh, NULL) == -1) {
+			syslog(LOG_ERR, "magic_load error: %s",
+			    magic_error(mh));
+			send_error(out, "E: magic_load", magic_error(mh));
+			send_info(out, "I: I could not load the magic "
+			    "database.", NULL);
+			send_eom(out);
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	if (magic_load(mh, NULL) == -1) {
-		syslog(LOG_ERR, "magic_load error: %s", magic_error(mh));
-		send_error(out, "E: magic_load", magic_error(mh));
-		send_info(out, "I: I could not load the magic database.", NULL);
-		send_eom(out);
-		exit(EXIT_FAILURE);
+	int fd = openat(dirfd, name, O_RDONLY);
+	if (fd == -1) {
+		syslog(LOG_ERR, "openat error: %m");
+		send_error(out, "E: openat", strerror(errno));
+		send_info(out, "I: I could not open a file to identify its "
+		    "content.", name);
+		return (NULL);
 	}
 
-	const char *mime = magic_file(mh, path);
+	metrics_count(METRICS_MAGIC, 1);
+	const char *mime = magic_descriptor(mh, fd);
 	if (mime == NULL) {
-		syslog(LOG_ERR, "magic_file error: %s", magic_error(mh));
-		send_error(out, "E: magic_file", magic_error(mh));
+		syslog(LOG_ERR, "magic_descriptor error: %s", magic_error(mh));
+		send_error(out, "E: magic_descriptor", magic_error(mh));
 		send_info(out, "I: I could not identify the content of this "
-		    "file", path);
-		send_eom(out);
-		exit(EXIT_FAILURE);
+		    "file", name);
 	}
+	close(fd);
 
-	char *ret = strdup(mime);
-	if (ret == NULL)
-	{
-		syslog(LOG_ERR, "strdup error: %m");
-		send_error(out, "E: strdup mime", strerror(errno));
-		send_info(out, "I: I could not copy a string", mime);
-		send_eom(out);
-		exit(EXIT_FAILURE);
-	}
-
-	magic_close(mh);
-
-	return (ret);
+	return (mime);
 }
 
 char *
-tool_join_path(const char *part1, const char *part2, FILE *out)
+tool_join_path(struct arena *arena, const char *part1, const char *part2,
+    FILE *out)
 {
+	assert(arena != NULL);
 	assert(part1 != NULL);
 	assert(part2 != NULL);
 	assert(out != NULL);
 
-	char *joined = malloc(PATH_MAX);
-	if (joined == NULL) {
-		syslog(LOG_ERR, "malloc error: %m");
-		send_error(out, "E: malloc joined", strerror(errno));
-		send_info(out, "I: I could not join path elements.", NULL);
-		send_eom(out);
-		exit(EXIT_FAILURE);
-	}
-
-	char *pj = stpncpy(joined, part1, PATH_MAX);
-	if ((pj > joined) && (*(pj-1) != '/')) {
-		*pj++ = '/';
-		*pj = '\0';
-	}
-
-	size_t rl = PATH_MAX - (pj - joined);
+	size_t l1 = strlen(part1);
+	bool slash = (l1 == 0 || part1[l1-1] != '/');
 
 	const char *p2 = part2;
 	if (*p2 == '/')
 		p2++;
-	strncpy(pj, p2, rl);
+	size_t l2 = strlen(p2);
 
-	if (joined[PATH_MAX-1] != '\0') {
+	size_t l = l1 + slash + l2;
+	if (l >= PATH_MAX) {
 		syslog(LOG_ERR, "joinpath too long: \"%s\" + \"%s\"", part1,
 		    part2);
 		send_error(out, "E: joinpath: joined too long", NULL);
 		send_info(out, "I: A joined path was too long.", NULL);
+		return (NULL);
+	}
+
+	char *joined = arena_alloc(arena, l + 1);
+	if (joined == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		send_error(out, "E: malloc joined", strerror(errno));
+		send_info(out, "I: I could not join path elements.", NULL);
 		send_eom(out);
 		exit(EXIT_FAILURE);
 	}
 
+	memcpy(joined, part1, l1);
+	if (slash)
+		joined[l1] = '/';
+	memcpy(joined + l1 + slash, p2, l2 + 1);
+
 	return (joined);
 }
 
@@ -121,3 +142,62 @@ tool_strip_crlf(char *line)
 	if (p != NULL)
 		*p = '\0';
 }
+
+void
+tool_make_stamp(struct tool_stamp *stamp, const struct stat *s)
+{
+	assert(stamp != NULL);
+	assert(s != NULL);
+
+	stamp->dev = s->st_dev;
+	stamp->ino = s->st_ino;
+	stamp->size = s->st_size;
+	stamp->mtime = s->st_mtim.tv_sec;
+	stamp->mtimensec = s->st_mtim.tv_nsec;
+	stamp->ctime = s->st_ctim.tv_sec;
+	stamp->ctimensec = s->st_ctim.tv_nsec;
+}
+
+/*
+ * Compares the stamp with the current state s of its file. The change time
+ * is only compared if ctime is set; it also covers changed permissions.
+ */
+bool
+tool_same_stamp(const struct tool_stamp *stamp, const struct stat *s,
+    bool ctime)
+{
+	assert(stamp != NULL);
+	assert(s != NULL);
+
+	if (stamp->dev != (uint64_t)s->st_dev ||
+	    stamp->ino != (uint64_t)s->st_ino ||
+	    stamp->size != (uint64_t)s->st_size ||
+	    stamp->mtime != s->st_mtim.tv_sec ||
+	    stamp->mtimensec != s->st_mtim.tv_nsec)
+		return (false);
+
+	return (!ctime || (stamp->ctime == s->st_ctim.tv_sec &&
+	    stamp->ctimensec == s->st_ctim.tv_nsec));
+}
+
+bool
+tool_write_all(FILE *f, const void *data, size_t len)
+{
+	assert(f != NULL);
+	assert(data != NULL || len == 0);
+
+	return (len == 0 || fwrite(data, 1, len, f) == len);
+}
+
+/*
+ * Tells whether a terminated string starts at offset within the mapped file
+ * map of size bytes, as every string referenced by an index file has to.
+ */
+bool
+tool_check_string(const char *map, size_t size, uint64_t offset)
+{
+	assert(map != NULL || size == 0);
+
+	return (offset < size &&
+	    memchr(map + offset, '\0', size - offset) != NULL);
+}
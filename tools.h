@@ -8,10 +8,38 @@
 #ifndef TOOLS_H
 #define TOOLS_H
 
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 
-char *tool_mimetype(const char *_path, FILE *_out);
-char *tool_join_path(const char *_part1, const char *_part2, FILE *_out);
+#include "arena.h"
+
+/*
+ * Tells whether a file has changed since the stamp was taken. Its fields
+ * have fixed sizes, so stamps may be stored in index files.
+ */
+struct tool_stamp {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtimensec;
+	int64_t ctime;
+	int64_t ctimensec;
+};
+
+const char *tool_mimetype(int _dirfd, const char *_name, FILE *_out);
+char *tool_join_path(struct arena *_arena, const char *_part1,
+    const char *_part2, FILE *_out);
 void tool_strip_crlf(char *_line);
+void tool_make_stamp(struct tool_stamp *_stamp, const struct stat *_s);
+bool tool_same_stamp(const struct tool_stamp *_stamp, const struct stat *_s,
+    bool _ctime);
+bool tool_write_all(FILE *_f, const void *_data, size_t _len);
+bool tool_check_string(const char *_map, size_t _size, uint64_t _offset);
 
 #endif /* !TOOLS_H */
@@ -0,0 +1,627 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE	/* splice(2) */
+#endif
+#ifndef __FreeBSD__	/* would hide sendfile(2) */
+#define _POSIX_C_SOURCE 200809
+#endif
+
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "transfer.h"
+
+#define QUANTUM		(4 * 1024 * 1024)
+#define MINBLOCK	(64 * 1024)
+#define MAXBLOCK	(1024 * 1024)
+#define TEXTBLOCK	(256 * 1024)
+
+static enum transfer_status run_sendfile(struct transfer *t, int out);
+static enum transfer_status run_splice(struct transfer *t, int out);
+static enum transfer_status run_copy(struct transfer *t, int out);
+static enum transfer_status run_text(struct transfer *t, int out);
+static bool convert_text(struct transfer *t);
+static const char *find_newline(const char *p, const char *end);
+static bool unsupported(int error);
+
+/*
+ * Prepares the transfer of the whole file in to out. The transfer takes
+ * ownership of in. The cheapest method the platform offers for out is
+ * tried first, falling back to the next one if it turns out to be
+ * unsupported: sendfile(2) for sockets, splice(2) through a pipe and finally
+ * a plain read/write loop with an adaptive buffer.
+ *
+ * A text transfer instead sends the file as a text file entity: every line
+ * is terminated by CRLF and the terminating ".\r\n" is appended.
+ */
+bool
+transfer_init(struct transfer *t, int in, int out, bool text)
+{
+	assert(t != NULL);
+	assert(in != -1);
+
+	t->in = in;
+	t->offset = 0;
+	t->sent = 0;
+	t->pipe[0] = t->pipe[1] = -1;
+	t->piped = 0;
+	t->block = NULL;
+	t->blocksize = MINBLOCK;
+	t->blocklen = 0;
+	t->blockoff = 0;
+	t->src = NULL;
+	t->srclen = 0;
+	t->srcoff = 0;
+	t->bol = true;
+	t->pendingcr = false;
+	t->eom = false;
+
+	struct stat s;
+	if (fstat(in, &s) == -1) {
+		syslog(LOG_ERR, "fstat error: %m");
+		return (false);
+	}
+	t->size = s.st_size;
+
+	int ret = posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+	if (ret != 0 && ret != ENOSYS)
+		syslog(LOG_DEBUG, "posix_fadvise error: %d", ret);
+
+	if (text)
+		t->method = TRANSFER_TEXT;
+	else if (fstat(out, &s) == 0 && S_ISSOCK(s.st_mode))
+		t->method = TRANSFER_SENDFILE;
+	else
+		t->method = TRANSFER_SPLICE;
+
+	return (true);
+}
+
+/*
+ * Moves the next part of the file to out. At most QUANTUM bytes are moved
+ * per call, so a single large transfer does not starve other connections.
+ * TRANSFER_AGAIN is returned if out would block or the quantum is used up.
+ */
+enum transfer_status
+transfer_run(struct transfer *t, int out)
+{
+	assert(t != NULL);
+
+	off_t sent = t->sent;
+	enum transfer_status status;
+	for (;;) {
+		switch (t->method) {
+		case TRANSFER_SENDFILE:
+			status = run_sendfile(t, out);
+			break;
+		case TRANSFER_SPLICE:
+			status = run_splice(t, out);
+			break;
+		case TRANSFER_TEXT:
+			status = run_text(t, out);
+			break;
+		case TRANSFER_COPY:
+		default:
+			status = run_copy(t, out);
+			break;
+		}
+
+		if (status != TRANSFER_ERROR || !unsupported(errno) ||
+		    t->method >= TRANSFER_COPY || t->piped > 0)
+			break;
+
+		syslog(LOG_DEBUG, "transfer method %d unsupported, falling "
+		    "back", t->method);
+		t->method++;
+	}
+
+	metrics_count(METRICS_BYTES, t->sent - sent);
+	if (status == TRANSFER_DONE)
+		syslog(LOG_DEBUG, "transferred %jd bytes", (intmax_t)t->sent);
+
+	return (status);
+}
+
+void
+transfer_free(struct transfer *t)
+{
+	assert(t != NULL);
+
+	if (t->in != -1)
+		close(t->in);
+	if (t->pipe[0] != -1)
+		close(t->pipe[0]);
+	if (t->pipe[1] != -1)
+		close(t->pipe[1]);
+	free(t->block);
+	free(t->src);
+
+	t->in = -1;
+	t->pipe[0] = t->pipe[1] = -1;
+	t->block = NULL;
+	t->src = NULL;
+}
+
+/*
+ * Produces the next part of a text transfer in block for callers doing the
+ * writing themselves. len is set to 0 once the whole entity, including the
+ * terminating period, has been produced.
+ */
+bool
+transfer_convert(struct transfer *t, char *block, size_t size, size_t *len)
+{
+	assert(t != NULL);
+	assert(t->method == TRANSFER_TEXT);
+	assert(block != NULL);
+	assert(size > 8);
+	assert(len != NULL);
+
+	*len = 0;
+	if (t->eom)
+		return (true);
+
+	if (t->src == NULL) {
+		t->src = malloc(TEXTBLOCK);
+		if (t->src == NULL) {
+			syslog(LOG_ERR, "malloc error: %m");
+			return (false);
+		}
+	}
+
+	/* The block stays the caller's. */
+	t->block = block;
+	t->blocksize = size;
+	t->blocklen = 0;
+	bool success = convert_text(t);
+	*len = t->blocklen;
+	t->block = NULL;
+	t->blocklen = 0;
+
+	return (success);
+}
+
+/*
+ * Reads the file in into memory exactly as transfer_run() would send it. in
+ * stays open. False is returned if the file could not be read completely,
+ * e.g. because it grew meanwhile.
+ */
+bool
+transfer_load(int in, bool text, char **data, size_t *len)
+{
+	assert(in != -1);
+	assert(data != NULL);
+	assert(len != NULL);
+
+	struct stat s;
+	if (fstat(in, &s) == -1) {
+		syslog(LOG_ERR, "fstat error: %m");
+		return (false);
+	}
+
+	/* Text at most doubles, plus the termination of the last line. */
+	size_t size = s.st_size;
+	size_t capacity = text ? 2 * size + 16 : size + 1;
+	char *buf = malloc(capacity);
+	if (buf == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		return (false);
+	}
+
+	if (!text) {
+		size_t got = 0;
+		while (got < size) {
+			ssize_t r = pread(in, buf + got, size - got, got);
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+				free(buf);
+				return (false);
+			}
+			if (r == 0)
+				break;
+			got += r;
+		}
+		*data = buf;
+		*len = got;
+		return (true);
+	}
+
+	struct transfer t = {
+		.in = in,
+		.block = buf,
+		.blocksize = capacity,
+		.src = malloc(TEXTBLOCK),
+		.bol = true
+	};
+	if (t.src == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		free(buf);
+		return (false);
+	}
+
+	bool success = (convert_text(&t) && t.eom);
+	free(t.src);
+	if (!success) {
+		free(buf);
+		return (false);
+	}
+
+	*data = buf;
+	*len = t.blocklen;
+	return (true);
+}
+
+static enum transfer_status
+run_sendfile(struct transfer *t, int out)
+{
+	assert(t != NULL);
+
+	off_t quantum = t->sent + QUANTUM;
+	while (t->offset < t->size) {
+		if (t->sent >= quantum)
+			return (TRANSFER_AGAIN);
+
+		size_t count = QUANTUM;
+		if (t->size - t->offset < (off_t)count)
+			count = t->size - t->offset;
+
+#if defined(__linux__)
+		ssize_t w = sendfile(out, t->in, &t->offset, count);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (TRANSFER_AGAIN);
+			return (TRANSFER_ERROR);
+		}
+		if (w == 0)	/* the file shrank */
+			break;
+		t->sent += w;
+#elif defined(__FreeBSD__)
+		off_t w = 0;
+		int ret = sendfile(t->in, out, t->offset, count, NULL, &w, 0);
+		t->offset += w;
+		t->sent += w;
+		if (ret == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EBUSY)
+				return (TRANSFER_AGAIN);
+			return (TRANSFER_ERROR);
+		}
+		if (w == 0)
+			break;
+#else
+		(void)out;
+		errno = ENOSYS;
+		return (TRANSFER_ERROR);
+#endif
+	}
+
+	return (TRANSFER_DONE);
+}
+
+static enum transfer_status
+run_splice(struct transfer *t, int out)
+{
+	assert(t != NULL);
+
+#ifdef __linux__
+	if (t->pipe[0] == -1 && pipe(t->pipe) == -1)
+		return (TRANSFER_ERROR);
+
+	off_t quantum = t->sent + QUANTUM;
+	while (t->offset < t->size || t->piped > 0) {
+		if (t->sent >= quantum)
+			return (TRANSFER_AGAIN);
+
+		if (t->piped == 0) {
+			size_t count = QUANTUM;
+			if (t->size - t->offset < (off_t)count)
+				count = t->size - t->offset;
+
+			ssize_t r = splice(t->in, &t->offset, t->pipe[1], NULL,
+			    count, SPLICE_F_MOVE);
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+				return (TRANSFER_ERROR);
+			}
+			if (r == 0)	/* the file shrank */
+				break;
+			t->piped = r;
+		}
+
+		ssize_t w = splice(t->pipe[0], NULL, out, NULL, t->piped,
+		    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (TRANSFER_AGAIN);
+			return (TRANSFER_ERROR);
+		}
+		t->piped -= w;
+		t->sent += w;
+	}
+
+	return (TRANSFER_DONE);
+#else
+	(void)out;
+	errno = ENOSYS;
+	return (TRANSFER_ERROR);
+#endif
+}
+
+static enum transfer_status
+run_copy(struct transfer *t, int out)
+{
+	assert(t != NULL);
+
+	off_t quantum = t->sent + QUANTUM;
+	for (;;) {
+		if (t->sent >= quantum)
+			return (TRANSFER_AGAIN);
+
+		if (t->blockoff == t->blocklen) {
+			/*
+			 * Grow the buffer as long as the consumer keeps up
+			 * with whole blocks.
+			 */
+			if (t->blocklen == t->blocksize &&
+			    t->blocksize < MAXBLOCK) {
+				free(t->block);
+				t->block = NULL;
+				t->blocksize *= 2;
+			}
+			if (t->block == NULL) {
+				t->block = malloc(t->blocksize);
+				if (t->block == NULL) {
+					syslog(LOG_ERR, "malloc error: %m");
+					return (TRANSFER_ERROR);
+				}
+			}
+
+			ssize_t r = pread(t->in, t->block, t->blocksize,
+			    t->offset);
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+				return (TRANSFER_ERROR);
+			}
+			if (r == 0)
+				break;
+			t->offset += r;
+			t->blocklen = r;
+			t->blockoff = 0;
+		}
+
+		ssize_t w = write(out, t->block + t->blockoff,
+		    t->blocklen - t->blockoff);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (TRANSFER_AGAIN);
+			return (TRANSFER_ERROR);
+		}
+		t->blockoff += w;
+		t->sent += w;
+	}
+
+	return (TRANSFER_DONE);
+}
+
+static enum transfer_status
+run_text(struct transfer *t, int out)
+{
+	assert(t != NULL);
+
+	if (t->block == NULL) {
+		t->blocksize = TEXTBLOCK;
+		t->block = malloc(TEXTBLOCK);
+		t->src = malloc(TEXTBLOCK);
+		if (t->block == NULL || t->src == NULL) {
+			syslog(LOG_ERR, "malloc error: %m");
+			return (TRANSFER_ERROR);
+		}
+	}
+
+	off_t quantum = t->sent + QUANTUM;
+	for (;;) {
+		if (t->blockoff == t->blocklen) {
+			if (t->eom)
+				break;
+			if (t->sent >= quantum)
+				return (TRANSFER_AGAIN);
+			t->blocklen = 0;
+			t->blockoff = 0;
+			if (!convert_text(t))
+				return (TRANSFER_ERROR);
+		}
+
+		ssize_t w = write(out, t->block + t->blockoff,
+		    t->blocklen - t->blockoff);
+		if (w == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return (TRANSFER_AGAIN);
+			return (TRANSFER_ERROR);
+		}
+		t->blockoff += w;
+		t->sent += w;
+	}
+
+	return (TRANSFER_DONE);
+}
+
+/*
+ * Fills the output block with the next part of the text entity in a single
+ * pass over the file: a CR is dropped if a LF follows, every LF becomes CRLF
+ * and an unterminated last line is terminated. With STRICT_RFC1436, lines
+ * starting with a period get an extra one. A CR at the end of a run is held
+ * back until the next byte shows whether it belongs to a line terminator.
+ */
+static bool
+convert_text(struct transfer *t)
+{
+	assert(t != NULL);
+	assert(t->block != NULL);
+	assert(t->src != NULL);
+
+	char *o = t->block + t->blocklen;
+	char *oend = t->block + t->blocksize;
+
+	/* Room for a dot, a held back CR, a CRLF and the end of message. */
+	while (oend - o > 8) {
+		if (t->srcoff == t->srclen) {
+			ssize_t r = pread(t->in, t->src, TEXTBLOCK, t->offset);
+			if (r == -1) {
+				if (errno == EINTR)
+					continue;
+				return (false);
+			}
+			t->offset += r;
+			t->srclen = r;
+			t->srcoff = 0;
+
+			if (r == 0) {
+				if (t->pendingcr)
+					*o++ = '\r';
+				if (!t->bol) {
+					*o++ = '\r';
+					*o++ = '\n';
+				}
+				memcpy(o, ".\r\n", 3);
+				o += 3;
+				t->pendingcr = false;
+				t->bol = true;
+				t->eom = true;
+				break;
+			}
+		}
+
+		const char *s = t->src + t->srcoff;
+		const char *send = t->src + t->srclen;
+
+		if (t->pendingcr) {
+			t->pendingcr = false;
+			if (*s == '\n') {
+				*o++ = '\r';
+				*o++ = '\n';
+				t->srcoff++;
+				t->bol = true;
+				continue;
+			}
+			*o++ = '\r';
+		}
+
+		if (t->bol) {
+			t->bol = false;
+#ifdef STRICT_RFC1436
+			if (*s == '.')
+				*o++ = '.';
+#endif
+		}
+
+		const char *limit = s + (oend - o - 6);
+		if (limit > send)
+			limit = send;
+
+		const char *nl = find_newline(s, limit);
+		if (nl == NULL) {
+			size_t n = limit - s;
+			if (s[n - 1] == '\r') {
+				n--;
+				t->pendingcr = true;
+			}
+			memcpy(o, s, n);
+			o += n;
+			t->srcoff = limit - t->src;
+		} else {
+			size_t n = nl - s;
+			if (n > 0 && nl[-1] == '\r')
+				n--;
+			memcpy(o, s, n);
+			o += n;
+			*o++ = '\r';
+			*o++ = '\n';
+			t->srcoff = nl + 1 - t->src;
+			t->bol = true;
+		}
+	}
+
+	t->blocklen = o - t->block;
+
+	return (true);
+}
+
+/*
+ * Returns the first LF in [p, end) or NULL. Where the compiler targets SSE2
+ * or AVX2, 16 or 32 bytes are compared at once.
+ */
+static const char *
+find_newline(const char *p, const char *end)
+{
+	assert(p != NULL);
+	assert(end != NULL);
+
+#if defined(__AVX2__)
+	const __m256i lf = _mm256_set1_epi8('\n');
+	for (; end - p >= 32; p += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+		if (m != 0)
+			return (p + __builtin_ctz(m));
+	}
+#elif defined(__SSE2__)
+	const __m128i lf = _mm_set1_epi8('\n');
+	for (; end - p >= 16; p += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)p);
+		unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+		if (m != 0)
+			return (p + __builtin_ctz(m));
+	}
+#endif
+
+	for (; p < end; p++)
+		if (*p == '\n')
+			return (p);
+
+	return (NULL);
+}
+
+static bool
+unsupported(int error)
+{
+	return (error == EINVAL || error == ENOSYS || error == EOPNOTSUPP ||
+	    error == ENOTSOCK);
+}
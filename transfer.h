@@ -0,0 +1,56 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef TRANSFER_H
+#define TRANSFER_H
+
+#include <sys/types.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+enum transfer_method {
+	TRANSFER_SENDFILE,
+	TRANSFER_SPLICE,
+	TRANSFER_COPY,
+	TRANSFER_TEXT
+};
+
+enum transfer_status {
+	TRANSFER_DONE,
+	TRANSFER_AGAIN,
+	TRANSFER_ERROR
+};
+
+struct transfer {
+	int in;
+	off_t offset;
+	off_t size;
+	off_t sent;
+	enum transfer_method method;
+	int pipe[2];
+	size_t piped;
+	char *block;
+	size_t blocksize;
+	size_t blocklen;
+	size_t blockoff;
+	char *src;
+	size_t srclen;
+	size_t srcoff;
+	bool bol;
+	bool pendingcr;
+	bool eom;
+};
+
+bool transfer_init(struct transfer *_t, int _in, int _out, bool _text);
+enum transfer_status transfer_run(struct transfer *_t, int _out);
+void transfer_free(struct transfer *_t);
+bool transfer_convert(struct transfer *_t, char *_block, size_t _size,
+    size_t *_len);
+bool transfer_load(int _in, bool _text, char **_data, size_t *_len);
+
+#endif /* !TRANSFER_H */
@@ -0,0 +1,100 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+
+#include "typecache.h"
+
+#define TYPECACHESIZE	8192	/* must be a power of two */
+
+/*
+ * The item type of a regular file only depends on its content, so the
+ * result of the classification is remembered per inode. A changed mtime
+ * or size invalidates an entry. The cache is direct mapped: a colliding
+ * file simply replaces the former entry.
+ */
+struct entry {
+	dev_t dev;
+	ino_t ino;
+	time_t mtime;
+	long mtimensec;
+	off_t size;
+	char type;
+};
+
+static struct entry *cache;
+
+static struct entry *lookup(const struct stat *s);
+
+char
+typecache_get(const struct stat *s)
+{
+	assert(s != NULL);
+
+	struct entry *e = lookup(s);
+	if (e == NULL || e->type == '\0')
+		return ('\0');
+
+	if (e->dev != s->st_dev || e->ino != s->st_ino ||
+	    e->mtime != s->st_mtim.tv_sec ||
+	    e->mtimensec != s->st_mtim.tv_nsec || e->size != s->st_size)
+		return ('\0');
+
+	return (e->type);
+}
+
+void
+typecache_put(const struct stat *s, char type)
+{
+	assert(s != NULL);
+
+	struct entry *e = lookup(s);
+	if (e == NULL)
+		return;
+
+	e->dev = s->st_dev;
+	e->ino = s->st_ino;
+	e->mtime = s->st_mtim.tv_sec;
+	e->mtimensec = s->st_mtim.tv_nsec;
+	e->size = s->st_size;
+	e->type = type;
+}
+
+void
+typecache_flush(void)
+{
+	if (cache != NULL)
+		memset(cache, 0, TYPECACHESIZE * sizeof(struct entry));
+}
+
+static struct entry *
+lookup(const struct stat *s)
+{
+	assert(s != NULL);
+
+	if (cache == NULL) {
+		cache = calloc(TYPECACHESIZE, sizeof(struct entry));
+		if (cache == NULL) {
+			syslog(LOG_ERR, "calloc error: %m");
+			return (NULL);
+		}
+	}
+
+	uint64_t h = ((uint64_t)s->st_dev << 32 ^ (uint64_t)s->st_ino) *
+	    UINT64_C(0x9e3779b97f4a7c15);
+
+	return (&cache[(h >> 40) & (TYPECACHESIZE - 1)]);
+}
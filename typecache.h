@@ -0,0 +1,17 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef TYPECACHE_H
+#define TYPECACHE_H
+
+#include <sys/stat.h>
+
+char typecache_get(const struct stat *_s);
+void typecache_put(const struct stat *_s, char _type);
+void typecache_flush(void);
+
+#endif /* !TYPECACHE_H */
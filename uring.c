@@ -0,0 +1,604 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+#ifdef HAVE_IO_URING
+#define _GNU_SOURCE	/* syscall(2) */
+#endif
+
+#include <sys/types.h>
+#ifdef HAVE_IO_URING
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#ifdef HAVE_IO_URING
+
+/*
+ * A minimal io_uring(7) wrapper talking to the kernel directly. The
+ * submission queue entries are mapped one to one into the submission ring,
+ * so the index array is filled once and only the tail moves afterwards.
+ * Operations are queued locally and handed to the kernel in one batch by
+ * uring_submit(), which also waits for the next completion.
+ *
+ * The ring owns a pool of equally sized blocks. If the kernel allows it,
+ * they are registered as fixed buffers, which saves mapping the pages of
+ * the buffer for every single read and write.
+ */
+struct uring {
+	int fd;
+	void *sqring;
+	size_t sqringsize;
+	void *cqring;
+	size_t cqringsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	unsigned *sqhead;
+	unsigned *sqtail;
+	unsigned sqmask;
+	unsigned sqentries;
+	unsigned tail;
+	unsigned *cqhead;
+	unsigned *cqtail;
+	unsigned cqmask;
+	struct io_uring_cqe *cqes;
+	char *blocks;
+	size_t blocksize;
+	int *unused;
+	int nunused;
+	bool registered;
+	struct __kernel_timespec timeout;
+};
+
+static const int required[] = {
+	IORING_OP_ACCEPT,
+	IORING_OP_POLL_ADD,
+	IORING_OP_RECV,
+	IORING_OP_TIMEOUT,
+	IORING_OP_READ,
+	IORING_OP_READ_FIXED,
+	IORING_OP_WRITE,
+	IORING_OP_WRITE_FIXED,
+	IORING_OP_WRITEV
+};
+
+static bool supported(int fd);
+static void register_blocks(struct uring *u, int nblocks);
+static struct io_uring_sqe *next_sqe(struct uring *u, int op, int fd,
+    void *data);
+
+/*
+ * Sets up a ring for entries submissions at a time and a pool of nblocks
+ * blocks. NULL is returned if the kernel does not support everything the
+ * server needs, so the caller can fall back to epoll(7).
+ */
+struct uring *
+uring_new(unsigned entries, int nblocks, size_t blocksize)
+{
+	assert(entries > 0);
+	assert(nblocks > 0);
+	assert(blocksize > 0);
+
+	struct uring *u = calloc(1, sizeof(struct uring));
+	if (u == NULL)
+		return (NULL);
+	u->fd = -1;
+	u->sqring = u->cqring = MAP_FAILED;
+	u->sqes = MAP_FAILED;
+
+	/* Completions are kept by the kernel if the ring overflows. */
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = 4 * entries;
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (u->fd == -1)
+		goto fail;
+	if (!(p.features & IORING_FEAT_NODROP) || !supported(u->fd)) {
+		errno = ENOSYS;
+		goto fail;
+	}
+
+	u->sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->cqringsize = p.cq_off.cqes +
+	    p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (u->cqringsize > u->sqringsize)
+			u->sqringsize = u->cqringsize;
+		u->cqringsize = 0;
+	}
+
+	u->sqring = mmap(NULL, u->sqringsize, PROT_READ | PROT_WRITE,
+	    MAP_SHARED, u->fd, IORING_OFF_SQ_RING);
+	if (u->sqring == MAP_FAILED)
+		goto fail;
+	if (u->cqringsize == 0)
+		u->cqring = u->sqring;
+	else {
+		u->cqring = mmap(NULL, u->cqringsize, PROT_READ | PROT_WRITE,
+		    MAP_SHARED, u->fd, IORING_OFF_CQ_RING);
+		if (u->cqring == MAP_FAILED)
+			goto fail;
+	}
+	u->sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes = mmap(NULL, u->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    u->fd, IORING_OFF_SQES);
+	if (u->sqes == MAP_FAILED)
+		goto fail;
+
+	char *sq = u->sqring;
+	u->sqhead = (unsigned *)(sq + p.sq_off.head);
+	u->sqtail = (unsigned *)(sq + p.sq_off.tail);
+	u->sqmask = *(unsigned *)(sq + p.sq_off.ring_mask);
+	u->sqentries = p.sq_entries;
+	u->tail = *u->sqtail;
+	unsigned *array = (unsigned *)(sq + p.sq_off.array);
+	for (unsigned i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	char *cq = u->cqring;
+	u->cqhead = (unsigned *)(cq + p.cq_off.head);
+	u->cqtail = (unsigned *)(cq + p.cq_off.tail);
+	u->cqmask = *(unsigned *)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	u->blocksize = blocksize;
+	u->blocks = malloc(nblocks * blocksize);
+	u->unused = malloc(nblocks * sizeof(int));
+	if (u->blocks == NULL || u->unused == NULL)
+		goto fail;
+	for (int i = 0; i < nblocks; i++)
+		u->unused[i] = nblocks - 1 - i;
+	u->nunused = nblocks;
+	register_blocks(u, nblocks);
+
+	return (u);
+
+fail:
+	uring_free(u);
+	return (NULL);
+}
+
+void
+uring_free(struct uring *u)
+{
+	if (u == NULL)
+		return;
+
+	int error = errno;
+	if (u->sqes != MAP_FAILED)
+		munmap(u->sqes, u->sqessize);
+	if (u->cqring != MAP_FAILED && u->cqring != u->sqring)
+		munmap(u->cqring, u->cqringsize);
+	if (u->sqring != MAP_FAILED)
+		munmap(u->sqring, u->sqringsize);
+	if (u->fd != -1)
+		close(u->fd);
+	free(u->blocks);
+	free(u->unused);
+	free(u);
+	errno = error;
+}
+
+/*
+ * Returns a block of the pool and sets index to its buffer index. If the
+ * pool is exhausted, a separately allocated block is returned and index is
+ * set to -1. Either way, the block has to be given back by
+ * uring_release().
+ */
+char *
+uring_block(struct uring *u, int *index)
+{
+	assert(u != NULL);
+	assert(index != NULL);
+
+	if (u->nunused == 0) {
+		*index = -1;
+		return (malloc(u->blocksize));
+	}
+
+	*index = u->unused[--u->nunused];
+	return (u->blocks + *index * u->blocksize);
+}
+
+void
+uring_release(struct uring *u, char *block, int index)
+{
+	assert(u != NULL);
+	assert(block != NULL);
+
+	if (index == -1)
+		free(block);
+	else
+		u->unused[u->nunused++] = index;
+}
+
+void
+uring_accept(struct uring *u, int fd, struct sockaddr *addr,
+    socklen_t *addrlen, void *data)
+{
+	assert(u != NULL);
+	assert(addr != NULL);
+	assert(addrlen != NULL);
+
+	struct io_uring_sqe *sqe = next_sqe(u, IORING_OP_ACCEPT, fd, data);
+	sqe->addr = (uintptr_t)addr;
+	sqe->addr2 = (uintptr_t)addrlen;
+}
+
+/*
+ * Completes once fd is readable.
+ */
+void
+uring_poll(struct uring *u, int fd, void *data)
+{
+	assert(u != NULL);
+
+	struct io_uring_sqe *sqe = next_sqe(u, IORING_OP_POLL_ADD, fd, data);
+	uint32_t events = POLLIN;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	events = events << 16 | events >> 16;
+#endif
+	sqe->poll32_events = events;
+}
+
+void
+uring_recv(struct uring *u, int fd, void *buf, size_t len, void *data)
+{
+	assert(u != NULL);
+	assert(buf != NULL);
+
+	struct io_uring_sqe *sqe = next_sqe(u, IORING_OP_RECV, fd, data);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+}
+
+/*
+ * Reads from offset of fd into buf, which has to be a block of the pool
+ * with the given index or a separately allocated one.
+ */
+void
+uring_read(struct uring *u, int fd, void *buf, size_t len, off_t offset,
+    int index, void *data)
+{
+	assert(u != NULL);
+	assert(buf != NULL);
+
+	bool fixed = (u->registered && index != -1);
+	struct io_uring_sqe *sqe = next_sqe(u,
+	    fixed ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, data);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	if (fixed)
+		sqe->buf_index = index;
+}
+
+/*
+ * Writes buf to fd. As for uring_read(), buf has to lie within a block.
+ */
+void
+uring_write(struct uring *u, int fd, const void *buf, size_t len, int index,
+    void *data)
+{
+	assert(u != NULL);
+	assert(buf != NULL);
+
+	bool fixed = (u->registered && index != -1);
+	struct io_uring_sqe *sqe = next_sqe(u,
+	    fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd, data);
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = (uint64_t)-1;
+	if (fixed)
+		sqe->buf_index = index;
+}
+
+/*
+ * Writes the segments of iov to fd. iov has to stay valid until the
+ * operation completes.
+ */
+void
+uring_writev(struct uring *u, int fd, const struct iovec *iov, int iovcnt,
+    void *data)
+{
+	assert(u != NULL);
+	assert(iov != NULL);
+
+	struct io_uring_sqe *sqe = next_sqe(u, IORING_OP_WRITEV, fd, data);
+	sqe->addr = (uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->off = (uint64_t)-1;
+}
+
+/*
+ * Completes with -ETIME after ms milliseconds. Only one timeout may be
+ * queued at a time.
+ */
+void
+uring_timeout(struct uring *u, long ms, void *data)
+{
+	assert(u != NULL);
+	assert(ms >= 0);
+
+	u->timeout.tv_sec = ms / 1000;
+	u->timeout.tv_nsec = ms % 1000 * 1000000;
+
+	struct io_uring_sqe *sqe = next_sqe(u, IORING_OP_TIMEOUT, -1, data);
+	sqe->addr = (uintptr_t)&u->timeout;
+	sqe->len = 1;
+}
+
+/*
+ * Hands all queued operations to the kernel and waits until at least one
+ * of them has completed. On failure errno is set; EINTR means a signal
+ * arrived and EBUSY that the completions have to be collected first.
+ */
+bool
+uring_submit(struct uring *u)
+{
+	assert(u != NULL);
+
+	__atomic_store_n(u->sqtail, u->tail, __ATOMIC_RELEASE);
+	unsigned pending = u->tail - __atomic_load_n(u->sqhead,
+	    __ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE) != *u->cqhead) {
+		if (pending == 0)
+			return (true);
+		return (syscall(__NR_io_uring_enter, u->fd, pending, 0, 0,
+		    NULL, 0) != -1);
+	}
+
+	return (syscall(__NR_io_uring_enter, u->fd, pending, 1,
+	    IORING_ENTER_GETEVENTS, NULL, 0) != -1);
+}
+
+/*
+ * Takes the next completion off the ring. res is the result of the
+ * operation, a negative errno value on failure.
+ */
+bool
+uring_complete(struct uring *u, void **data, int *res)
+{
+	assert(u != NULL);
+	assert(data != NULL);
+	assert(res != NULL);
+
+	unsigned head = *u->cqhead;
+	if (head == __atomic_load_n(u->cqtail, __ATOMIC_ACQUIRE))
+		return (false);
+
+	struct io_uring_cqe *cqe = &u->cqes[head & u->cqmask];
+	*data = (void *)(uintptr_t)cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(u->cqhead, head + 1, __ATOMIC_RELEASE);
+
+	return (true);
+}
+
+static bool
+supported(int fd)
+{
+	size_t size = sizeof(struct io_uring_probe) +
+	    256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (probe == NULL)
+		return (false);
+
+	bool all = (syscall(__NR_io_uring_register, fd,
+	    IORING_REGISTER_PROBE, probe, 256) != -1);
+	for (size_t i = 0; all && i < sizeof(required) / sizeof(int); i++)
+		all = (required[i] <= probe->last_op &&
+		    (probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED));
+
+	free(probe);
+	return (all);
+}
+
+/*
+ * Registering the blocks counts against RLIMIT_MEMLOCK on older kernels.
+ * If that fails, the blocks are used as plain buffers.
+ */
+static void
+register_blocks(struct uring *u, int nblocks)
+{
+	assert(u != NULL);
+
+	struct iovec *iov = calloc(nblocks, sizeof(struct iovec));
+	if (iov == NULL)
+		return;
+	for (int i = 0; i < nblocks; i++) {
+		iov[i].iov_base = u->blocks + i * u->blocksize;
+		iov[i].iov_len = u->blocksize;
+	}
+
+	if (syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_BUFFERS,
+	    iov, nblocks) == -1)
+		syslog(LOG_NOTICE, "io_uring buffer registration error: %m");
+	else
+		u->registered = true;
+
+	free(iov);
+}
+
+/*
+ * Returns the next submission queue entry, prepared for op on fd. If the
+ * ring is full, the queued entries are handed to the kernel first.
+ */
+static struct io_uring_sqe *
+next_sqe(struct uring *u, int op, int fd, void *data)
+{
+	assert(u != NULL);
+
+	while (u->tail - __atomic_load_n(u->sqhead, __ATOMIC_ACQUIRE) ==
+	    u->sqentries) {
+		__atomic_store_n(u->sqtail, u->tail, __ATOMIC_RELEASE);
+		if (syscall(__NR_io_uring_enter, u->fd, u->sqentries, 0, 0,
+		    NULL, 0) == -1 && errno != EINTR && errno != EAGAIN &&
+		    errno != EBUSY) {
+			syslog(LOG_ERR, "io_uring_enter error: %m");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct io_uring_sqe *sqe = &u->sqes[u->tail & u->sqmask];
+	u->tail++;
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->user_data = (uintptr_t)data;
+
+	return (sqe);
+}
+
+#else /* !HAVE_IO_URING */
+
+struct uring *
+uring_new(unsigned entries, int nblocks, size_t blocksize)
+{
+	(void)entries;
+	(void)nblocks;
+	(void)blocksize;
+
+	errno = ENOSYS;
+	return (NULL);
+}
+
+void
+uring_free(struct uring *u)
+{
+	(void)u;
+}
+
+char *
+uring_block(struct uring *u, int *index)
+{
+	(void)u;
+
+	*index = -1;
+	return (NULL);
+}
+
+void
+uring_release(struct uring *u, char *block, int index)
+{
+	(void)u;
+	(void)block;
+	(void)index;
+}
+
+void
+uring_accept(struct uring *u, int fd, struct sockaddr *addr,
+    socklen_t *addrlen, void *data)
+{
+	(void)u;
+	(void)fd;
+	(void)addr;
+	(void)addrlen;
+	(void)data;
+}
+
+void
+uring_poll(struct uring *u, int fd, void *data)
+{
+	(void)u;
+	(void)fd;
+	(void)data;
+}
+
+void
+uring_recv(struct uring *u, int fd, void *buf, size_t len, void *data)
+{
+	(void)u;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)data;
+}
+
+void
+uring_read(struct uring *u, int fd, void *buf, size_t len, off_t offset,
+    int index, void *data)
+{
+	(void)u;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offset;
+	(void)index;
+	(void)data;
+}
+
+void
+uring_write(struct uring *u, int fd, const void *buf, size_t len, int index,
+    void *data)
+{
+	(void)u;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)index;
+	(void)data;
+}
+
+void
+uring_writev(struct uring *u, int fd, const struct iovec *iov, int iovcnt,
+    void *data)
+{
+	(void)u;
+	(void)fd;
+	(void)iov;
+	(void)iovcnt;
+	(void)data;
+}
+
+void
+uring_timeout(struct uring *u, long ms, void *data)
+{
+	(void)u;
+	(void)ms;
+	(void)data;
+}
+
+bool
+uring_submit(struct uring *u)
+{
+	(void)u;
+
+	errno = ENOSYS;
+	return (false);
+}
+
+bool
+uring_complete(struct uring *u, void **data, int *res)
+{
+	(void)u;
+	(void)data;
+	(void)res;
+
+	return (false);
+}
+
+#endif /* HAVE_IO_URING */
@@ -0,0 +1,39 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct uring;
+
+struct uring *uring_new(unsigned _entries, int _nblocks, size_t _blocksize);
+void uring_free(struct uring *_u);
+char *uring_block(struct uring *_u, int *_index);
+void uring_release(struct uring *_u, char *_block, int _index);
+void uring_accept(struct uring *_u, int _fd, struct sockaddr *_addr,
+    socklen_t *_addrlen, void *_data);
+void uring_poll(struct uring *_u, int _fd, void *_data);
+void uring_recv(struct uring *_u, int _fd, void *_buf, size_t _len,
+    void *_data);
+void uring_read(struct uring *_u, int _fd, void *_buf, size_t _len,
+    off_t _offset, int _index, void *_data);
+void uring_write(struct uring *_u, int _fd, const void *_buf, size_t _len,
+    int _index, void *_data);
+void uring_writev(struct uring *_u, int _fd, const struct iovec *_iov,
+    int _iovcnt, void *_data);
+void uring_timeout(struct uring *_u, long _ms, void *_data);
+bool uring_submit(struct uring *_u);
+bool uring_complete(struct uring *_u, void **_data, int *_res);
+
+#endif /* !URING_H */
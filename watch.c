@@ -0,0 +1,423 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#define _POSIX_C_SOURCE 200809
+
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/stat.h>
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include "filecache.h"
+#include "menucache.h"
+#include "typecache.h"
+#include "watch.h"
+
+#ifdef __linux__
+
+#define BUCKETS		1024	/* must be a power of two */
+#define EVENTBUF	65536
+#define DIRMASK		(IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+			    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+			    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | \
+			    IN_DONT_FOLLOW)
+
+/*
+ * Every directory below the root carries an inotify watch. Events within a
+ * directory invalidate its cached menu and the cached file the event names,
+ * so validated state stays correct without checking the file system on every
+ * request. Directories without a watch, because the watch limit has been
+ * reached, are simply not covered and fall back to stat(2) based validation.
+ * Every worker keeps watches of its own, as each one has its own caches.
+ */
+struct dir {
+	int wd;
+	char *selector;
+	struct dir *bywd;
+	struct dir *bysel;
+};
+
+static int fd = -1;
+static char *rootpath;
+static struct dir *wds[BUCKETS];
+static struct dir *selectors[BUCKETS];
+static bool limited;
+
+static void scan(const char *selector);
+static void add_watch(const char *selector);
+static void remove_watch(struct dir *d);
+static struct dir *find_wd(int wd);
+static struct dir *find_selector(const char *selector);
+static void unwatch_tree(const char *selector);
+static void invalidate_tree(const char *selector);
+static char *child_selector(const char *parent, const char *name);
+static uint32_t hash(const char *s);
+
+/*
+ * Watches the whole tree below root. Returns a descriptor that becomes
+ * readable when watch_process() has events to handle, or -1.
+ */
+int
+watch_init(const char *root)
+{
+	assert(root != NULL);
+
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd == -1) {
+		syslog(LOG_ERR, "inotify_init1 error: %m");
+		return (-1);
+	}
+
+	rootpath = strdup(root);
+	if (rootpath == NULL) {
+		syslog(LOG_ERR, "strdup error: %m");
+		close(fd);
+		fd = -1;
+		return (-1);
+	}
+
+	scan("/");
+
+	return (fd);
+}
+
+void
+watch_process(void)
+{
+	if (fd == -1)
+		return;
+
+	char buf[EVENTBUF]
+	    __attribute__((aligned(__alignof__(struct inotify_event))));
+	for (;;) {
+		ssize_t r = read(fd, buf, sizeof(buf));
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				syslog(LOG_ERR, "read inotify error: %m");
+			return;
+		}
+
+		for (char *p = buf; p < buf + r;) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				syslog(LOG_NOTICE, "inotify queue overflow, "
+				    "rescanning");
+				menucache_flush();
+				filecache_flush();
+				typecache_flush();
+				scan("/");
+				continue;
+			}
+
+			struct dir *d = find_wd(ev->wd);
+			if (d == NULL)
+				continue;
+
+			if (ev->mask & IN_IGNORED) {
+				menucache_invalidate(d->selector);
+				filecache_invalidate_tree(d->selector);
+				remove_watch(d);
+				continue;
+			}
+
+			menucache_invalidate(d->selector);
+			if (ev->len == 0 || ev->name[0] == '.')
+				continue;
+
+			char *child = child_selector(d->selector, ev->name);
+			if (child == NULL)
+				continue;
+
+			if (!(ev->mask & IN_ISDIR)) {
+				filecache_invalidate(child);
+				free(child);
+				continue;
+			}
+
+			/*
+			 * New directories are watched right away. Directories
+			 * moved away are forgotten. Permissions of a directory
+			 * affect everything below it.
+			 */
+			if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+				scan(child);
+			else if (ev->mask & IN_MOVED_FROM)
+				unwatch_tree(child);
+			else if (ev->mask & IN_ATTRIB)
+				invalidate_tree(child);
+			else
+				menucache_invalidate(child);
+
+			free(child);
+		}
+	}
+}
+
+/*
+ * Returns true if changes to the directory reached by selector are reliably
+ * reported.
+ */
+bool
+watch_covers(const char *selector)
+{
+	assert(selector != NULL);
+
+	return (fd != -1 && find_selector(selector) != NULL);
+}
+
+/*
+ * Watches the directory reached by selector and everything below it. Any
+ * change that happened before the watch existed would go unnoticed, so the
+ * menus are invalidated as well.
+ */
+static void
+scan(const char *selector)
+{
+	assert(selector != NULL);
+
+	add_watch(selector);
+	menucache_invalidate(selector);
+
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s%s", rootpath, selector) >=
+	    (int)sizeof(path))
+		return;
+
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return;
+
+	struct dirent *de;
+	while ((de = readdir(dir)) != NULL) {
+		if (de->d_name[0] == '.')
+			continue;
+
+		char *child = child_selector(selector, de->d_name);
+		if (child == NULL)
+			continue;
+
+		struct stat s;
+		if (snprintf(path, sizeof(path), "%s%s", rootpath, child) <
+		    (int)sizeof(path) && lstat(path, &s) == 0 &&
+		    S_ISDIR(s.st_mode))
+			scan(child);
+
+		free(child);
+	}
+
+	closedir(dir);
+}
+
+static void
+add_watch(const char *selector)
+{
+	assert(selector != NULL);
+
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s%s", rootpath, selector) >=
+	    (int)sizeof(path))
+		return;
+
+	int wd = inotify_add_watch(fd, path, DIRMASK);
+	if (wd == -1) {
+		if (errno == ENOSPC && !limited) {
+			syslog(LOG_WARNING, "inotify watch limit reached, "
+			    "falling back to stat validation");
+			limited = true;
+		} else if (errno != ENOSPC && errno != ENOENT &&
+		    errno != EACCES)
+			syslog(LOG_ERR, "inotify_add_watch error: %m");
+		return;
+	}
+
+	struct dir *d = find_wd(wd);
+	if (d != NULL) {
+		if (strcmp(d->selector, selector) == 0)
+			return;
+		/* The directory has been moved. */
+		remove_watch(d);
+	}
+
+	d = malloc(sizeof(struct dir));
+	if (d == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		inotify_rm_watch(fd, wd);
+		return;
+	}
+	d->wd = wd;
+	d->selector = strdup(selector);
+	if (d->selector == NULL) {
+		syslog(LOG_ERR, "strdup error: %m");
+		inotify_rm_watch(fd, wd);
+		free(d);
+		return;
+	}
+
+	struct dir **pw = &wds[(unsigned)wd & (BUCKETS - 1)];
+	d->bywd = *pw;
+	*pw = d;
+
+	struct dir **ps = &selectors[hash(selector) & (BUCKETS - 1)];
+	d->bysel = *ps;
+	*ps = d;
+}
+
+static void
+remove_watch(struct dir *d)
+{
+	assert(d != NULL);
+
+	struct dir **pw = &wds[(unsigned)d->wd & (BUCKETS - 1)];
+	while (*pw != d)
+		pw = &(*pw)->bywd;
+	*pw = d->bywd;
+
+	struct dir **ps = &selectors[hash(d->selector) & (BUCKETS - 1)];
+	while (*ps != d)
+		ps = &(*ps)->bysel;
+	*ps = d->bysel;
+
+	free(d->selector);
+	free(d);
+}
+
+static struct dir *
+find_wd(int wd)
+{
+	struct dir *d = wds[(unsigned)wd & (BUCKETS - 1)];
+	while (d != NULL && d->wd != wd)
+		d = d->bywd;
+
+	return (d);
+}
+
+static struct dir *
+find_selector(const char *selector)
+{
+	assert(selector != NULL);
+
+	struct dir *d = selectors[hash(selector) & (BUCKETS - 1)];
+	while (d != NULL && strcmp(d->selector, selector) != 0)
+		d = d->bysel;
+
+	return (d);
+}
+
+static void
+unwatch_tree(const char *selector)
+{
+	assert(selector != NULL);
+
+	filecache_invalidate_tree(selector);
+
+	size_t l = strlen(selector);
+	for (size_t i = 0; i < BUCKETS; i++) {
+		struct dir *d = selectors[i];
+		while (d != NULL) {
+			struct dir *next = d->bysel;
+			if (strncmp(d->selector, selector, l) == 0 &&
+			    (d->selector[l] == '\0' || d->selector[l] == '/')) {
+				menucache_invalidate(d->selector);
+				inotify_rm_watch(fd, d->wd);
+				remove_watch(d);
+			}
+			d = next;
+		}
+	}
+}
+
+static void
+invalidate_tree(const char *selector)
+{
+	assert(selector != NULL);
+
+	size_t l = strlen(selector);
+	for (size_t i = 0; i < BUCKETS; i++)
+		for (struct dir *d = selectors[i]; d != NULL; d = d->bysel)
+			if (strncmp(d->selector, selector, l) == 0 &&
+			    (d->selector[l] == '\0' || d->selector[l] == '/'))
+				menucache_invalidate(d->selector);
+	menucache_invalidate(selector);
+	filecache_invalidate_tree(selector);
+}
+
+static char *
+child_selector(const char *parent, const char *name)
+{
+	assert(parent != NULL);
+	assert(name != NULL);
+
+	size_t pl = strlen(parent);
+	if (pl > 0 && parent[pl - 1] == '/')
+		pl--;
+
+	char *child = malloc(pl + strlen(name) + 2);
+	if (child == NULL) {
+		syslog(LOG_ERR, "malloc error: %m");
+		return (NULL);
+	}
+	memcpy(child, parent, pl);
+	child[pl] = '/';
+	strcpy(child + pl + 1, name);
+
+	return (child);
+}
+
+static uint32_t
+hash(const char *s)
+{
+	assert(s != NULL);
+
+	uint32_t h = 2166136261u;
+	for (const unsigned char *p = (const unsigned char *)s; *p != '\0';
+	    p++)
+		h = (h ^ *p) * 16777619u;
+
+	return (h);
+}
+
+#else /* !__linux__ */
+
+int
+watch_init(const char *root)
+{
+	(void)root;
+
+	return (-1);
+}
+
+void
+watch_process(void)
+{
+}
+
+bool
+watch_covers(const char *selector)
+{
+	(void)selector;
+
+	return (false);
+}
+
+#endif /* __linux__ */
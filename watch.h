@@ -0,0 +1,17 @@
+/*-
+ * "THE BEER-WARE LICENSE" (Revision 42):
+ * <tobias.rehbein@web.de> wrote this file. As long as you retain this notice
+ * you can do whatever you want with this stuff. If we meet some day, and you
+ * think this stuff is worth it, you can buy me a beer in return.
+ */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include <stdbool.h>
+
+int watch_init(const char *_root);
+void watch_process(void);
+bool watch_covers(const char *_selector);
+
+#endif /* !WATCH_H */